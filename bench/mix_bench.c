@@ -0,0 +1,69 @@
+/* times one party line tick, summing every speaker and making every listener's mix,
+   with each kernel and a growing line. build and run with `make mix_bench`. */
+
+#include "../src/mix.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// 20ms of mono audio at 48kHz, and the deadline of one tick
+#define FRAME_SAMPLES 960
+#define DEADLINE_MS 20.0
+#define ITERATIONS 2000
+
+static const unsigned line_sizes[] = {8, 16, 32, 64};
+
+static const char * const kernel_names[] = {"scalar", "sse2", "avx2", "neon"};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double run(unsigned members, const int16_t *frames, int16_t *out) {
+    int32_t acc[FRAME_SAMPLES];
+    double start = now_ms();
+    for (int i = 0; i < ITERATIONS; i++) {
+        memset(acc, 0, sizeof(acc));
+        for (unsigned m = 0; m < members; m++) {
+            mix_add(acc, frames + m * FRAME_SAMPLES, FRAME_SAMPLES);
+        }
+        for (unsigned m = 0; m < members; m++) {
+            mix_out(out + m * FRAME_SAMPLES, acc, frames + m * FRAME_SAMPLES, FRAME_SAMPLES);
+        }
+    }
+    return (now_ms() - start) / ITERATIONS;
+}
+
+int main(void) {
+    const unsigned most = line_sizes[sizeof(line_sizes)/sizeof(line_sizes[0]) - 1];
+    int16_t *frames = malloc(sizeof(int16_t) * FRAME_SAMPLES * most);
+    int16_t *out = malloc(sizeof(int16_t) * FRAME_SAMPLES * most);
+    if (frames == NULL || out == NULL) {
+        return 1;
+    }
+    // loud enough that a big line clips, so saturation is part of the work
+    for (size_t j = 0; j < (size_t) FRAME_SAMPLES * most; j++) {
+        frames[j] = (int16_t) ((j * 7919) % 20000 - 10000);
+    }
+
+    for (size_t i = 0; i < sizeof(line_sizes)/sizeof(line_sizes[0]); i++) {
+        printf("%u members:\n", line_sizes[i]);
+        for (size_t k = 0; k < sizeof(kernel_names)/sizeof(kernel_names[0]); k++) {
+            if (! mix_select(kernel_names[k])) {
+                continue;
+            }
+            double ms = run(line_sizes[i], frames, out);
+            printf("  %-8s %.4f ms/tick, %.3f%% of the %.0f ms deadline\n",
+                    kernel_names[k], ms, ms / DEADLINE_MS * 100, DEADLINE_MS);
+        }
+    }
+
+    free(frames);
+    free(out);
+    return 0;
+}
@@ -0,0 +1,81 @@
+/* compares the plane compaction kernels against the old memcpy-per-row loop.
+   build and run with `make plane_bench`. */
+
+#include "../src/plane_copy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PADDING 64
+#define ITERATIONS 500
+
+static const struct resolution {
+    const char * const name;
+    const size_t width;
+    const size_t height;
+} resolutions[] = {
+    {"480p",  640,  480},
+    {"720p",  1280, 720},
+    {"1080p", 1920, 1080},
+};
+
+static const char * const kernel_names[] = {"scalar", "sse2", "avx2", "neon"};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* the loop video_receive_frame used before the kernels existed. */
+static void old_loop(uint8_t *dst, const uint8_t *src, int32_t stride, size_t width, size_t rows) {
+    size_t stride_abs = (size_t) abs(stride);
+    for (size_t h = 0; h < rows; h++) {
+        memcpy(&dst[h * width], &src[h * stride_abs], width);
+    }
+}
+
+typedef void (*copy_fn)(uint8_t *, const uint8_t *, int32_t, size_t, size_t);
+
+static double run(copy_fn fn, uint8_t *dst, const uint8_t *top, int32_t stride, const struct resolution *r) {
+    double start = now_ms();
+    for (int i = 0; i < ITERATIONS; i++) {
+        fn(dst, top, stride, r->width, r->height);
+        fn(dst, top, stride, r->width / 2, r->height / 2);
+        fn(dst, top, stride, r->width / 2, r->height / 2);
+    }
+    return (now_ms() - start) / ITERATIONS;
+}
+
+int main(void) {
+    for (size_t i = 0; i < sizeof(resolutions)/sizeof(resolutions[0]); i++) {
+        const struct resolution *r = &resolutions[i];
+        const int32_t stride = (int32_t) (r->width + PADDING);
+        const size_t size = (size_t) stride * r->height;
+        uint8_t *src = aligned_alloc(64, size);
+        uint8_t *dst = aligned_alloc(64, r->width * r->height);
+        for (size_t j = 0; j < size; j++) {
+            src[j] = (uint8_t) (j * 31);
+        }
+
+        printf("%s (%zux%zu, stride %d):\n", r->name, r->width, r->height, stride);
+        printf("  %-8s padded %.4f ms/frame\n", "old", run(old_loop, dst, src, stride, r));
+
+        for (size_t k = 0; k < sizeof(kernel_names)/sizeof(kernel_names[0]); k++) {
+            if (! plane_copy_select(kernel_names[k])) {
+                continue;
+            }
+            double padded = run(plane_copy, dst, src, stride, r);
+            /* bottom-up: the top row is the last one in memory. */
+            double flipped = run(plane_copy, dst, src + size - (size_t) stride, -stride, r);
+            printf("  %-8s padded %.4f ms/frame, bottom-up %.4f ms/frame\n",
+                    kernel_names[k], padded, flipped);
+        }
+
+        free(src);
+        free(dst);
+    }
+    return 0;
+}
@@ -0,0 +1,635 @@
+/* a load test. a swarm of tox clients in this process befriends a freshly started mrprickles,
+   floods it with messages and calls it with synthetic audio and video, and reports how it holds up
+   as the number of clients ramps up. nothing leaves this machine: everyone bootstraps off a local node
+   on 127.0.0.1 and finds each other through local discovery.
+
+   build and run with `make bench`, or by hand:
+       bin/swarm [path to mrprickles] [max clients] [seconds per step] [av: 1 or 0] */
+
+#include <tox/tox.h>
+#include <tox/toxav.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define GCC_UNUSED __attribute__((unused))
+
+#define MAX_CLIENTS 64
+#define CONNECT_TIMEOUT_S 120
+#define WARMUP_S 3
+
+// messages each client keeps in flight, and how long before one counts as lost
+#define MESSAGE_WINDOW 4
+#define MESSAGE_TIMEOUT_NS 5000000000ull
+
+#define AUDIO_RATE 48000
+#define AUDIO_FRAME_MS 20
+#define AUDIO_SAMPLES (AUDIO_RATE / 1000 * AUDIO_FRAME_MS)
+#define AUDIO_BITRATE 48
+#define VIDEO_BITRATE 2000
+#define VIDEO_WIDTH 320
+#define VIDEO_HEIGHT 240
+#define VIDEO_FRAME_MS 33
+
+// video frames carry their sequence number as a row of black and white blocks, which survive the codec
+#define MARK_BITS 16
+#define MARK_BLOCK 16
+#define VIDEO_SLOTS 256
+
+struct samples {
+    uint64_t *values;
+    size_t count;
+    size_t capacity;
+};
+
+struct step_stats {
+    struct samples message_rtt;
+    struct samples video_rtt;
+    uint64_t messages_sent;
+    uint64_t messages_echoed;
+    uint64_t messages_lost;
+    uint64_t audio_sent;
+    uint64_t audio_echoed;
+    uint64_t video_sent;
+    uint64_t video_echoed;
+};
+
+struct in_flight {
+    uint32_t seq;
+    uint64_t sent_ns;
+    bool used;
+};
+
+struct client {
+    unsigned index;
+    Tox *tox;
+    ToxAV *av;
+    pthread_t thread;
+    uint32_t bot;
+    atomic_bool connected;
+
+    // only touched by the client's own thread
+    bool calling;
+    atomic_bool in_call;
+    uint32_t next_seq;
+    struct in_flight messages[MESSAGE_WINDOW];
+    uint64_t next_audio_ns;
+    uint64_t next_video_ns;
+    uint16_t video_seq;
+    uint64_t video_sent_ns[VIDEO_SLOTS];
+    int16_t *pcm;
+    uint8_t *frame;
+
+    pthread_mutex_t lock; // guards stats
+    struct step_stats stats;
+};
+
+static struct client clients[MAX_CLIENTS];
+static unsigned nclients = 0;
+static atomic_uint active_clients = 0;
+static atomic_bool stopping = false;
+static bool use_av = true;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void sleep_ms(unsigned ms) {
+    struct timespec ts = {ms / 1000, (long) (ms % 1000) * 1000000};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+static void add_sample(struct samples *s, uint64_t value) {
+    if (s->count == s->capacity) {
+        size_t capacity = s->capacity ? s->capacity * 2 : 1024;
+        uint64_t *values = realloc(s->values, capacity * sizeof(*values));
+        if (values == NULL) {
+            return;
+        }
+        s->values = values;
+        s->capacity = capacity;
+    }
+    s->values[s->count++] = value;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// in milliseconds; the samples must be sorted
+static double percentile(const struct samples *s, double q) {
+    if (s->count == 0) {
+        return 0;
+    }
+    size_t rank = (size_t) (q * (double) s->count + 0.999999);
+    rank = rank == 0 ? 0 : rank - 1;
+    if (rank >= s->count) {
+        rank = s->count - 1;
+    }
+    return (double) s->values[rank] / 1e6;
+}
+
+/* messages */
+
+static void send_messages(struct client *c, uint64_t now) {
+    for (unsigned i = 0; i < MESSAGE_WINDOW; i++) {
+        struct in_flight *m = &c->messages[i];
+        if (m->used && now - m->sent_ns > MESSAGE_TIMEOUT_NS) {
+            m->used = false;
+            pthread_mutex_lock(&c->lock);
+            c->stats.messages_lost++;
+            pthread_mutex_unlock(&c->lock);
+        }
+        if (m->used) {
+            continue;
+        }
+
+        // no letters up front, so the bot doesn't take it for a command and echoes it
+        char text[64];
+        const uint32_t seq = c->next_seq;
+        const int length = snprintf(text, sizeof(text), "#%u:%" PRIu32, c->index, seq);
+        TOX_ERR_FRIEND_SEND_MESSAGE err;
+        tox_friend_send_message(c->tox, c->bot, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t *) text,
+                (size_t) length, &err);
+        if (err != TOX_ERR_FRIEND_SEND_MESSAGE_OK) {
+            return;
+        }
+        c->next_seq++;
+        m->seq = seq;
+        m->sent_ns = now;
+        m->used = true;
+        pthread_mutex_lock(&c->lock);
+        c->stats.messages_sent++;
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+static void on_friend_message(GCC_UNUSED Tox *tox, GCC_UNUSED uint32_t friend_num,
+        GCC_UNUSED TOX_MESSAGE_TYPE type, const uint8_t *message, size_t length, void *user_data) {
+    struct client *c = user_data;
+    char text[64];
+    if (length >= sizeof(text)) {
+        return;
+    }
+    memcpy(text, message, length);
+    text[length] = '\0';
+
+    unsigned index;
+    uint32_t seq;
+    if (sscanf(text, "#%u:%" SCNu32, &index, &seq) != 2 || index != c->index) {
+        return;
+    }
+    const uint64_t now = now_ns();
+    for (unsigned i = 0; i < MESSAGE_WINDOW; i++) {
+        struct in_flight *m = &c->messages[i];
+        if (m->used && m->seq == seq) {
+            m->used = false;
+            pthread_mutex_lock(&c->lock);
+            c->stats.messages_echoed++;
+            add_sample(&c->stats.message_rtt, now - m->sent_ns);
+            pthread_mutex_unlock(&c->lock);
+            return;
+        }
+    }
+}
+
+static void on_friend_connection(GCC_UNUSED Tox *tox, uint32_t friend_num, TOX_CONNECTION status,
+        void *user_data) {
+    struct client *c = user_data;
+    if (friend_num == c->bot) {
+        atomic_store(&c->connected, status != TOX_CONNECTION_NONE);
+    }
+}
+
+/* audio and video */
+
+static void mark_frame(uint8_t *y, uint16_t seq) {
+    for (unsigned bit = 0; bit < MARK_BITS; bit++) {
+        const uint8_t shade = (seq >> bit) & 1 ? 235 : 16;
+        for (unsigned row = 0; row < MARK_BLOCK; row++) {
+            memset(y + row * VIDEO_WIDTH + bit * MARK_BLOCK, shade, MARK_BLOCK);
+        }
+    }
+}
+
+static uint16_t read_mark(const uint8_t *y, int32_t ystride) {
+    uint16_t seq = 0;
+    for (unsigned bit = 0; bit < MARK_BITS; bit++) {
+        // the middle of the block, away from the edges the codec smears
+        unsigned sum = 0;
+        for (unsigned row = MARK_BLOCK / 4; row < MARK_BLOCK * 3 / 4; row++) {
+            const uint8_t *p = y + (ptrdiff_t) row * ystride + bit * MARK_BLOCK + MARK_BLOCK / 4;
+            for (unsigned col = 0; col < MARK_BLOCK / 2; col++) {
+                sum += p[col];
+            }
+        }
+        if (sum / ((MARK_BLOCK / 2) * (MARK_BLOCK / 2)) > 128) {
+            seq |= (uint16_t) (1u << bit);
+        }
+    }
+    return seq;
+}
+
+static void send_av(struct client *c, uint64_t now) {
+    TOXAV_ERR_SEND_FRAME err;
+    if (now >= c->next_audio_ns) {
+        c->next_audio_ns = now + AUDIO_FRAME_MS * 1000000ull;
+        toxav_audio_send_frame(c->av, c->bot, c->pcm, AUDIO_SAMPLES, 1, AUDIO_RATE, &err);
+        if (err == TOXAV_ERR_SEND_FRAME_OK) {
+            pthread_mutex_lock(&c->lock);
+            c->stats.audio_sent++;
+            pthread_mutex_unlock(&c->lock);
+        }
+    }
+    if (now >= c->next_video_ns) {
+        c->next_video_ns = now + VIDEO_FRAME_MS * 1000000ull;
+        const uint16_t seq = c->video_seq++;
+        mark_frame(c->frame, seq);
+        const uint8_t *u = c->frame + VIDEO_WIDTH * VIDEO_HEIGHT;
+        const uint8_t *v = u + (VIDEO_WIDTH / 2) * (VIDEO_HEIGHT / 2);
+        c->video_sent_ns[seq % VIDEO_SLOTS] = now;
+        toxav_video_send_frame(c->av, c->bot, VIDEO_WIDTH, VIDEO_HEIGHT, c->frame, u, v, &err);
+        if (err == TOXAV_ERR_SEND_FRAME_OK) {
+            pthread_mutex_lock(&c->lock);
+            c->stats.video_sent++;
+            pthread_mutex_unlock(&c->lock);
+        }
+    }
+}
+
+static void on_call_state(GCC_UNUSED ToxAV *av, GCC_UNUSED uint32_t friend_num, uint32_t state,
+        void *user_data) {
+    struct client *c = user_data;
+    if (state & (TOXAV_FRIEND_CALL_STATE_FINISHED | TOXAV_FRIEND_CALL_STATE_ERROR)) {
+        atomic_store(&c->in_call, false);
+        c->calling = false;
+    } else {
+        atomic_store(&c->in_call, true);
+    }
+}
+
+static void on_audio_frame(GCC_UNUSED ToxAV *av, GCC_UNUSED uint32_t friend_num,
+        GCC_UNUSED const int16_t *pcm, GCC_UNUSED size_t sample_count,
+        GCC_UNUSED uint8_t channels, GCC_UNUSED uint32_t sampling_rate, void *user_data) {
+    struct client *c = user_data;
+    pthread_mutex_lock(&c->lock);
+    c->stats.audio_echoed++;
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void on_video_frame(GCC_UNUSED ToxAV *av, GCC_UNUSED uint32_t friend_num,
+        uint16_t width, uint16_t height, const uint8_t *y, GCC_UNUSED const uint8_t *u,
+        GCC_UNUSED const uint8_t *v, int32_t ystride, GCC_UNUSED int32_t ustride,
+        GCC_UNUSED int32_t vstride, void *user_data) {
+    struct client *c = user_data;
+    const uint64_t now = now_ns();
+    if (width < MARK_BITS * MARK_BLOCK || height < MARK_BLOCK) {
+        return;
+    }
+    const uint16_t seq = read_mark(y, ystride);
+    const uint64_t sent = c->video_sent_ns[seq % VIDEO_SLOTS];
+
+    pthread_mutex_lock(&c->lock);
+    c->stats.video_echoed++;
+    // a misread mark or a frame from long ago gives nonsense, so only keep plausible ones
+    if (sent != 0 && now > sent && now - sent < 10000000000ull) {
+        add_sample(&c->stats.video_rtt, now - sent);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* threads */
+
+static void * run_client(void *arg) {
+    struct client *c = arg;
+    while (! atomic_load(&stopping)) {
+        tox_iterate(c->tox, c);
+        toxav_iterate(c->av);
+
+        const uint64_t now = now_ns();
+        const bool active = c->index < atomic_load(&active_clients) && atomic_load(&c->connected);
+        if (active) {
+            send_messages(c, now);
+            if (use_av && ! c->calling) {
+                TOXAV_ERR_CALL err;
+                c->calling = toxav_call(c->av, c->bot, AUDIO_BITRATE, VIDEO_BITRATE, &err);
+            }
+            if (use_av && atomic_load(&c->in_call)) {
+                send_av(c, now);
+            }
+        } else if (c->calling) {
+            toxav_call_control(c->av, c->bot, TOXAV_CALL_CONTROL_CANCEL, NULL);
+            c->calling = false;
+            atomic_store(&c->in_call, false);
+        }
+
+        unsigned interval = tox_iteration_interval(c->tox);
+        const unsigned av_interval = toxav_iteration_interval(c->av);
+        if (av_interval < interval) {
+            interval = av_interval;
+        }
+        sleep_ms(interval < 5 ? interval : 5);
+    }
+    return NULL;
+}
+
+static void * run_node(void *arg) {
+    Tox *node = arg;
+    while (! atomic_load(&stopping)) {
+        tox_iterate(node, NULL);
+        sleep_ms(tox_iteration_interval(node));
+    }
+    return NULL;
+}
+
+static void * drain_pipe(void *arg) {
+    FILE *out = arg;
+    char line[512];
+    while (fgets(line, sizeof(line), out) != NULL) {
+    }
+    return NULL;
+}
+
+/* setup */
+
+static void to_hex(char *out, const uint8_t *in, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        sprintf(out + 2 * i, "%02X", in[i]);
+    }
+}
+
+static bool from_hex(uint8_t *out, const char *in, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        unsigned byte;
+        if (sscanf(in + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+        out[i] = (uint8_t) byte;
+    }
+    return true;
+}
+
+// starts the bot with its own home, waits for it to print its address
+static pid_t start_bot(const char *exe, const char *home, const char *bootstrap_node, uint8_t *address) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    const pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        char log_file[512];
+        snprintf(log_file, sizeof(log_file), "%s/mrprickles.log", home);
+        setenv("HOME", home, 1);
+        setenv("MRPRICKLES_BOOTSTRAP", bootstrap_node, 1);
+        setenv("MRPRICKLES_LOG_FILE", log_file, 1);
+        // measure the bot, not its rate limits
+        setenv("MRPRICKLES_LIMIT_MESSAGE", "0,1,0,1", 1);
+        setenv("MRPRICKLES_LIMIT_CALL", "0,1,0,1", 1);
+        setenv("MRPRICKLES_LIMIT_REQUEST", "0,1,0,1", 1);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl(exe, exe, (char *) NULL);
+        perror("could not start mrprickles");
+        _exit(127);
+    }
+    close(fds[1]);
+
+    FILE *out = fdopen(fds[0], "r");
+    char line[512];
+    while (fgets(line, sizeof(line), out) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strlen(line) == TOX_ADDRESS_SIZE * 2 && from_hex(address, line, TOX_ADDRESS_SIZE)) {
+            // keep reading whatever else it says so it never blocks on a full pipe
+            pthread_t drainer;
+            pthread_create(&drainer, NULL, drain_pipe, out);
+            pthread_detach(drainer);
+            return pid;
+        }
+    }
+    fclose(out);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static bool start_client(struct client *c, unsigned index, uint16_t node_port, const uint8_t *node_key,
+        const uint8_t *bot_address) {
+    memset(c, 0, sizeof(*c));
+    c->index = index;
+    pthread_mutex_init(&c->lock, NULL);
+
+    struct Tox_Options options;
+    tox_options_default(&options);
+    options.local_discovery_enabled = true;
+    options.start_port = 33445;
+    options.end_port = 34445;
+
+    TOX_ERR_NEW err;
+    c->tox = tox_new(&options, &err);
+    if (c->tox == NULL) {
+        fprintf(stderr, "client %u: tox_new failed: %d\n", index, err);
+        return false;
+    }
+    tox_bootstrap(c->tox, "127.0.0.1", node_port, node_key, NULL);
+
+    tox_callback_friend_message(c->tox, on_friend_message);
+    tox_callback_friend_connection_status(c->tox, on_friend_connection);
+
+    TOXAV_ERR_NEW av_err;
+    c->av = toxav_new(c->tox, &av_err);
+    if (c->av == NULL) {
+        fprintf(stderr, "client %u: toxav_new failed: %d\n", index, av_err);
+        return false;
+    }
+    toxav_callback_call_state(c->av, on_call_state, c);
+    toxav_callback_audio_receive_frame(c->av, on_audio_frame, c);
+    toxav_callback_video_receive_frame(c->av, on_video_frame, c);
+
+    const char *hello = "load test";
+    TOX_ERR_FRIEND_ADD add_err;
+    c->bot = tox_friend_add(c->tox, bot_address, (const uint8_t *) hello, strlen(hello), &add_err);
+    if (add_err != TOX_ERR_FRIEND_ADD_OK) {
+        fprintf(stderr, "client %u: could not add the bot: %d\n", index, add_err);
+        return false;
+    }
+
+    // a quiet tone and a grey frame
+    c->pcm = malloc(AUDIO_SAMPLES * sizeof(int16_t));
+    c->frame = malloc(VIDEO_WIDTH * VIDEO_HEIGHT * 3 / 2);
+    if (c->pcm == NULL || c->frame == NULL) {
+        return false;
+    }
+    for (unsigned i = 0; i < AUDIO_SAMPLES; i++) {
+        c->pcm[i] = (int16_t) ((i % 100) * 40 - 2000);
+    }
+    memset(c->frame, 128, VIDEO_WIDTH * VIDEO_HEIGHT * 3 / 2);
+
+    return pthread_create(&c->thread, NULL, run_client, c) == 0;
+}
+
+static void free_stats(struct step_stats *s) {
+    free(s->message_rtt.values);
+    free(s->video_rtt.values);
+    memset(s, 0, sizeof(*s));
+}
+
+static void merge_samples(struct samples *into, const struct samples *from) {
+    for (size_t i = 0; i < from->count; i++) {
+        add_sample(into, from->values[i]);
+    }
+}
+
+// take every client's numbers for the step that just ended and start over
+static void collect(struct step_stats *total) {
+    memset(total, 0, sizeof(*total));
+    for (unsigned i = 0; i < nclients; i++) {
+        struct client *c = &clients[i];
+        pthread_mutex_lock(&c->lock);
+        struct step_stats s = c->stats;
+        memset(&c->stats, 0, sizeof(c->stats));
+        pthread_mutex_unlock(&c->lock);
+
+        merge_samples(&total->message_rtt, &s.message_rtt);
+        merge_samples(&total->video_rtt, &s.video_rtt);
+        total->messages_sent += s.messages_sent;
+        total->messages_echoed += s.messages_echoed;
+        total->messages_lost += s.messages_lost;
+        total->audio_sent += s.audio_sent;
+        total->audio_echoed += s.audio_echoed;
+        total->video_sent += s.video_sent;
+        total->video_echoed += s.video_echoed;
+        free_stats(&s);
+    }
+    qsort(total->message_rtt.values, total->message_rtt.count, sizeof(uint64_t), compare_u64);
+    qsort(total->video_rtt.values, total->video_rtt.count, sizeof(uint64_t), compare_u64);
+}
+
+int main(int argc, char **argv) {
+    const char *exe = argc > 1 ? argv[1] : "bin/mrprickles";
+    unsigned max_clients = argc > 2 ? (unsigned) strtoul(argv[2], NULL, 10) : 16;
+    const unsigned step_seconds = argc > 3 ? (unsigned) strtoul(argv[3], NULL, 10) : 10;
+    use_av = argc > 4 ? atoi(argv[4]) != 0 : true;
+    if (max_clients == 0 || max_clients > MAX_CLIENTS) {
+        max_clients = MAX_CLIENTS;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char home[] = "/tmp/mrprickles-swarm-XXXXXX";
+    if (mkdtemp(home) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    /* the local node everybody bootstraps off. */
+    struct Tox_Options options;
+    tox_options_default(&options);
+    options.local_discovery_enabled = true;
+    Tox *node = tox_new(&options, NULL);
+    if (node == NULL) {
+        fprintf(stderr, "could not start the bootstrap node\n");
+        return EXIT_FAILURE;
+    }
+    uint8_t node_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_dht_id(node, node_key);
+    const uint16_t node_port = tox_self_get_udp_port(node, NULL);
+    pthread_t node_thread;
+    pthread_create(&node_thread, NULL, run_node, node);
+
+    char node_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    to_hex(node_hex, node_key, TOX_PUBLIC_KEY_SIZE);
+    char bootstrap_node[128];
+    snprintf(bootstrap_node, sizeof(bootstrap_node), "127.0.0.1:%u:%s", node_port, node_hex);
+
+    uint8_t bot_address[TOX_ADDRESS_SIZE];
+    const pid_t bot = start_bot(exe, home, bootstrap_node, bot_address);
+    if (bot < 0) {
+        fprintf(stderr, "could not start %s\n", exe);
+        return EXIT_FAILURE;
+    }
+    printf("bootstrap node on 127.0.0.1:%u, bot running with home %s\n", node_port, home);
+
+    /* everybody befriends the bot up front; the steps only change how many of them are busy. */
+    for (; nclients < max_clients; nclients++) {
+        if (! start_client(&clients[nclients], nclients, node_port, node_key, bot_address)) {
+            break;
+        }
+    }
+    printf("waiting for %u clients to connect to the bot...\n", nclients);
+    fflush(stdout);
+    const uint64_t connect_start = now_ns();
+    unsigned connected = 0;
+    while (connected < nclients && now_ns() - connect_start < CONNECT_TIMEOUT_S * 1000000000ull) {
+        sleep_ms(200);
+        connected = 0;
+        for (unsigned i = 0; i < nclients; i++) {
+            connected += atomic_load(&clients[i].connected);
+        }
+    }
+    printf("%u of %u clients connected after %.1f s\n\n", connected, nclients,
+            (double) (now_ns() - connect_start) / 1e9);
+
+    printf("%7s %9s %9s %9s %9s %6s | %9s %9s %9s %9s | %9s %9s\n", "clients", "msg/s", "rtt p50", "rtt p90",
+            "rtt p99", "lost", "video/s", "echoed/s", "echo p50", "echo p99", "audio/s", "echoed/s");
+    // 1, 2, 4... clients, finishing with all of them
+    for (unsigned step = 1; connected > 0; step = step * 2 < connected ? step * 2 : connected) {
+        atomic_store(&active_clients, step);
+        sleep_ms(WARMUP_S * 1000);
+        struct step_stats s;
+        collect(&s);
+        free_stats(&s);
+
+        const uint64_t start = now_ns();
+        sleep_ms(step_seconds * 1000);
+        collect(&s);
+        const double seconds = (double) (now_ns() - start) / 1e9;
+
+        printf("%7u %9.1f %7.2fms %7.2fms %7.2fms %6" PRIu64 " | %9.1f %9.1f %7.2fms %7.2fms | %9.1f %9.1f\n",
+                step, s.messages_echoed / seconds, percentile(&s.message_rtt, 0.5), percentile(&s.message_rtt, 0.9),
+                percentile(&s.message_rtt, 0.99), s.messages_lost, s.video_sent / seconds,
+                s.video_echoed / seconds, percentile(&s.video_rtt, 0.5), percentile(&s.video_rtt, 0.99),
+                s.audio_sent / seconds, s.audio_echoed / seconds);
+        fflush(stdout);
+        free_stats(&s);
+
+        if (step == connected) {
+            break;
+        }
+    }
+
+    atomic_store(&active_clients, 0);
+    sleep_ms(1000);
+    atomic_store(&stopping, true);
+    for (unsigned i = 0; i < nclients; i++) {
+        pthread_join(clients[i].thread, NULL);
+        toxav_kill(clients[i].av);
+        tox_kill(clients[i].tox);
+        free(clients[i].pcm);
+        free(clients[i].frame);
+        free_stats(&clients[i].stats);
+    }
+    pthread_join(node_thread, NULL);
+    tox_kill(node);
+
+    kill(bot, SIGTERM);
+    waitpid(bot, NULL, 0);
+    printf("\nthe bot's log is in %s\n", home);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,46 @@
+#include "admin.h"
+
+#include "globals.h"
+#include "util.h"
+
+#include <sodium/utils.h>
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// written once, by main before the threads start or by shard 0's tox thread, then only read
+static uint8_t admin_key[TOX_PUBLIC_KEY_SIZE];
+static atomic_bool admin_known = false;
+
+void admin_init(void) {
+    const char *key_hex = getenv("MRPRICKLES_ADMIN");
+    if (key_hex == NULL) {
+        return;
+    }
+    size_t length;
+    if (sodium_hex2bin(admin_key, sizeof(admin_key), key_hex, strlen(key_hex), NULL, &length, NULL) != 0
+            || length != sizeof(admin_key)) {
+        logger("ignoring MRPRICKLES_ADMIN, it should be a public key in hex");
+        return;
+    }
+    atomic_store(&admin_known, true);
+}
+
+void admin_friend_added(Tox *tox, uint32_t friend_num) {
+    if (shard_current()->index != 0 || friend_num != 0 || atomic_load(&admin_known)) {
+        return;
+    }
+    if (tox_friend_get_public_key(tox, friend_num, admin_key, NULL)) {
+        atomic_store(&admin_known, true);
+    }
+}
+
+bool admin_is(Tox *tox, uint32_t friend_num) {
+    if (! atomic_load(&admin_known)) {
+        return false;
+    }
+    uint8_t key[TOX_PUBLIC_KEY_SIZE];
+    return tox_friend_get_public_key(tox, friend_num, key, NULL)
+        && memcmp(key, admin_key, sizeof(key)) == 0;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <tox/tox.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* the admin is one person for the whole process, not one per shard: the public key in
+   MRPRICKLES_ADMIN, or else friend 0 of shard 0, whoever first added the original profile.
+   friend 0 of any other shard is only whoever found that shard's id first. */
+
+// read MRPRICKLES_ADMIN. call before the tox threads start.
+void admin_init(void);
+
+// a friend was added, or loaded. if it's shard 0's friend 0 and no admin is known yet, it's them.
+void admin_friend_added(Tox *tox, uint32_t friend_num);
+
+// tox thread
+bool admin_is(Tox *tox, uint32_t friend_num);
@@ -1,14 +1,36 @@
 #include "av_callbacks.h"
 
+#include "av_workers.h"
+#include "bitrate.h"
+#include "calls.h"
+#include "cmdqueue.h"
+#include "friends.h"
 #include "globals.h"
+#include "metrics.h"
+#include "party.h"
+#include "plane_copy.h"
+#include "shutdown.h"
 #include "util.h"
 
-#include <string.h>
 #include <stdlib.h>
+#include <string.h>
+
+static void hang_up(uint32_t friend_num, GCC_UNUSED struct call_ctx *ctx, void *arg) {
+    toxav_call_control((ToxAV *) arg, friend_num, TOXAV_CALL_CONTROL_CANCEL, NULL);
+    call_ctx_release(friend_num);
+}
+
+void hang_up_all(ToxAV *toxAV) {
+    calls_for_each(hang_up, toxAV);
+}
 
 void call(ToxAV *toxAV, uint32_t friend_num, bool audio_enabled, bool video_enabled, GCC_UNUSED void *user_data) {
-    uint8_t * friend_name;
-    friend_name_from_num(&friend_name, toxav_get_tox(toxAV), friend_num);
+    if (shutdown_draining()) {
+        toxav_call_control(toxAV, friend_num, TOXAV_CALL_CONTROL_CANCEL, NULL);
+        return;
+    }
+    char friend_name[TOX_MAX_NAME_LENGTH + 1];
+    friend_copy_name(friend_num, friend_name, sizeof(friend_name));
     TOXAV_ERR_ANSWER err;
     toxav_answer(toxAV, friend_num, audio_enabled ? audio_bitrate : 0,
             video_enabled ? video_bitrate : 0, &err);
@@ -18,96 +40,136 @@ void call(ToxAV *toxAV, uint32_t friend_num, bool audio_enabled, bool video_enab
     } else {
         logger("could not answer call, friend: %u (%s), error: %d",
                 friend_num, friend_name, err);
+        const char *msg = "sorry, i couldn't pick up.";
+        post_message(friend_num, msg, strlen(msg));
+    }
+}
+
+/* msi reports this from inside tox_iterate, while the call tables belong to the toxav thread. */
+void call_state(GCC_UNUSED ToxAV *toxAV, uint32_t friend_num, uint32_t state, GCC_UNUSED void *user_data) {
+    if (! post_call_state(friend_num, state)) {
+        logger("lost a call state change for friend %u: %u", friend_num, state);
     }
-    free(friend_name);
 }
 
-void call_state(ToxAV *toxAV, uint32_t friend_num, uint32_t state, GCC_UNUSED void *user_data) {
-    uint8_t * friend_name;
-    friend_name_from_num(&friend_name, toxav_get_tox(toxAV), friend_num);
+void call_state_changed(ToxAV *toxAV, uint32_t friend_num, uint32_t state) {
+    char friend_name[TOX_MAX_NAME_LENGTH + 1];
+    friend_copy_name(friend_num, friend_name, sizeof(friend_name));
     if (state & TOXAV_FRIEND_CALL_STATE_FINISHED) {
         logger("call with friend %u (%s) finished", friend_num, friend_name);
+        call_ctx_release(friend_num);
         return;
     } else if (state & TOXAV_FRIEND_CALL_STATE_ERROR) {
         logger("call with friend %u (%s) errored", friend_num, friend_name);
+        call_ctx_release(friend_num);
         return;
     }
 
     bool send_audio = (state & TOXAV_FRIEND_CALL_STATE_SENDING_A)
         && (state & TOXAV_FRIEND_CALL_STATE_ACCEPTING_A);
-    bool send_video = state & TOXAV_FRIEND_CALL_STATE_SENDING_V
+    bool send_video = (state & TOXAV_FRIEND_CALL_STATE_SENDING_V)
         && (state & TOXAV_FRIEND_CALL_STATE_ACCEPTING_V);
 
-    TOXAV_ERR_BIT_RATE_SET audio_err;
-    TOXAV_ERR_BIT_RATE_SET video_err;
-    toxav_audio_set_bit_rate(toxAV, friend_num, send_audio ? audio_bitrate : 0,
-                             &audio_err);
-    if (audio_err != TOXAV_ERR_BIT_RATE_SET_OK) {
-        logger("audio bit rate failed to set.");
+    struct call_ctx *ctx = call_ctx_get(friend_num);
+    if (ctx == NULL) {
+        log_ratelimited(1000, LOG_ERROR, "oh no, couldn't allocate memory.");
+        return;
     }
-    toxav_video_set_bit_rate(toxAV, friend_num, send_audio ? video_bitrate : 0,
-                             &video_err);
-    if (audio_err != TOXAV_ERR_BIT_RATE_SET_OK) {
-        logger("video bit rate failed to set.");
+    bitrate_set_sending(toxAV, friend_num, ctx, send_audio, send_video);
+    if (ctx->party && send_audio && ctx->party_slot == 0 && ! party_join(toxAV, friend_num, ctx)) {
+        const char *msg = "the party line is full.";
+        post_message(friend_num, msg, strlen(msg));
+        ctx->party = false;
     }
 
     logger("call state for friend %u (%s) changed to %u: audio: %d, video: %d",
             friend_num, friend_name, state, send_audio, send_video);
-    free(friend_name);
+}
+
+/* toxav thinks the link is saturated. this may come from the tox thread, so hand it over. */
+void audio_bit_rate(GCC_UNUSED ToxAV *toxAV, uint32_t friend_num, uint32_t bit_rate, GCC_UNUSED void *user_data) {
+    post_audio_bit_rate(friend_num, bit_rate);
+}
+
+void video_bit_rate(GCC_UNUSED ToxAV *toxAV, uint32_t friend_num, uint32_t bit_rate, GCC_UNUSED void *user_data) {
+    post_video_bit_rate(friend_num, bit_rate);
 }
 
 void audio_receive_frame(ToxAV *toxAV, uint32_t friend_num, const int16_t *pcm, size_t sample_count,
                         uint8_t channels, uint32_t sampling_rate, GCC_UNUSED void *user_data) {
-    TOXAV_ERR_SEND_FRAME err;
-    toxav_audio_send_frame(toxAV, friend_num, pcm, sample_count, channels,
-            sampling_rate, &err);
-
-    if (err != TOXAV_ERR_SEND_FRAME_OK) {
-        logger("could not send audio frame to friend: %u, error: %d",
-                friend_num, err);
+    const uint64_t start = monotonic_ns();
+    struct call_ctx *ctx = call_ctx_get(friend_num);
+    if (ctx != NULL && ctx->party_slot != 0) {
+        // party line members aren't echoed, the mixer sends them everyone else
+        party_push(ctx, pcm, sample_count, channels, sampling_rate);
+        metrics_record(METRIC_AUDIO_RECEIVE_NS, monotonic_ns() - start);
+        return;
+    }
+    if (ctx != NULL && ! ctx->sending_audio) {
+        return; // they aren't taking audio, every send would fail
+    }
+    const size_t size = sample_count * channels * sizeof(int16_t);
+    struct av_job *job = ctx ? av_job_get(ctx->worker, size) : NULL;
+    if (job == NULL) {
+        log_ratelimited(1000, LOG_ERROR, "oh no, couldn't allocate memory.");
+        return;
     }
+
+    job->kind = AV_JOB_AUDIO;
+    job->toxav = toxAV;
+    job->friend_num = friend_num;
+    job->call = ctx;
+    job->sample_count = sample_count;
+    job->channels = channels;
+    job->sampling_rate = sampling_rate;
+    memcpy(job->data, pcm, size);
+    av_job_submit(ctx->worker, job);
+    metrics_record(METRIC_AUDIO_RECEIVE_NS, monotonic_ns() - start);
 }
 
 void video_receive_frame(ToxAV *toxAV, uint32_t friend_num, uint16_t width, uint16_t height,
                         const uint8_t *y, const uint8_t *u, const uint8_t *v,
                         const int32_t ystride, const int32_t ustride, const int32_t vstride,
                         GCC_UNUSED void *user_data) {
+    const uint64_t start = monotonic_ns();
     uint32_t ystride_abs = (uint32_t) abs(ystride);
     uint32_t ustride_abs = (uint32_t) abs(ustride);
     uint32_t vstride_abs = (uint32_t) abs(vstride);
 
     if (ystride_abs < width || ustride_abs < width / 2 || vstride_abs < width / 2) {
-        logger("wtf");
+        log_ratelimited(1000, LOG_WARN, "friend %u sent a frame with impossible strides", friend_num);
         return;
     }
 
     if (height == 0) {
-        logger("height of frame should not be zero.");
+        log_ratelimited(1000, LOG_WARN, "height of frame should not be zero.");
         return;
     }
-    uint8_t *y_dest = calloc(width, height);
-    uint8_t *u_dest = calloc(width, height / 2);
-    uint8_t *v_dest = calloc(width, height / 2);
 
-    for (size_t h = 0; h < height; h++) {
-        memcpy(&y_dest[h * width], &y[h * ystride_abs], width);
+    const size_t luma_size = (size_t) width * height;
+    const size_t chroma_size = (size_t) (width / 2) * (height / 2);
+    struct call_ctx *ctx = call_ctx_get(friend_num);
+    if (ctx != NULL && ! ctx->sending_video) {
+        return; // they aren't taking video, every send would fail
     }
-
-    for (size_t h = 0; h < height / 2; h++) {
-        memcpy(&u_dest[h * width / 2], &u[h * ustride_abs], width / 2);
-        memcpy(&v_dest[h * width / 2], &v[h * vstride_abs], width / 2);
+    struct av_job *job = ctx ? av_job_get(ctx->worker, luma_size + 2 * chroma_size) : NULL;
+    if (job == NULL) {
+        log_ratelimited(1000, LOG_ERROR, "oh no, couldn't allocate memory.");
+        return;
     }
 
-    TOXAV_ERR_SEND_FRAME err;
-    toxav_video_send_frame(toxAV, friend_num, width, height, y_dest,
-            u_dest, v_dest, &err);
-
-    free(y_dest);
-    free(u_dest);
-    free(v_dest);
-
-    if (err != TOXAV_ERR_SEND_FRAME_OK) {
-        logger("could not send video frame to friend: %u, error: %d",
-                friend_num, err);
-    }
+    /* the source planes only live until we return, so compact them into the job.
+       packed planes are a single copy each, negative strides mean bottom-up. */
+    plane_copy(job->data, y, ystride, width, height);
+    plane_copy(job->data + luma_size, u, ustride, width / 2, height / 2);
+    plane_copy(job->data + luma_size + chroma_size, v, vstride, width / 2, height / 2);
+
+    job->kind = AV_JOB_VIDEO;
+    job->toxav = toxAV;
+    job->friend_num = friend_num;
+    job->call = ctx;
+    job->width = width;
+    job->height = height;
+    av_job_submit(ctx->worker, job);
+    metrics_record(METRIC_VIDEO_RECEIVE_NS, monotonic_ns() - start);
 }
@@ -4,9 +4,18 @@
 
 #include <tox/toxav.h>
 
+// shutting down. toxav thread.
+void hang_up_all(ToxAV *toxAV);
+
 void call(ToxAV *toxAV, uint32_t friend_num, bool audio_enabled, bool video_enabled, GCC_UNUSED void *user_data);
 
 void call_state(ToxAV *toxAV, uint32_t friend_num, uint32_t state, GCC_UNUSED void *user_data);
+// what call_state posted, on the toxav thread
+void call_state_changed(ToxAV *toxAV, uint32_t friend_num, uint32_t state);
+
+void audio_bit_rate(ToxAV *toxAV, uint32_t friend_num, uint32_t bit_rate, GCC_UNUSED void *user_data);
+
+void video_bit_rate(ToxAV *toxAV, uint32_t friend_num, uint32_t bit_rate, GCC_UNUSED void *user_data);
 
 void audio_receive_frame(ToxAV *toxAV, uint32_t friend_num,
                         const int16_t *pcm, size_t sample_count,
@@ -0,0 +1,319 @@
+#include "av_workers.h"
+
+#include "metrics.h"
+#include "shard.h"
+#include "util.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_WORKERS 64
+// recycled jobs kept around per worker, anything beyond this is freed
+#define MAX_FREE_JOBS 32
+
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct av_job *head;
+    struct av_job *tail;
+    size_t depth;
+    struct av_job *free_jobs;
+    size_t nfree;
+    unsigned ncalls;
+    bool stopping;
+};
+
+static struct worker * workers = NULL;
+static unsigned nworkers = 0;
+static pthread_mutex_t assign_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void send_job(struct av_job *job) {
+    TOXAV_ERR_SEND_FRAME err;
+    if (job->kind == AV_JOB_AUDIO) {
+        toxav_audio_send_frame(job->toxav, job->friend_num, (const int16_t *) job->data,
+                job->sample_count, job->channels, job->sampling_rate, &err);
+        if (err == TOXAV_ERR_SEND_FRAME_OK) {
+            const size_t bytes = job->sample_count * job->channels * sizeof(int16_t);
+            atomic_fetch_add(&job->call->audio_sent, 1);
+            atomic_fetch_add(&job->call->audio_bytes, bytes);
+            metrics_add(METRIC_AUDIO_FRAMES_SENT, 1);
+            metrics_add(METRIC_AUDIO_BYTES_SENT, bytes);
+        }
+    } else {
+        assert (job->kind == AV_JOB_VIDEO);
+        const size_t luma_size = (size_t) job->width * job->height;
+        const size_t chroma_size = (size_t) (job->width / 2) * (job->height / 2);
+        const uint8_t *y = job->data;
+        const uint8_t *u = y + luma_size;
+        const uint8_t *v = u + chroma_size;
+        toxav_video_send_frame(job->toxav, job->friend_num, job->width, job->height,
+                y, u, v, &err);
+        if (err == TOXAV_ERR_SEND_FRAME_OK) {
+            const size_t bytes = luma_size + 2 * chroma_size;
+            atomic_fetch_add(&job->call->video_sent, 1);
+            atomic_fetch_add(&job->call->video_bytes, bytes);
+            metrics_add(METRIC_VIDEO_FRAMES_SENT, 1);
+            metrics_add(METRIC_VIDEO_BYTES_SENT, bytes);
+        }
+    }
+
+    if (err != TOXAV_ERR_SEND_FRAME_OK) {
+        atomic_fetch_add(&job->call->send_errors, 1);
+        if (err == TOXAV_ERR_SEND_FRAME_RTP_FAILED) {
+            atomic_fetch_add(&job->call->congestion_errors, 1);
+        }
+        metrics_add(METRIC_SEND_ERRORS, 1);
+        /* a congested call fails every frame, so only say so when something changes. */
+        if (atomic_exchange(&job->call->last_error, (int) err) != (int) err) {
+            log_ratelimited(1000, LOG_WARN, "could not send %s frame to friend: %u, error: %d",
+                    job->kind == AV_JOB_AUDIO ? "audio" : "video", job->friend_num, err);
+        }
+    } else {
+        atomic_store(&job->call->last_error, (int) TOXAV_ERR_SEND_FRAME_OK);
+    }
+}
+
+static void recycle_job(struct worker *worker, struct av_job *job) {
+    if (worker->nfree < MAX_FREE_JOBS) {
+        job->next = worker->free_jobs;
+        worker->free_jobs = job;
+        worker->nfree++;
+    } else {
+        free(job->data);
+        free(job);
+    }
+}
+
+static void * run_worker(void * arg) {
+    struct worker * worker = arg;
+
+    pthread_mutex_lock(&worker->lock);
+    while (true) {
+        while (worker->head == NULL && ! worker->stopping) {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+        if (worker->stopping) {
+            break;
+        }
+
+        struct av_job *job = worker->head;
+        worker->head = job->next;
+        if (worker->head == NULL) {
+            worker->tail = NULL;
+        }
+        worker->depth--;
+        if (job->kind == AV_JOB_VIDEO) {
+            atomic_fetch_sub(&job->call->queued_video, 1);
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        if (job->kind == AV_JOB_VIDEO
+                && monotonic_ns() - job->received_ns > AV_VIDEO_STALE_MS * 1000000u) {
+            atomic_fetch_add(&job->call->video_dropped, 1);
+            metrics_add(METRIC_VIDEO_FRAMES_DROPPED, 1);
+        } else {
+            send_job(job);
+        }
+
+        pthread_mutex_lock(&worker->lock);
+        recycle_job(worker, job);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+bool av_workers_start(unsigned count) {
+    assert (workers == NULL);
+    if (count == 0) {
+        // with no core to spare the workers squeeze in with the shard threads
+        long ncpus = shard_spare_cpus();
+        if (ncpus == 0) {
+            ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        count = ncpus < 1 ? 1 : (unsigned) ncpus;
+    }
+    if (count > MAX_WORKERS) {
+        count = MAX_WORKERS;
+    }
+
+    workers = calloc(count, sizeof(struct worker));
+    if (workers == NULL) {
+        return false;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        struct worker *worker = &workers[i];
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        if (pthread_create(&worker->thread, NULL, &run_worker, worker) != 0) {
+            logger("could not start av worker %u", i);
+            pthread_cond_destroy(&worker->cond);
+            pthread_mutex_destroy(&worker->lock);
+            break;
+        }
+
+        if (! shard_pin_spare(worker->thread, i)) {
+            logger("could not pin av worker %u to a core", i);
+        }
+        nworkers++;
+    }
+
+    if (nworkers == 0) {
+        free(workers);
+        workers = NULL;
+        return false;
+    }
+    logger("started %u av workers", nworkers);
+    return true;
+}
+
+static void free_jobs(struct av_job *job) {
+    while (job != NULL) {
+        struct av_job *next = job->next;
+        free(job->data);
+        free(job);
+        job = next;
+    }
+}
+
+void av_workers_stop(void) {
+    for (unsigned i = 0; i < nworkers; i++) {
+        pthread_mutex_lock(&workers[i].lock);
+        workers[i].stopping = true;
+        pthread_cond_signal(&workers[i].cond);
+        pthread_mutex_unlock(&workers[i].lock);
+    }
+
+    for (unsigned i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        free_jobs(workers[i].head);
+        free_jobs(workers[i].free_jobs);
+        pthread_cond_destroy(&workers[i].cond);
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+}
+
+unsigned av_workers_assign(void) {
+    assert (nworkers > 0);
+    pthread_mutex_lock(&assign_lock);
+    unsigned best = 0;
+    for (unsigned i = 1; i < nworkers; i++) {
+        if (workers[i].ncalls < workers[best].ncalls) {
+            best = i;
+        }
+    }
+    workers[best].ncalls++;
+    pthread_mutex_unlock(&assign_lock);
+    return best;
+}
+
+void av_workers_unassign(unsigned worker) {
+    assert (worker < nworkers);
+    pthread_mutex_lock(&assign_lock);
+    assert (workers[worker].ncalls > 0);
+    workers[worker].ncalls--;
+    pthread_mutex_unlock(&assign_lock);
+}
+
+struct av_job * av_job_get(unsigned worker_num, size_t size) {
+    assert (worker_num < nworkers);
+    struct worker *worker = &workers[worker_num];
+
+    pthread_mutex_lock(&worker->lock);
+    struct av_job *job = worker->free_jobs;
+    if (job != NULL) {
+        worker->free_jobs = job->next;
+        worker->nfree--;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    if (job == NULL) {
+        job = calloc(1, sizeof(struct av_job));
+        if (job == NULL) {
+            return NULL;
+        }
+    }
+
+    if (job->capacity < size) {
+        uint8_t *data = realloc(job->data, size);
+        if (data == NULL) {
+            free(job->data);
+            free(job);
+            return NULL;
+        }
+        job->data = data;
+        job->capacity = size;
+    }
+
+    job->next = NULL;
+    return job;
+}
+
+/* unlink the oldest queued video job, of the given call or of any call if call is NULL.
+   the worker must be locked. */
+static bool drop_oldest_video(struct worker *worker, const struct call_ctx *call) {
+    struct av_job *prev = NULL;
+    for (struct av_job *job = worker->head; job != NULL; prev = job, job = job->next) {
+        if (job->kind != AV_JOB_VIDEO || (call != NULL && job->call != call)) {
+            continue;
+        }
+
+        if (prev == NULL) {
+            worker->head = job->next;
+        } else {
+            prev->next = job->next;
+        }
+        if (worker->tail == job) {
+            worker->tail = prev;
+        }
+        worker->depth--;
+        atomic_fetch_sub(&job->call->queued_video, 1);
+        atomic_fetch_add(&job->call->video_dropped, 1);
+        metrics_add(METRIC_VIDEO_FRAMES_DROPPED, 1);
+        recycle_job(worker, job);
+        return true;
+    }
+    return false;
+}
+
+void av_job_submit(unsigned worker_num, struct av_job *job) {
+    assert (worker_num < nworkers);
+    assert (job->call != NULL);
+    struct worker *worker = &workers[worker_num];
+    job->received_ns = monotonic_ns();
+
+    pthread_mutex_lock(&worker->lock);
+    if (job->kind == AV_JOB_VIDEO) {
+        /* skip ahead to the newest frames rather than falling further behind. */
+        if (atomic_load(&job->call->queued_video) >= AV_VIDEO_QUEUE_DEPTH) {
+            drop_oldest_video(worker, job->call);
+        }
+        if (worker->depth >= AV_WORKER_QUEUE_DEPTH && ! drop_oldest_video(worker, NULL)) {
+            /* the queue is all audio, which matters more than this frame. */
+            atomic_fetch_add(&job->call->video_dropped, 1);
+            metrics_add(METRIC_VIDEO_FRAMES_DROPPED, 1);
+            recycle_job(worker, job);
+            pthread_mutex_unlock(&worker->lock);
+            return;
+        }
+        atomic_fetch_add(&job->call->queued_video, 1);
+    }
+
+    job->next = NULL;
+    if (worker->tail == NULL) {
+        worker->head = job;
+    } else {
+        worker->tail->next = job;
+    }
+    worker->tail = job;
+    worker->depth++;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
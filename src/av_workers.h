@@ -0,0 +1,68 @@
+#pragma once
+
+#include "calls.h"
+
+#include <tox/toxav.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* received frames are copied into a job on the toxav thread and echoed back by a worker.
+   every call is assigned to one worker, each worker is a thread pinned to a core the shard
+   threads leave spare (see shard.h), so a call's frames stay in order while different calls
+   are encoded in parallel.
+
+   when a worker falls behind, video gives way: only the newest few frames of a call are kept,
+   frames that waited too long are dropped, and a full queue sheds its oldest video frame.
+   audio is never dropped. */
+
+// video frames of one call that may wait in a queue
+#define AV_VIDEO_QUEUE_DEPTH 2
+// jobs a worker holds before it starts shedding video
+#define AV_WORKER_QUEUE_DEPTH 64
+// video older than this by the time a worker gets to it is not worth sending
+#define AV_VIDEO_STALE_MS 100
+
+enum av_job_kind {
+    AV_JOB_AUDIO,
+    AV_JOB_VIDEO,
+};
+
+struct av_job {
+    struct av_job *next;
+    enum av_job_kind kind;
+    ToxAV *toxav;
+    uint32_t friend_num;
+    struct call_ctx *call;
+    uint64_t received_ns;
+
+    // video: the y, u and v planes back to back
+    uint16_t width;
+    uint16_t height;
+
+    // audio: interleaved pcm
+    size_t sample_count;
+    uint8_t channels;
+    uint32_t sampling_rate;
+
+    uint8_t *data;
+    size_t capacity;
+};
+
+// count of 0 means one worker per spare core, see shard.h
+bool av_workers_start(unsigned count);
+
+// must be called before toxav_kill. jobs still queued are dropped.
+void av_workers_stop(void);
+
+// the worker with the fewest calls, which the caller now counts as one of its calls
+unsigned av_workers_assign(void);
+
+void av_workers_unassign(unsigned worker);
+
+// a recycled job with room for at least size bytes of data, or NULL if out of memory
+struct av_job * av_job_get(unsigned worker, size_t size);
+
+// job->call and job->kind must be set
+void av_job_submit(unsigned worker, struct av_job *job);
@@ -0,0 +1,136 @@
+#include "bitrate.h"
+
+#include "globals.h"
+#include "util.h"
+
+static uint32_t clamp(uint32_t rate, uint32_t min, uint32_t max) {
+    return rate < min ? min : rate > max ? max : rate;
+}
+
+static void apply_audio(ToxAV *toxAV, uint32_t friend_num, uint32_t rate) {
+    TOXAV_ERR_BIT_RATE_SET err;
+    toxav_audio_set_bit_rate(toxAV, friend_num, rate, &err);
+    if (err != TOXAV_ERR_BIT_RATE_SET_OK) {
+        log_ratelimited(1000, LOG_WARN, "audio bit rate failed to set, friend: %u, error: %d", friend_num, err);
+    }
+}
+
+static void apply_video(ToxAV *toxAV, uint32_t friend_num, uint32_t rate) {
+    TOXAV_ERR_BIT_RATE_SET err;
+    toxav_video_set_bit_rate(toxAV, friend_num, rate, &err);
+    if (err != TOXAV_ERR_BIT_RATE_SET_OK) {
+        log_ratelimited(1000, LOG_WARN, "video bit rate failed to set, friend: %u, error: %d", friend_num, err);
+    }
+}
+
+void bitrate_reset(struct call_ctx *ctx) {
+    atomic_store(&ctx->audio_rate, audio_bitrate);
+    atomic_store(&ctx->video_rate, video_bitrate);
+    atomic_store(&ctx->rate_cuts, 0);
+    ctx->sending_audio = false;
+    ctx->sending_video = false;
+    ctx->rate_checked_ns = monotonic_ns();
+    ctx->rate_cut_ns = ctx->rate_checked_ns; // hold the starting rates for a bit
+    ctx->congestion_seen = 0;
+    ctx->dropped_seen = 0;
+    ctx->video_seen = 0;
+}
+
+void bitrate_set_sending(ToxAV *toxAV, uint32_t friend_num, struct call_ctx *ctx, bool audio, bool video) {
+    ctx->sending_audio = audio;
+    ctx->sending_video = video;
+    apply_audio(toxAV, friend_num, audio ? atomic_load(&ctx->audio_rate) : 0);
+    apply_video(toxAV, friend_num, video ? atomic_load(&ctx->video_rate) : 0);
+}
+
+// cut one direction, video first. nothing happens if both are as low as they go.
+static void cut(ToxAV *toxAV, uint32_t friend_num, struct call_ctx *ctx, const char *why) {
+    const uint32_t video = atomic_load(&ctx->video_rate);
+    const uint32_t audio = atomic_load(&ctx->audio_rate);
+    if (ctx->sending_video && video > video_bitrate_min) {
+        const uint32_t rate = clamp(video * BITRATE_DECREASE_PERCENT / 100, video_bitrate_min, video_bitrate_max);
+        atomic_store(&ctx->video_rate, rate);
+        apply_video(toxAV, friend_num, rate);
+        log_ratelimited(1000, LOG_INFO, "call with friend %u: %s, video down to %u kbit/s", friend_num, why, rate);
+    } else if (ctx->sending_audio && audio > audio_bitrate_min) {
+        const uint32_t rate = clamp(audio * BITRATE_DECREASE_PERCENT / 100, audio_bitrate_min, audio_bitrate_max);
+        atomic_store(&ctx->audio_rate, rate);
+        apply_audio(toxAV, friend_num, rate);
+        log_ratelimited(1000, LOG_INFO, "call with friend %u: %s, audio down to %u kbit/s", friend_num, why, rate);
+    } else {
+        return;
+    }
+    atomic_fetch_add(&ctx->rate_cuts, 1);
+    ctx->rate_cut_ns = monotonic_ns();
+}
+
+void bitrate_suggested(ToxAV *toxAV, uint32_t friend_num, struct call_ctx *ctx, bool video, uint32_t bit_rate) {
+    if (video) {
+        const uint32_t rate = clamp(bit_rate, video_bitrate_min, video_bitrate_max);
+        if (! ctx->sending_video || rate >= atomic_load(&ctx->video_rate)) {
+            return;
+        }
+        atomic_store(&ctx->video_rate, rate);
+        apply_video(toxAV, friend_num, rate);
+    } else {
+        const uint32_t rate = clamp(bit_rate, audio_bitrate_min, audio_bitrate_max);
+        if (! ctx->sending_audio || rate >= atomic_load(&ctx->audio_rate)) {
+            return;
+        }
+        atomic_store(&ctx->audio_rate, rate);
+        apply_audio(toxAV, friend_num, rate);
+    }
+    log_ratelimited(1000, LOG_INFO, "call with friend %u: toxav suggested %u kbit/s for %s",
+            friend_num, bit_rate, video ? "video" : "audio");
+    atomic_fetch_add(&ctx->rate_cuts, 1);
+    ctx->rate_cut_ns = monotonic_ns();
+}
+
+static void bump(ToxAV *toxAV, uint32_t friend_num, struct call_ctx *ctx) {
+    const uint32_t video = atomic_load(&ctx->video_rate);
+    const uint32_t audio = atomic_load(&ctx->audio_rate);
+    if (ctx->sending_audio && audio < audio_bitrate_max) {
+        const uint32_t rate = clamp(audio + BITRATE_AUDIO_STEP, audio_bitrate_min, audio_bitrate_max);
+        atomic_store(&ctx->audio_rate, rate);
+        apply_audio(toxAV, friend_num, rate);
+    }
+    if (ctx->sending_video && video < video_bitrate_max) {
+        const uint32_t rate = clamp(video + BITRATE_VIDEO_STEP, video_bitrate_min, video_bitrate_max);
+        atomic_store(&ctx->video_rate, rate);
+        apply_video(toxAV, friend_num, rate);
+    }
+}
+
+static void check_call(uint32_t friend_num, struct call_ctx *ctx, void *arg) {
+    ToxAV *toxAV = arg;
+    const uint64_t now = monotonic_ns();
+    if (now - ctx->rate_checked_ns < BITRATE_INTERVAL_MS * 1000000ull) {
+        return;
+    }
+    ctx->rate_checked_ns = now;
+
+    const uint_fast64_t errors = atomic_load(&ctx->congestion_errors);
+    const uint_fast64_t dropped = atomic_load(&ctx->video_dropped);
+    const uint_fast64_t sent = atomic_load(&ctx->video_sent);
+    const uint_fast64_t new_errors = errors - ctx->congestion_seen;
+    const uint_fast64_t new_dropped = dropped - ctx->dropped_seen;
+    const uint_fast64_t new_sent = sent - ctx->video_seen;
+    ctx->congestion_seen = errors;
+    ctx->dropped_seen = dropped;
+    ctx->video_seen = sent;
+
+    /* rtp failures mean toxav couldn't get the frame out. the other send errors are about
+       the call itself, like the friend turning video off, and a lower rate won't help. dropping more than a tenth of the
+       video means the encoder can't keep up with the rate, which a lower one also helps with. */
+    if (new_errors > 0) {
+        cut(toxAV, friend_num, ctx, "frames failed to send");
+    } else if (new_dropped * 10 > new_sent + new_dropped) {
+        cut(toxAV, friend_num, ctx, "video falling behind");
+    } else if (now - ctx->rate_cut_ns >= BITRATE_HOLD_MS * 1000000ull) {
+        bump(toxAV, friend_num, ctx);
+    }
+}
+
+void bitrate_tick(ToxAV *toxAV) {
+    calls_for_each(check_call, toxAV);
+}
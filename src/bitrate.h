@@ -0,0 +1,36 @@
+#pragma once
+
+#include "calls.h"
+
+#include <tox/toxav.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* per-call bit rate control. a call starts at audio_bitrate and video_bitrate and is cut
+   multiplicatively when toxav says the link is saturated or frames fail to send, then creeps
+   back up additively once the link has been clean for a while. video is cut before audio,
+   since audio is what keeps a call usable. everything here runs on the toxav thread; toxcore
+   reports call state changes from tox_iterate, so those are handed over through cmdqueue. */
+
+// how often each call's send counters are looked at
+#define BITRATE_INTERVAL_MS 1000
+// no increases for this long after a cut
+#define BITRATE_HOLD_MS 4000
+// cuts keep this much of the bit rate, in percent
+#define BITRATE_DECREASE_PERCENT 75
+// increases, in kbit/s
+#define BITRATE_AUDIO_STEP 4
+#define BITRATE_VIDEO_STEP 250
+
+// a call has started, go back to the starting bit rates
+void bitrate_reset(struct call_ctx *ctx);
+
+// the friend's call state changed. apply the controller's rates to the directions we send.
+void bitrate_set_sending(ToxAV *toxAV, uint32_t friend_num, struct call_ctx *ctx, bool audio, bool video);
+
+// toxav suggested a lower bit rate for the call, in kbit/s
+void bitrate_suggested(ToxAV *toxAV, uint32_t friend_num, struct call_ctx *ctx, bool video, uint32_t bit_rate);
+
+// adjust every call of the current shard that is due, after toxav_iterate
+void bitrate_tick(ToxAV *toxAV);
@@ -0,0 +1,500 @@
+#include "bootstrap.h"
+
+#include "cmdqueue.h"
+#include "globals.h"
+#include "profile.h"
+#include "shard.h"
+#include "util.h"
+
+#include <sodium/utils.h>
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define MAX_NODES 64
+#define MAX_ADDRESSES 64
+// addresses per hostname worth bootstrapping off
+#define ADDRESSES_PER_HOST 2
+#define RETRY_FIRST_MS 5000
+#define RETRY_MAX_MS 120000
+// how long the cached addresses get on their own before the node list joins in
+#define CACHE_TRIAL_MS 3000
+// cached addresses are forgotten after failing this many trials
+#define CACHE_MAX_MISSES 3
+// hostnames looked up at once, so one slow name doesn't hold up the rest
+#define RESOLVER_THREADS 4
+
+struct node {
+    char host[256];
+    uint16_t port;
+    uint8_t key[TOX_PUBLIC_KEY_SIZE];
+    bool numeric;
+};
+
+struct address {
+    char ip[INET6_ADDRSTRLEN];
+    uint16_t port;
+    uint8_t key[TOX_PUBLIC_KEY_SIZE];
+    // trials failed in a row, cached addresses only
+    unsigned misses;
+};
+
+static const struct {
+    const char * const host;
+    const uint16_t port;
+    const char * const key_hex;
+} default_nodes[] = {
+    {"nodes.tox.chat",  33445, "788237D34978D1D5BD822F0A5BEBD2C53C64CC31CD3149350EE27D4D9A2F9B6B"},
+    {"nodes.tox.chat",  33445, "6FC41E2BD381D37E9748FC0E0328CE086AF9598BECC8FEB7DDF2E440475F300E"},
+    {"130.133.110.14",  33445, "461FA3776EF0FA655F1A05477DF1B3B614F7D6B124F7DB1DD4FE3C08B03B640F"},
+    {"205.185.116.116", 33445, "A179B09749AC826FF01F37A9613F6B57118AE014D4196A0E1105A98F93A54702"},
+    {"163.172.136.118", 33445, "2C289F9F37C20D09DA83565588BF496FAB3764853FA38141817A72E3F18ACA0B"},
+    {"144.76.60.215",   33445, "04119E835DF3E78BACF0F84235B300546AF8B936F035185E2A8E9E0A67C8924F"},
+    {"23.226.230.47",   33445, "A09162D68618E742FFBCA1C2C70385E6679604B2D80EA6E84AD0996A1AC8A074"},
+    {"178.21.112.187",  33445, "4B2C19E924972CB9B57732FB172F8A8604DE13EEDA2A6234E348983344B23057"},
+    {"195.154.119.113", 33445, "E398A69646B8CEACA9F0B84F553726C1C49270558C57DF5F3C368F05A7D71354"},
+    {"192.210.149.121", 33445, "F404ABAA1C99A9D37D61AB54898F56793E1DEF8BD46B1038B9D822E8460FAB67"},
+};
+
+// shared by every shard
+static struct node nodes[MAX_NODES];
+static size_t nnodes = 0;
+static bool nodes_loaded = false;
+
+// per shard, only touched by its tox thread
+struct bootstrap_state {
+    char *cache_filename;
+    // known to have gotten us connected before
+    struct address cached[MAX_ADDRESSES];
+    size_t ncached;
+    // bootstrapped off since the last round, or its trial, started
+    struct address tried[MAX_ADDRESSES];
+    size_t ntried;
+    /* toxcore doesn't say which node got us connected, so a round tries the cached addresses
+       on their own first. if they connect us nobody new is cached, and if they don't each of
+       them has missed once. */
+    bool trial;
+    uint64_t trial_end_ns;
+
+    bool connected;
+    uint64_t next_round_ns;
+    unsigned retry_ms;
+    // a lookup of nodes[i] is still running
+    atomic_bool resolving[MAX_NODES];
+};
+
+static struct bootstrap_state states[MAX_SHARDS];
+
+struct lookup {
+    struct lookup *next;
+    struct shard *shard;
+    struct node *node;
+};
+
+/* lookups wait here for the resolvers, a few threads shared by every shard. they're started the
+   first time a hostname needs looking up and live as long as the process, rather than costing
+   a thread per lookup on every round. */
+static pthread_mutex_t lookups_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lookups_cond = PTHREAD_COND_INITIALIZER;
+static struct lookup *lookups_head = NULL;
+static struct lookup *lookups_tail = NULL;
+static unsigned nresolvers = 0;
+static bool resolvers_started = false;
+
+static struct bootstrap_state * state(void) {
+    assert (shard_current() != NULL);
+    return &states[shard_current()->index];
+}
+
+static bool is_numeric(const char *host) {
+    uint8_t buf[sizeof(struct in6_addr)];
+    return inet_pton(AF_INET, host, buf) == 1 || inet_pton(AF_INET6, host, buf) == 1;
+}
+
+static bool add_node(const char *host, unsigned port, const char *key_hex) {
+    if (nnodes == MAX_NODES) {
+        logger("too many bootstrap nodes, ignoring %s", host);
+        return false;
+    }
+    struct node *n = &nodes[nnodes];
+    if (strlen(host) >= sizeof(n->host) || port == 0 || port > UINT16_MAX
+            || strlen(key_hex) != TOX_PUBLIC_KEY_SIZE * 2
+            || sodium_hex2bin(n->key, sizeof(n->key), key_hex, strlen(key_hex), NULL, NULL, NULL) != 0) {
+        logger("bad bootstrap node: %s %u %s", host, port, key_hex);
+        return false;
+    }
+    strcpy(n->host, host);
+    n->port = (uint16_t) port;
+    n->numeric = is_numeric(host);
+    nnodes++;
+    return true;
+}
+
+static bool load_nodes_file(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        return false;
+    }
+    char line[512];
+    unsigned line_num = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_num++;
+        char host[256], key_hex[128];
+        unsigned port;
+        const char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0') {
+            continue;
+        }
+        if (sscanf(start, "%255s %u %127s", host, &port, key_hex) != 3) {
+            logger("%s:%u: expected \"host port key\"", filename, line_num);
+            continue;
+        }
+        add_node(host, port, key_hex);
+    }
+    fclose(file);
+    logger("loaded %zu bootstrap nodes from %s", nnodes, filename);
+    return true;
+}
+
+static void load_nodes(void) {
+    const char *override = getenv("MRPRICKLES_BOOTSTRAP");
+    if (override != NULL && override[0] != '\0') {
+        char host[256], key_hex[128];
+        unsigned port;
+        if (sscanf(override, "%255[^:]:%u:%127s", host, &port, key_hex) == 3 && add_node(host, port, key_hex)) {
+            return;
+        }
+        logger("MRPRICKLES_BOOTSTRAP should look like host:port:key, ignoring it");
+    }
+
+    const char *filename = getenv("MRPRICKLES_NODES_FILE");
+    if (filename != NULL && filename[0] != '\0') {
+        if (load_nodes_file(filename)) {
+            return;
+        }
+        logger("could not read %s, using the built-in bootstrap nodes", filename);
+    } else {
+        const char *home = getenv("HOME");
+        char *default_file;
+        if (home != NULL && asprintf(&default_file, "%s/.config/mrprickles/nodes", home) != -1) {
+            const bool loaded = load_nodes_file(default_file);
+            free(default_file);
+            if (loaded) {
+                return;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(default_nodes)/sizeof(default_nodes[0]); i++) {
+        add_node(default_nodes[i].host, default_nodes[i].port, default_nodes[i].key_hex);
+    }
+}
+
+static void load_cache(struct bootstrap_state *st) {
+    FILE *file = fopen(st->cache_filename, "r");
+    if (file == NULL) {
+        return;
+    }
+    char line[256];
+    while (st->ncached < MAX_ADDRESSES && fgets(line, sizeof(line), file) != NULL) {
+        struct address *a = &st->cached[st->ncached];
+        char key_hex[128];
+        unsigned port;
+        a->misses = 0; // older caches don't have it
+        if (sscanf(line, "%45s %u %127s %u", a->ip, &port, key_hex, &a->misses) >= 3 && port > 0 && port <= UINT16_MAX
+                && is_numeric(a->ip) && strlen(key_hex) == TOX_PUBLIC_KEY_SIZE * 2
+                && sodium_hex2bin(a->key, sizeof(a->key), key_hex, strlen(key_hex), NULL, NULL, NULL) == 0) {
+            a->port = (uint16_t) port;
+            st->ncached++;
+        }
+    }
+    fclose(file);
+    if (st->ncached > 0) {
+        logger("%zu bootstrap addresses cached from last time", st->ncached);
+    }
+}
+
+/* written like the profile and by its saver, so a crash never leaves half a cache
+   and tox_iterate never waits on the disk. */
+static void save_cache(struct bootstrap_state *st) {
+    if (st->cache_filename == NULL) {
+        return;
+    }
+    const size_t line_size = INET6_ADDRSTRLEN + sizeof(" 65535  4294967295\n") + TOX_PUBLIC_KEY_SIZE * 2;
+    char *text = malloc(st->ncached * line_size + 1);
+    if (text == NULL) {
+        return;
+    }
+    size_t length = 0;
+    text[0] = '\0';
+    for (size_t i = 0; i < st->ncached; i++) {
+        const struct address *a = &st->cached[i];
+        char key_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        sodium_bin2hex(key_hex, sizeof(key_hex), a->key, sizeof(a->key));
+        length += (size_t) snprintf(text + length, line_size + 1, "%s %u %s %u\n",
+                a->ip, a->port, key_hex, a->misses);
+    }
+    profile_write_file(st->cache_filename, (uint8_t *) text, length);
+}
+
+static bool same_address(const struct address *a, const char *ip, uint16_t port, const uint8_t *key) {
+    return a->port == port && strcmp(a->ip, ip) == 0 && memcmp(a->key, key, sizeof(a->key)) == 0;
+}
+
+// the node list got us connected. whatever it was bootstrapped off joins the cache.
+static void cache_tried(struct bootstrap_state *st) {
+    for (size_t i = 0; i < st->ntried && st->ncached < MAX_ADDRESSES; i++) {
+        const struct address *t = &st->tried[i];
+        bool known = false;
+        for (size_t j = 0; j < st->ncached && ! known; j++) {
+            known = same_address(&st->cached[j], t->ip, t->port, t->key);
+        }
+        if (! known) {
+            st->cached[st->ncached] = *t;
+            st->cached[st->ncached++].misses = 0;
+        }
+    }
+}
+
+void bootstrap_init(const char *data_filename) {
+    if (! nodes_loaded) {
+        load_nodes();
+        nodes_loaded = true;
+    }
+
+    struct bootstrap_state *st = state();
+    st->retry_ms = RETRY_FIRST_MS;
+    // a node given on the command line is meant to be the only one, so don't mix in old ones
+    const char *override = getenv("MRPRICKLES_BOOTSTRAP");
+    if (override == NULL || override[0] == '\0') {
+        if (asprintf(&st->cache_filename, "%s.nodes", data_filename) == -1) {
+            st->cache_filename = NULL;
+        } else {
+            load_cache(st);
+        }
+    }
+}
+
+static void bootstrap_address(Tox *tox, const char *ip, uint16_t port, const uint8_t *key) {
+    struct bootstrap_state *st = state();
+    TOX_ERR_BOOTSTRAP err;
+    if (! tox_bootstrap(tox, ip, port, key, &err)) {
+        logger(" --> could not bootstrap from %s:%u, error code: %d", ip, port, err);
+        return;
+    }
+
+    for (size_t i = 0; i < st->ntried; i++) {
+        if (same_address(&st->tried[i], ip, port, key)) {
+            return;
+        }
+    }
+    if (st->ntried < MAX_ADDRESSES) {
+        struct address *a = &st->tried[st->ntried++];
+        snprintf(a->ip, sizeof(a->ip), "%s", ip);
+        a->port = port;
+        memcpy(a->key, key, sizeof(a->key));
+    }
+}
+
+static void resolve(struct lookup *lookup) {
+    const struct node *n = lookup->node;
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    struct addrinfo *result;
+    const int err = getaddrinfo(n->host, NULL, &hints, &result);
+    if (err != 0) {
+        log_ratelimited(10000, LOG_WARN, " --> could not resolve host: %s (%s)", n->host, gai_strerror(err));
+    } else {
+        unsigned posted = 0;
+        for (struct addrinfo *ai = result; ai != NULL && posted < ADDRESSES_PER_HOST; ai = ai->ai_next) {
+            char ip[INET6_ADDRSTRLEN];
+            const void *addr = ai->ai_family == AF_INET
+                    ? (const void *) &((struct sockaddr_in *) ai->ai_addr)->sin_addr
+                    : (const void *) &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+            if ((ai->ai_family == AF_INET || ai->ai_family == AF_INET6)
+                    && inet_ntop(ai->ai_family, addr, ip, sizeof(ip)) != NULL
+                    && post_bootstrap(lookup->shard, ip, n->port, n->key)) {
+                posted++;
+            }
+        }
+        freeaddrinfo(result);
+    }
+    atomic_store(&states[lookup->shard->index].resolving[n - nodes], false);
+    free(lookup);
+}
+
+static void * run_resolver(GCC_UNUSED void *arg) {
+    pthread_mutex_lock(&lookups_lock);
+    while (true) {
+        while (lookups_head == NULL) {
+            pthread_cond_wait(&lookups_cond, &lookups_lock);
+        }
+        struct lookup *lookup = lookups_head;
+        lookups_head = lookup->next;
+        if (lookups_head == NULL) {
+            lookups_tail = NULL;
+        }
+        pthread_mutex_unlock(&lookups_lock);
+        resolve(lookup);
+        pthread_mutex_lock(&lookups_lock);
+    }
+    return NULL;
+}
+
+// false if no resolver is running and none could be started
+static bool queue_lookup(struct lookup *lookup) {
+    pthread_mutex_lock(&lookups_lock);
+    if (! resolvers_started) {
+        resolvers_started = true;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        for (unsigned i = 0; i < RESOLVER_THREADS; i++) {
+            pthread_t thread;
+            if (pthread_create(&thread, &attr, run_resolver, NULL) == 0) {
+                nresolvers++;
+            }
+        }
+        pthread_attr_destroy(&attr);
+        if (nresolvers < RESOLVER_THREADS) {
+            logger("could only start %u of %d resolver threads", nresolvers, RESOLVER_THREADS);
+        }
+    }
+    if (nresolvers == 0) {
+        pthread_mutex_unlock(&lookups_lock);
+        return false;
+    }
+    lookup->next = NULL;
+    if (lookups_tail == NULL) {
+        lookups_head = lookup;
+    } else {
+        lookups_tail->next = lookup;
+    }
+    lookups_tail = lookup;
+    pthread_cond_signal(&lookups_cond);
+    pthread_mutex_unlock(&lookups_lock);
+    return true;
+}
+
+static void bootstrap_nodes(Tox *tox) {
+    struct bootstrap_state *st = state();
+    unsigned lookups = 0;
+    for (size_t i = 0; i < nnodes; i++) {
+        struct node *n = &nodes[i];
+        if (n->numeric) {
+            logger("requesting nodes from %s:%u...", n->host, n->port);
+            bootstrap_address(tox, n->host, n->port, n->key);
+            continue;
+        }
+        // still looking it up from last time
+        if (atomic_exchange(&st->resolving[i], true)) {
+            continue;
+        }
+        struct lookup *lookup = malloc(sizeof(*lookup));
+        if (lookup != NULL) {
+            lookup->shard = shard_current();
+            lookup->node = n;
+        }
+        if (lookup != NULL && queue_lookup(lookup)) {
+            lookups++;
+        } else {
+            free(lookup);
+            atomic_store(&st->resolving[i], false);
+        }
+    }
+    logger("bootstrapping: %zu nodes, %u lookups started", nnodes, lookups);
+}
+
+void bootstrap(Tox *tox) {
+    struct bootstrap_state *st = state();
+    st->ntried = 0;
+    if (st->ncached == 0) {
+        bootstrap_nodes(tox);
+        return;
+    }
+
+    for (size_t i = 0; i < st->ncached; i++) {
+        bootstrap_address(tox, st->cached[i].ip, st->cached[i].port, st->cached[i].key);
+    }
+    st->trial = true;
+    st->trial_end_ns = monotonic_ns() + CACHE_TRIAL_MS * 1000000ull;
+    logger("bootstrapping: %zu cached addresses first", st->ncached);
+}
+
+// the cached addresses didn't get us connected in time
+static void end_trial(Tox *tox) {
+    struct bootstrap_state *st = state();
+    st->trial = false;
+    size_t kept = 0;
+    for (size_t i = 0; i < st->ncached; i++) {
+        if (++st->cached[i].misses < CACHE_MAX_MISSES) {
+            st->cached[kept++] = st->cached[i];
+        }
+    }
+    if (kept < st->ncached) {
+        logger("forgetting %zu cached bootstrap addresses that stopped working", st->ncached - kept);
+    }
+    st->ncached = kept;
+    // so that only the node list is cached if it's what connects us
+    st->ntried = 0;
+    bootstrap_nodes(tox);
+}
+
+void bootstrap_resolved(Tox *tox, const char *ip, uint16_t port, const uint8_t *key) {
+    logger("requesting nodes from %s:%u...", ip, port);
+    bootstrap_address(tox, ip, port, key);
+}
+
+void bootstrap_connection_changed(TOX_CONNECTION status) {
+    struct bootstrap_state *st = state();
+    if (status == TOX_CONNECTION_NONE) {
+        st->connected = false;
+        st->next_round_ns = monotonic_ns();
+        st->retry_ms = RETRY_FIRST_MS;
+    } else if (! st->connected) {
+        st->connected = true;
+        st->next_round_ns = 0;
+        st->retry_ms = RETRY_FIRST_MS;
+        if (st->trial) {
+            st->trial = false;
+            for (size_t i = 0; i < st->ncached; i++) {
+                st->cached[i].misses = 0;
+            }
+        } else {
+            cache_tried(st);
+        }
+        save_cache(st);
+    }
+}
+
+void bootstrap_tick(Tox *tox) {
+    struct bootstrap_state *st = state();
+    if (st->connected) {
+        return;
+    }
+    const uint64_t now = monotonic_ns();
+    if (st->trial && now >= st->trial_end_ns) {
+        end_trial(tox);
+    }
+    if (st->next_round_ns == 0) {
+        // the first round happened at startup; give it a chance before trying again
+        st->next_round_ns = now + st->retry_ms * 1000000ull;
+        return;
+    }
+    if (now < st->next_round_ns) {
+        return;
+    }
+    logger("not connected, bootstrapping again");
+    bootstrap(tox);
+    st->next_round_ns = now + st->retry_ms * 1000000ull;
+    st->retry_ms = st->retry_ms * 2 > RETRY_MAX_MS ? RETRY_MAX_MS : st->retry_ms * 2;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <tox/tox.h>
+
+#include <stdint.h>
+
+/* the nodes come from MRPRICKLES_NODES_FILE, or ~/.config/mrprickles/nodes, or the built-in list,
+   one "host port key" per line. MRPRICKLES_BOOTSTRAP=host:port:key replaces them all with one node.
+
+   numeric addresses are bootstrapped right away. hostnames are looked up in parallel by a few
+   resolver threads and bootstrapped by the tox thread once they resolve, so nothing waits on dns.
+   addresses that got us connected are kept next to the profile and tried on their own first;
+   the node list only joins in when they don't connect us, and ones that keep failing are dropped.
+   the node list is shared, everything else is kept per shard. */
+
+// the current shard's cached addresses, and the node list the first time. data_filename is the profile's path.
+void bootstrap_init(const char *data_filename);
+
+// tox thread (or before it starts)
+void bootstrap(Tox *tox);
+
+// tox thread. a hostname resolved to ip.
+void bootstrap_resolved(Tox *tox, const char *ip, uint16_t port, const uint8_t *key);
+
+// tox thread, from self_connection_status. losing the network schedules another round.
+void bootstrap_connection_changed(TOX_CONNECTION status);
+
+// tox thread, once per iteration. retries with backoff while we're not connected.
+void bootstrap_tick(Tox *tox);
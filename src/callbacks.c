@@ -1,6 +1,18 @@
 #include "callbacks.h"
 
+#include "admin.h"
+#include "bootstrap.h"
+#include "conference.h"
+#include "file_echo.h"
+#include "friends.h"
+#include "listing.h"
 #include "messaging.h"
+#include "metrics.h"
+#include "outbox.h"
+#include "profile.h"
+#include "ratelimit.h"
+#include "scratch.h"
+#include "shutdown.h"
 #include "util.h"
 
 #include <assert.h>
@@ -8,15 +20,18 @@
 #include <string.h>
 
 void self_connection_status(GCC_UNUSED Tox * tox, TOX_CONNECTION status, GCC_UNUSED void *user_data) {
+    bootstrap_connection_changed(status);
     switch (status) {
         case TOX_CONNECTION_NONE:
             logger("lost connection to the tox network");
             break;
         case TOX_CONNECTION_TCP:
             logger("connected to the tox network using TCP.");
+            startup_finish("first connect");
             break;
         case TOX_CONNECTION_UDP:
             logger("connected to the tox network using UDP.");
+            startup_finish("first connect");
             break;
         default:
             logger("this should absolutely not happen. status: %d", status);
@@ -25,64 +40,141 @@ void self_connection_status(GCC_UNUSED Tox * tox, TOX_CONNECTION status, GCC_UNU
 
 void friend_request(Tox *tox, const uint8_t *public_key, const uint8_t *message, GCC_UNUSED size_t length,
                     GCC_UNUSED void * user_data) {
+    if (shutdown_draining()) {
+        return; // they'll ask again
+    }
+    if (! ratelimit_allow_request()) {
+        log_ratelimited(1000, LOG_WARN, "ignoring a friend request, too many lately");
+        return;
+    }
+
     TOX_ERR_FRIEND_ADD err;
-    tox_friend_add_norequest(tox, public_key, &err);
+    uint32_t friend_num = tox_friend_add_norequest(tox, public_key, &err);
     logger("received friend request: %s", message);
 
     if (err != TOX_ERR_FRIEND_ADD_OK) {
         logger("could not add friend, error: %d", err);
     } else {
         logger("added to our friend list");
+        friends_add(tox, friend_num);
+        admin_friend_added(tox, friend_num);
     }
 
-    save_profile(tox);
+    profile_mark_dirty();
+}
+
+void friend_name_change(GCC_UNUSED Tox *tox, uint32_t friend_num, const uint8_t *name, size_t length,
+                        GCC_UNUSED void *user_data) {
+    friends_set_name(friend_num, name, length);
+}
+
+void friend_status_change(GCC_UNUSED Tox *tox, uint32_t friend_num, TOX_USER_STATUS status,
+                        GCC_UNUSED void *user_data) {
+    friends_set_status(friend_num, status);
 }
 
-void friend_on_off(Tox *tox, uint32_t friend_num, TOX_CONNECTION connection_status, GCC_UNUSED void *user_data) {
-    uint8_t *name;
-    friend_name_from_num(&name, tox, friend_num);
+void friend_read_receipt(Tox *tox, uint32_t friend_num, uint32_t message_id, GCC_UNUSED void *user_data) {
+    outbox_receipt(friend_num, message_id);
+    listing_receipt(tox, friend_num);
+}
+
+void friend_on_off(Tox *tox, uint32_t friend_num, TOX_CONNECTION connection_status,
+                    GCC_UNUSED void *user_data) {
+    friends_set_connection(friend_num, connection_status);
     if (connection_status == TOX_CONNECTION_NONE) {
-        logger("friend %u (%s) went offline", friend_num, name);
+        listing_forget(friend_num);
+        outbox_offline(friend_num);
+        file_echo_offline(friend_num);
+        logger("friend %u (%s) went offline", friend_num, friend_name(friend_num));
     } else {
-        logger("friend %u (%s) came online", friend_num, name);
+        logger("friend %u (%s) came online", friend_num, friend_name(friend_num));
+        outbox_online(tox, friend_num);
     }
-    free(name);
 }
 
-void file_recv(Tox *tox, uint32_t friend_num, uint32_t file_num, uint32_t kind, GCC_UNUSED uint64_t file_size,
-                GCC_UNUSED const uint8_t *filename, GCC_UNUSED size_t filename_length, GCC_UNUSED void *user_data) {
+void file_recv(Tox *tox, uint32_t friend_num, uint32_t file_num, uint32_t kind, uint64_t file_size,
+                const uint8_t *filename, size_t filename_length, GCC_UNUSED void *user_data) {
     if (kind == TOX_FILE_KIND_AVATAR) {
         return;
     }
+    if (shutdown_draining()) {
+        tox_file_control(tox, friend_num, file_num, TOX_FILE_CONTROL_CANCEL, NULL);
+        return;
+    }
+    file_echo_start(tox, friend_num, file_num, file_size, filename, filename_length);
+}
+
+void file_recv_chunk(Tox *tox, uint32_t friend_num, uint32_t file_num, uint64_t position,
+                    const uint8_t *data, size_t length, GCC_UNUSED void *user_data) {
+    file_echo_chunk(tox, friend_num, file_num, position, data, length);
+}
 
-    tox_file_control(tox, friend_num, file_num, TOX_FILE_CONTROL_CANCEL, NULL);
+void file_chunk_request(Tox *tox, uint32_t friend_num, uint32_t file_num, uint64_t position, size_t length,
+                        GCC_UNUSED void *user_data) {
+    file_echo_request(tox, friend_num, file_num, position, length);
+}
 
-    const char *msg = "i don't want your dumb file.";
-    tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-            (const uint8_t *) msg, strlen(msg), NULL);
+void file_recv_control(Tox *tox, uint32_t friend_num, uint32_t file_num, TOX_FILE_CONTROL control,
+                        GCC_UNUSED void *user_data) {
+    file_echo_control(tox, friend_num, file_num, control);
 }
 
 void friend_message(Tox *tox, uint32_t friend_num, TOX_MESSAGE_TYPE type,
                     const uint8_t *message, size_t length, GCC_UNUSED void *user_data) {
+    // too late to start on anything, the toxav thread may already be gone
+    if (shutdown_draining()) {
+        return;
+    }
+    // over the limit, the cheapest thing is to not answer at all
+    if (! ratelimit_allow(LIMIT_MESSAGE, friend_num)) {
+        log_ratelimited(1000, LOG_WARN, "friend %u is sending too many messages", friend_num);
+        return;
+    }
     if (type == TOX_MESSAGE_TYPE_ACTION) {
-        char* reply = ":^O";
-        tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) reply, strlen(reply), NULL);
+        const char *reply = ":^O";
+        outbox_send(tox, friend_num, reply, strlen(reply));
         return;
     }
     assert (type == TOX_MESSAGE_TYPE_NORMAL);
+    const uint64_t start = monotonic_ns();
+    metrics_add(METRIC_MESSAGES_RECEIVED, 1);
 
-    uint8_t *name;
-    friend_name_from_num(&name, tox, friend_num);
-    logger("friend %u (%s) says: \033[1m%s\033[0m", friend_num, name, message);
-    free(name);
+    logger("friend %u (%s) says: \033[1m%s\033[0m", friend_num, friend_name(friend_num), message);
 
-    // the message was passed to us without a terminating null byte. the null byte here is provided by calloc
-    char * dest_msg = calloc(sizeof(char), length+1);
+    // the message was passed to us without a terminating null byte. the null byte here is provided by scratch_calloc
+    char * dest_msg = scratch_calloc(sizeof(char), length+1);
     if (NULL == dest_msg) {
         logger("oh no, couldn't allocate memory.");
         return;
     }
     memcpy(dest_msg, message, length);
     reply_friend_message(tox, friend_num, dest_msg, length);
-    free(dest_msg);
+    metrics_record(METRIC_FRIEND_MESSAGE_NS, monotonic_ns() - start);
+}
+
+void conference_invite(Tox *tox, uint32_t friend_num, TOX_CONFERENCE_TYPE type, const uint8_t *cookie,
+                        size_t length, GCC_UNUSED void *user_data) {
+    if (shutdown_draining()) {
+        return;
+    }
+    conference_join(tox, friend_num, type, cookie, length);
+}
+
+void conference_message(Tox *tox, uint32_t conference_num, uint32_t peer_num, TOX_MESSAGE_TYPE type,
+                        const uint8_t *message, size_t length, GCC_UNUSED void *user_data) {
+    // conferences send us our own messages back, and echoing those would never end
+    if (shutdown_draining() || tox_conference_peer_number_is_ours(tox, conference_num, peer_num, NULL)
+            || type != TOX_MESSAGE_TYPE_NORMAL || length > TOX_MAX_MESSAGE_LENGTH) {
+        return;
+    }
+    if (! ratelimit_allow_conference(conference_num)) {
+        log_ratelimited(1000, LOG_WARN, "conference %u is too chatty", conference_num);
+        return;
+    }
+    metrics_add(METRIC_CONFERENCE_MESSAGES_RECEIVED, 1);
+
+    char text[TOX_MAX_MESSAGE_LENGTH + 1];
+    memcpy(text, message, length);
+    text[length] = '\0';
+    reply_conference_message(tox, conference_num, text, length);
 }
@@ -11,12 +11,44 @@ void friend_request(Tox *tox, const uint8_t *public_key, const uint8_t *message,
                     GCC_UNUSED size_t length, GCC_UNUSED void * user_data);
 
 
-void friend_on_off(Tox *tox, uint32_t friend_num, TOX_CONNECTION connection_status, GCC_UNUSED void *user_data);
+void friend_name_change(GCC_UNUSED Tox *tox, uint32_t friend_num, const uint8_t *name, size_t length,
+                        GCC_UNUSED void *user_data);
 
 
-void file_recv(Tox *tox, uint32_t friend_num, uint32_t file_num, uint32_t kind, GCC_UNUSED uint64_t file_size,
-                GCC_UNUSED const uint8_t *filename, GCC_UNUSED size_t filename_length, GCC_UNUSED void *user_data);
+void friend_status_change(GCC_UNUSED Tox *tox, uint32_t friend_num, TOX_USER_STATUS status,
+                        GCC_UNUSED void *user_data);
+
+
+void friend_read_receipt(Tox *tox, uint32_t friend_num, uint32_t message_id, GCC_UNUSED void *user_data);
+
+
+void friend_on_off(Tox *tox, uint32_t friend_num, TOX_CONNECTION connection_status,
+                    GCC_UNUSED void *user_data);
+
+
+void file_recv(Tox *tox, uint32_t friend_num, uint32_t file_num, uint32_t kind, uint64_t file_size,
+                const uint8_t *filename, size_t filename_length, GCC_UNUSED void *user_data);
+
+
+void file_recv_chunk(Tox *tox, uint32_t friend_num, uint32_t file_num, uint64_t position,
+                    const uint8_t *data, size_t length, GCC_UNUSED void *user_data);
+
+
+void file_chunk_request(Tox *tox, uint32_t friend_num, uint32_t file_num, uint64_t position, size_t length,
+                        GCC_UNUSED void *user_data);
+
+
+void file_recv_control(Tox *tox, uint32_t friend_num, uint32_t file_num, TOX_FILE_CONTROL control,
+                        GCC_UNUSED void *user_data);
 
 
 void friend_message(Tox *tox, uint32_t friend_num, GCC_UNUSED TOX_MESSAGE_TYPE type,
                     const uint8_t *message, size_t length, GCC_UNUSED void *user_data);
+
+
+void conference_invite(Tox *tox, uint32_t friend_num, TOX_CONFERENCE_TYPE type, const uint8_t *cookie,
+                        size_t length, GCC_UNUSED void *user_data);
+
+
+void conference_message(Tox *tox, uint32_t conference_num, uint32_t peer_num, TOX_MESSAGE_TYPE type,
+                        const uint8_t *message, size_t length, GCC_UNUSED void *user_data);
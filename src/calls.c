@@ -0,0 +1,193 @@
+#include "calls.h"
+
+#include "av_workers.h"
+#include "bitrate.h"
+#include "globals.h"
+#include "party.h"
+#include "util.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct call_table {
+    struct call_ctx **calls;
+    size_t size;
+};
+
+// one per shard, indexed by friend number
+static struct call_table tables[MAX_SHARDS];
+// held while a table is resized and by readers outside the toxav threads
+static pthread_mutex_t calls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct call_table * table(void) {
+    assert (shard_current() != NULL);
+    return &tables[shard_current()->index];
+}
+
+static void start_call(struct call_ctx *ctx) {
+    ctx->worker = av_workers_assign();
+    atomic_store(&ctx->audio_sent, 0);
+    atomic_store(&ctx->audio_bytes, 0);
+    atomic_store(&ctx->video_sent, 0);
+    atomic_store(&ctx->video_bytes, 0);
+    atomic_store(&ctx->video_dropped, 0);
+    atomic_store(&ctx->send_errors, 0);
+    atomic_store(&ctx->congestion_errors, 0);
+    atomic_store(&ctx->last_error, 0);
+    bitrate_reset(ctx);
+    ctx->party = false;
+    ctx->party_slot = 0;
+    ctx->active = true;
+}
+
+struct call_ctx * call_ctx_get(uint32_t friend_num) {
+    struct call_table *t = table();
+    if (friend_num >= t->size) {
+        size_t new_size = t->size ? t->size : 16;
+        while (new_size <= friend_num) {
+            new_size *= 2;
+        }
+        pthread_mutex_lock(&calls_lock);
+        struct call_ctx ** new_calls = realloc(t->calls, new_size * sizeof(*t->calls));
+        if (new_calls == NULL) {
+            pthread_mutex_unlock(&calls_lock);
+            return NULL;
+        }
+        for (size_t i = t->size; i < new_size; i++) {
+            new_calls[i] = NULL;
+        }
+        t->calls = new_calls;
+        t->size = new_size;
+        pthread_mutex_unlock(&calls_lock);
+    }
+
+    if (t->calls[friend_num] == NULL) {
+        struct call_ctx *ctx = calloc(1, sizeof(struct call_ctx));
+        if (ctx == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&calls_lock);
+        t->calls[friend_num] = ctx;
+        pthread_mutex_unlock(&calls_lock);
+    }
+
+    struct call_ctx *ctx = t->calls[friend_num];
+    if (! ctx->active) {
+        start_call(ctx);
+    }
+    return ctx;
+}
+
+struct call_ctx * call_ctx_find(uint32_t friend_num) {
+    const struct call_table *t = table();
+    if (friend_num >= t->size || t->calls[friend_num] == NULL || ! t->calls[friend_num]->active) {
+        return NULL;
+    }
+    return t->calls[friend_num];
+}
+
+void call_ctx_release(uint32_t friend_num) {
+    struct call_table *t = table();
+    if (friend_num >= t->size || t->calls[friend_num] == NULL || ! t->calls[friend_num]->active) {
+        return;
+    }
+    struct call_ctx *ctx = t->calls[friend_num];
+    logger("call with friend %u: %" PRIuFAST64 " audio frames sent, %" PRIuFAST64 " video frames sent, "
+            "%" PRIuFAST64 " video frames dropped, %" PRIuFAST64 " send errors, %u bit rate cuts", friend_num,
+            atomic_load(&ctx->audio_sent), atomic_load(&ctx->video_sent),
+            atomic_load(&ctx->video_dropped), atomic_load(&ctx->send_errors), atomic_load(&ctx->rate_cuts));
+    party_leave(ctx);
+    av_workers_unassign(ctx->worker);
+    ctx->active = false;
+}
+
+void calls_for_each(void (*fn)(uint32_t friend_num, struct call_ctx *ctx, void *arg), void *arg) {
+    const struct call_table *t = table();
+    for (size_t i = 0; i < t->size; i++) {
+        if (t->calls[i] != NULL && t->calls[i]->active) {
+            fn((uint32_t) i, t->calls[i], arg);
+        }
+    }
+}
+
+void calls_report(char *buf, size_t size) {
+    const struct call_table *t = table();
+    size_t len = 0;
+    unsigned active = 0;
+    buf[0] = '\0';
+
+    pthread_mutex_lock(&calls_lock);
+    for (size_t i = 0; i < t->size; i++) {
+        const struct call_ctx *ctx = t->calls[i];
+        if (ctx == NULL || ! ctx->active) {
+            continue;
+        }
+        active++;
+        if (len >= size) {
+            continue;
+        }
+        int n = snprintf(buf + len, size - len, "%s%zu: audio %" PRIuFAST64 " sent, video %" PRIuFAST64
+                " sent %" PRIuFAST64 " dropped, %" PRIuFAST64 " errors, %u/%u kbit/s after %u cuts",
+                len ? "\n" : "", i, atomic_load(&ctx->audio_sent), atomic_load(&ctx->video_sent),
+                atomic_load(&ctx->video_dropped), atomic_load(&ctx->send_errors),
+                atomic_load(&ctx->audio_rate), atomic_load(&ctx->video_rate), atomic_load(&ctx->rate_cuts));
+        if (n < 0 || (size_t) n >= size - len) {
+            buf[len] = '\0'; // drop the line that didn't fit
+            len = size;
+        } else {
+            len += (size_t) n;
+        }
+    }
+    pthread_mutex_unlock(&calls_lock);
+
+    if (active == 0) {
+        snprintf(buf, size, "no calls right now.");
+    }
+}
+
+void calls_write_prometheus(FILE *file) {
+    fprintf(file, "# TYPE mrprickles_call_frames_total counter\n"
+            "# TYPE mrprickles_call_bytes_total counter\n"
+            "# TYPE mrprickles_call_send_errors_total counter\n"
+            "# TYPE mrprickles_call_bit_rate_kbps gauge\n");
+
+    pthread_mutex_lock(&calls_lock);
+    for (unsigned shard = 0; shard < g_nshards; shard++) {
+        const struct call_table *t = &tables[shard];
+        for (size_t i = 0; i < t->size; i++) {
+            const struct call_ctx *ctx = t->calls[i];
+            if (ctx == NULL || ! ctx->active) {
+                continue;
+            }
+            fprintf(file, "mrprickles_call_frames_total{shard=\"%u\",friend=\"%zu\",kind=\"audio\"} %" PRIuFAST64 "\n"
+                    "mrprickles_call_frames_total{shard=\"%u\",friend=\"%zu\",kind=\"video\"} %" PRIuFAST64 "\n"
+                    "mrprickles_call_bytes_total{shard=\"%u\",friend=\"%zu\",kind=\"audio\"} %" PRIuFAST64 "\n"
+                    "mrprickles_call_bytes_total{shard=\"%u\",friend=\"%zu\",kind=\"video\"} %" PRIuFAST64 "\n"
+                    "mrprickles_call_send_errors_total{shard=\"%u\",friend=\"%zu\"} %" PRIuFAST64 "\n"
+                    "mrprickles_call_bit_rate_kbps{shard=\"%u\",friend=\"%zu\",kind=\"audio\"} %u\n"
+                    "mrprickles_call_bit_rate_kbps{shard=\"%u\",friend=\"%zu\",kind=\"video\"} %u\n",
+                    shard, i, atomic_load(&ctx->audio_sent), shard, i, atomic_load(&ctx->video_sent),
+                    shard, i, atomic_load(&ctx->audio_bytes), shard, i, atomic_load(&ctx->video_bytes),
+                    shard, i, atomic_load(&ctx->send_errors),
+                    shard, i, atomic_load(&ctx->audio_rate), shard, i, atomic_load(&ctx->video_rate));
+        }
+    }
+    pthread_mutex_unlock(&calls_lock);
+}
+
+void calls_free_all(void) {
+    pthread_mutex_lock(&calls_lock);
+    for (unsigned shard = 0; shard < MAX_SHARDS; shard++) {
+        struct call_table *t = &tables[shard];
+        for (size_t i = 0; i < t->size; i++) {
+            free(t->calls[i]);
+        }
+        free(t->calls);
+        t->calls = NULL;
+        t->size = 0;
+    }
+    pthread_mutex_unlock(&calls_lock);
+}
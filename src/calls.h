@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* per-call state, indexed by friend number. each shard has its own table, which only its toxav thread
+   changes; these work on the current shard's. contexts are never freed while the workers run,
+   so jobs may point into them. */
+struct call_ctx {
+    atomic_bool active;
+    // the av worker that echoes this call's frames
+    unsigned worker;
+
+    // video jobs of this call waiting in its worker's queue
+    atomic_uint queued_video;
+
+    // reset whenever a new call starts
+    atomic_uint_fast64_t audio_sent;
+    atomic_uint_fast64_t audio_bytes;
+    atomic_uint_fast64_t video_sent;
+    atomic_uint_fast64_t video_bytes;
+    atomic_uint_fast64_t video_dropped;
+    atomic_uint_fast64_t send_errors;
+    // the subset of send_errors that means the link is saturated, which the rate controller acts on
+    atomic_uint_fast64_t congestion_errors;
+    // the worker only logs a send error when it differs from the previous one
+    atomic_int last_error;
+
+    // bit rates in kbit/s picked by the rate controller, see bitrate.h
+    atomic_uint audio_rate;
+    atomic_uint video_rate;
+    atomic_uint rate_cuts;
+    // the rest of the controller's state, only touched by the toxav thread
+    bool sending_audio;
+    bool sending_video;
+    uint64_t rate_checked_ns;
+    uint64_t rate_cut_ns;
+    uint_fast64_t congestion_seen;
+    uint_fast64_t dropped_seen;
+    uint_fast64_t video_seen;
+
+    // the friend asked us to call them onto the party line, see party.h. toxav thread only.
+    bool party;
+    // their slot on the line plus one, 0 while they're not on it
+    unsigned party_slot;
+};
+
+// returns NULL if memory could not be allocated. an inactive call is assigned a worker.
+struct call_ctx * call_ctx_get(uint32_t friend_num);
+
+// NULL unless the friend is in a call
+struct call_ctx * call_ctx_find(uint32_t friend_num);
+
+// the call has ended; log its counters and give its worker back
+void call_ctx_release(uint32_t friend_num);
+
+// every active call of the current shard. only from its toxav thread.
+void calls_for_each(void (*fn)(uint32_t friend_num, struct call_ctx *ctx, void *arg), void *arg);
+
+// one line of counters per active call, truncated to fit size
+void calls_report(char *buf, size_t size);
+
+// frame, byte and error counters of every active call, labelled by shard and friend number
+void calls_write_prometheus(FILE *file);
+
+void calls_free_all(void);
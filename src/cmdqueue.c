@@ -0,0 +1,258 @@
+#include "cmdqueue.h"
+
+#include "av_callbacks.h"
+#include "bitrate.h"
+#include "bootstrap.h"
+#include "calls.h"
+#include "conference.h"
+#include "globals.h"
+#include "outbox.h"
+#include "shutdown.h"
+#include "util.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum command_type {
+    COMMAND_CALL,
+    COMMAND_PARTY_CALL,
+    COMMAND_CALL_STATE,
+    COMMAND_AUDIO_BIT_RATE,
+    COMMAND_VIDEO_BIT_RATE,
+    COMMAND_MESSAGE,
+    COMMAND_BOOTSTRAP,
+    COMMAND_BROADCAST,
+};
+
+struct command {
+    struct mpsc_node node; // must come first
+    enum command_type type;
+    uint32_t friend_num;
+    uint32_t audio_bit_rate;
+    uint32_t video_bit_rate;
+    uint32_t state;
+    uint16_t port;
+    size_t length;
+    uint8_t message[];
+};
+
+// one pair per shard
+static struct mpsc_queue toxav_commands[MAX_SHARDS];
+static struct mpsc_queue tox_commands[MAX_SHARDS];
+
+void cmdqueue_init(void) {
+    for (unsigned i = 0; i < MAX_SHARDS; i++) {
+        mpsc_init(&toxav_commands[i]);
+        mpsc_init(&tox_commands[i]);
+    }
+}
+
+static struct shard * here(void) {
+    struct shard *shard = shard_current();
+    assert (shard != NULL);
+    return shard;
+}
+
+static struct command * new_command(enum command_type type, uint32_t friend_num, size_t length) {
+    struct command *cmd = malloc(sizeof(struct command) + length);
+    if (cmd == NULL) {
+        logger("oh no, couldn't allocate memory.");
+        return NULL;
+    }
+    cmd->type = type;
+    cmd->friend_num = friend_num;
+    cmd->audio_bit_rate = 0;
+    cmd->video_bit_rate = 0;
+    cmd->state = 0;
+    cmd->port = 0;
+    cmd->length = length;
+    return cmd;
+}
+
+static bool post_toxav(struct command *cmd) {
+    if (cmd == NULL) {
+        return false;
+    }
+    struct shard *shard = here();
+    mpsc_push(&toxav_commands[shard->index], &cmd->node);
+    reactor_wake(&shard->toxav_reactor);
+    return true;
+}
+
+bool post_call(uint32_t friend_num, uint32_t audio_bit_rate, uint32_t video_bit_rate) {
+    struct command *cmd = new_command(COMMAND_CALL, friend_num, 0);
+    if (cmd != NULL) {
+        cmd->audio_bit_rate = audio_bit_rate;
+        cmd->video_bit_rate = video_bit_rate;
+    }
+    return post_toxav(cmd);
+}
+
+bool post_party_call(uint32_t friend_num) {
+    struct command *cmd = new_command(COMMAND_PARTY_CALL, friend_num, 0);
+    if (cmd != NULL) {
+        cmd->audio_bit_rate = audio_bitrate;
+    }
+    return post_toxav(cmd);
+}
+
+bool post_call_state(uint32_t friend_num, uint32_t state) {
+    struct command *cmd = new_command(COMMAND_CALL_STATE, friend_num, 0);
+    if (cmd != NULL) {
+        cmd->state = state;
+    }
+    return post_toxav(cmd);
+}
+
+bool post_audio_bit_rate(uint32_t friend_num, uint32_t bit_rate) {
+    struct command *cmd = new_command(COMMAND_AUDIO_BIT_RATE, friend_num, 0);
+    if (cmd != NULL) {
+        cmd->audio_bit_rate = bit_rate;
+    }
+    return post_toxav(cmd);
+}
+
+bool post_video_bit_rate(uint32_t friend_num, uint32_t bit_rate) {
+    struct command *cmd = new_command(COMMAND_VIDEO_BIT_RATE, friend_num, 0);
+    if (cmd != NULL) {
+        cmd->video_bit_rate = bit_rate;
+    }
+    return post_toxav(cmd);
+}
+
+static bool post_tox(struct shard *shard, struct command *cmd) {
+    mpsc_push(&tox_commands[shard->index], &cmd->node);
+    reactor_wake(&shard->tox_reactor);
+    return true;
+}
+
+bool post_message(uint32_t friend_num, const char *message, size_t length) {
+    assert (length <= TOX_MAX_MESSAGE_LENGTH);
+    struct command *cmd = new_command(COMMAND_MESSAGE, friend_num, length);
+    if (cmd == NULL) {
+        return false;
+    }
+    memcpy(cmd->message, message, length);
+    return post_tox(here(), cmd);
+}
+
+// the message holds the key, then the address as a string
+bool post_bootstrap(struct shard *shard, const char *ip, uint16_t port, const uint8_t *key) {
+    const size_t ip_length = strlen(ip) + 1;
+    struct command *cmd = new_command(COMMAND_BOOTSTRAP, 0, TOX_PUBLIC_KEY_SIZE + ip_length);
+    if (cmd == NULL) {
+        return false;
+    }
+    cmd->port = port;
+    memcpy(cmd->message, key, TOX_PUBLIC_KEY_SIZE);
+    memcpy(cmd->message + TOX_PUBLIC_KEY_SIZE, ip, ip_length);
+    return post_tox(shard, cmd);
+}
+
+bool post_broadcast(struct shard *shard, const char *message, size_t length) {
+    assert (length <= TOX_MAX_MESSAGE_LENGTH);
+    struct command *cmd = new_command(COMMAND_BROADCAST, 0, length);
+    if (cmd == NULL) {
+        return false;
+    }
+    memcpy(cmd->message, message, length);
+    return post_tox(shard, cmd);
+}
+
+static void run_toxav_command(ToxAV *toxAV, const struct command *cmd) {
+    switch (cmd->type) {
+        case COMMAND_CALL:
+        case COMMAND_PARTY_CALL: {
+            if (shutdown_draining()) {
+                break; // nobody would hang it up
+            }
+            TOXAV_ERR_CALL err;
+            toxav_call(toxAV, cmd->friend_num, cmd->audio_bit_rate, cmd->video_bit_rate, &err);
+            if (err != TOXAV_ERR_CALL_OK) {
+                logger("could not call friend %u, error: %d", cmd->friend_num, err);
+                break;
+            }
+            if (cmd->type == COMMAND_PARTY_CALL) {
+                // they join the line once their audio starts flowing, see call_state_changed
+                struct call_ctx *ctx = call_ctx_get(cmd->friend_num);
+                if (ctx != NULL) {
+                    ctx->party = true;
+                }
+            }
+            break;
+        }
+        case COMMAND_CALL_STATE:
+            call_state_changed(toxAV, cmd->friend_num, cmd->state);
+            break;
+        case COMMAND_AUDIO_BIT_RATE:
+        case COMMAND_VIDEO_BIT_RATE: {
+            struct call_ctx *ctx = call_ctx_find(cmd->friend_num);
+            if (ctx != NULL) { // the call may have ended since
+                const bool video = cmd->type == COMMAND_VIDEO_BIT_RATE;
+                bitrate_suggested(toxAV, cmd->friend_num, ctx, video,
+                        video ? cmd->video_bit_rate : cmd->audio_bit_rate);
+            }
+            break;
+        }
+        default:
+            logger("this should absolutely not happen. command: %d", cmd->type);
+    }
+}
+
+void drain_toxav_commands(ToxAV *toxAV) {
+    struct mpsc_queue *queue = &toxav_commands[here()->index];
+    for (struct mpsc_node *node; (node = mpsc_pop(queue)) != NULL; ) {
+        struct command *cmd = (struct command *) node;
+        run_toxav_command(toxAV, cmd);
+        free(cmd);
+    }
+}
+
+static void discard(struct mpsc_queue *queue) {
+    for (struct mpsc_node *node; (node = mpsc_pop(queue)) != NULL; ) {
+        free(node);
+    }
+}
+
+void discard_toxav_commands(void) {
+    discard(&toxav_commands[here()->index]);
+}
+
+void drain_tox_commands(Tox *tox) {
+    struct mpsc_queue *queue = &tox_commands[here()->index];
+    for (struct mpsc_node *node; (node = mpsc_pop(queue)) != NULL; ) {
+        struct command *cmd = (struct command *) node;
+        if (cmd->type == COMMAND_BOOTSTRAP) {
+            bootstrap_resolved(tox, (const char *) cmd->message + TOX_PUBLIC_KEY_SIZE, cmd->port, cmd->message);
+        } else if (cmd->type == COMMAND_BROADCAST) {
+            if (! broadcast_start((const char *) cmd->message, cmd->length)) {
+                logger("shard %u is still shouting, it missed a broadcast", here()->index);
+            }
+        } else {
+            assert (cmd->type == COMMAND_MESSAGE);
+            outbox_send(tox, cmd->friend_num, (const char *) cmd->message, cmd->length);
+        }
+        free(cmd);
+    }
+}
+
+void cmdqueue_free(void) {
+    for (unsigned i = 0; i < MAX_SHARDS; i++) {
+        discard(&toxav_commands[i]);
+        discard(&tox_commands[i]);
+    }
+}
+
+void cmdqueue_report(char *buf, size_t size) {
+    const struct mpsc_queue *toxav_queue = &toxav_commands[here()->index];
+    const struct mpsc_queue *tox_queue = &tox_commands[here()->index];
+    snprintf(buf, size, "toxav queue: %zu queued, %zu at most, %" PRIuFAST64 " contended\n"
+            "tox queue: %zu queued, %zu at most, %" PRIuFAST64 " contended",
+            atomic_load(&toxav_queue->depth), atomic_load(&toxav_queue->max_depth),
+            atomic_load(&toxav_queue->contended),
+            atomic_load(&tox_queue->depth), atomic_load(&tox_queue->max_depth),
+            atomic_load(&tox_queue->contended));
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "mpsc.h"
+#include "shard.h"
+
+#include <tox/tox.h>
+#include <tox/toxav.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* neither Tox nor ToxAV may be used from a thread other than the one iterating it,
+   so other threads post commands here and the owning thread runs them before it next iterates.
+   every shard has its own queues. commands go to the current shard unless one is given. */
+
+// to the toxav thread. bit rates are suggestions for the rate controller, see bitrate.h.
+bool post_call(uint32_t friend_num, uint32_t audio_bit_rate, uint32_t video_bit_rate);
+// an audio call onto the party line, see party.h
+bool post_party_call(uint32_t friend_num);
+// toxcore reports call state changes from the tox thread
+bool post_call_state(uint32_t friend_num, uint32_t state);
+bool post_audio_bit_rate(uint32_t friend_num, uint32_t bit_rate);
+bool post_video_bit_rate(uint32_t friend_num, uint32_t bit_rate);
+
+// to the tox thread
+bool post_message(uint32_t friend_num, const char *message, size_t length);
+bool post_bootstrap(struct shard *shard, const char *ip, uint16_t port, const uint8_t *key);
+// a broadcast started on another shard, see conference.h
+bool post_broadcast(struct shard *shard, const char *message, size_t length);
+
+void cmdqueue_init(void);
+
+// run everything posted so far. only from the thread that owns the object.
+void drain_toxav_commands(ToxAV *toxAV);
+void drain_tox_commands(Tox *tox);
+
+// free what's queued for the toxav thread without running it, shutting down
+void discard_toxav_commands(void);
+
+// depth, high-water mark and contention of the current shard's queues
+void cmdqueue_report(char *buf, size_t size);
+
+// whatever is still queued anywhere, once every thread has returned
+void cmdqueue_free(void);
@@ -0,0 +1,166 @@
+#include "conference.h"
+
+#include "friends.h"
+#include "globals.h"
+#include "metrics.h"
+#include "outbox.h"
+#include "profile.h"
+#include "scratch.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct broadcast {
+    uint32_t next_friend;
+    uint32_t next_conference; // an index into the chat list, once the friends are done
+    unsigned reached;
+    size_t length;
+    char text[TOX_MAX_MESSAGE_LENGTH];
+};
+
+struct conferences {
+    bool hosting;
+    uint32_t hosted; // our own conference, if hosting
+    struct broadcast broadcasts[MAX_BROADCASTS]; // a ring, the one going out at head
+    unsigned head;
+    unsigned count;
+};
+
+// one per shard
+static struct conferences all_conferences[MAX_SHARDS];
+
+static struct conferences * conferences(void) {
+    assert (shard_current() != NULL);
+    return &all_conferences[shard_current()->index];
+}
+
+void conference_join(Tox *tox, uint32_t friend_num, TOX_CONFERENCE_TYPE type,
+                    const uint8_t *cookie, size_t length) {
+    if (type != TOX_CONFERENCE_TYPE_TEXT) {
+        // joining an av conference means mixing its audio, which we don't do
+        logger("friend %u (%s) invited us to an audio conference, ignoring it", friend_num, friend_name(friend_num));
+        return;
+    }
+
+    TOX_ERR_CONFERENCE_JOIN err;
+    const uint32_t conference_num = tox_conference_join(tox, friend_num, cookie, length, &err);
+    if (err != TOX_ERR_CONFERENCE_JOIN_OK) {
+        logger("could not join friend %u's conference, error: %d", friend_num, err);
+        return;
+    }
+    logger("joined conference %u, invited by friend %u (%s)", conference_num, friend_num, friend_name(friend_num));
+    profile_mark_dirty();
+}
+
+bool conference_invite_friend(Tox *tox, uint32_t friend_num) {
+    struct conferences *c = conferences();
+    if (! c->hosting) {
+        TOX_ERR_CONFERENCE_NEW err;
+        c->hosted = tox_conference_new(tox, &err);
+        if (err != TOX_ERR_CONFERENCE_NEW_OK) {
+            logger("could not start a conference, error: %d", err);
+            return false;
+        }
+        c->hosting = true;
+        logger("started conference %u", c->hosted);
+        profile_mark_dirty();
+    }
+
+    TOX_ERR_CONFERENCE_INVITE err;
+    tox_conference_invite(tox, friend_num, c->hosted, &err);
+    if (err != TOX_ERR_CONFERENCE_INVITE_OK) {
+        logger("could not invite friend %u to conference %u, error: %d", friend_num, c->hosted, err);
+        return false;
+    }
+    return true;
+}
+
+bool conference_send(Tox *tox, uint32_t conference_num, const char *message, size_t length) {
+    TOX_ERR_CONFERENCE_SEND_MESSAGE err;
+    tox_conference_send_message(tox, conference_num, TOX_MESSAGE_TYPE_NORMAL,
+            (const uint8_t *) message, length, &err);
+    if (err != TOX_ERR_CONFERENCE_SEND_MESSAGE_OK) {
+        log_ratelimited(1000, LOG_WARN, "could not send to conference %u, error: %d", conference_num, err);
+        return false;
+    }
+    return true;
+}
+
+bool broadcast_start(const char *message, size_t length) {
+    assert (length <= TOX_MAX_MESSAGE_LENGTH);
+    struct conferences *c = conferences();
+    if (c->count == MAX_BROADCASTS) {
+        return false;
+    }
+    struct broadcast *b = &c->broadcasts[(c->head + c->count++) % MAX_BROADCASTS];
+    b->next_friend = 0;
+    b->next_conference = 0;
+    b->reached = 0;
+    b->length = length;
+    memcpy(b->text, message, length);
+    return true;
+}
+
+// send what fits in one iteration's budget. returns how many went out, *done once everyone has it.
+static unsigned send_batch(Tox *tox, struct broadcast *b, bool *done) {
+    const uint64_t start = monotonic_ns();
+    unsigned sent = 0;
+    *done = false;
+
+    /* friends first. offline ones are skipped rather than queued, the outbox would only
+       hold on to a few thousand copies of the same thing. */
+    const uint32_t end = friends_end();
+    while (b->next_friend < end) {
+        if (sent == FANOUT_BATCH || monotonic_ns() - start > FANOUT_BUDGET_NS) {
+            return sent;
+        }
+        const uint32_t num = b->next_friend++;
+        const struct friend_info *info = friend_get(num);
+        if (info == NULL || info->connection == TOX_CONNECTION_NONE) {
+            continue;
+        }
+        if (outbox_send(tox, num, b->text, b->length)) {
+            b->reached++;
+        }
+        sent++;
+    }
+
+    const size_t nconferences = tox_conference_get_chatlist_size(tox);
+    if (b->next_conference < nconferences) {
+        uint32_t *chatlist = scratch_alloc(nconferences * sizeof(uint32_t));
+        if (chatlist == NULL) {
+            return sent; // try again next time
+        }
+        tox_conference_get_chatlist(tox, chatlist);
+        while (b->next_conference < nconferences && sent < FANOUT_BATCH
+                && monotonic_ns() - start <= FANOUT_BUDGET_NS) {
+            if (conference_send(tox, chatlist[b->next_conference++], b->text, b->length)) {
+                b->reached++;
+            }
+            sent++;
+        }
+    }
+    *done = b->next_conference >= nconferences;
+    return sent;
+}
+
+bool broadcast_pending(void) {
+    return conferences()->count > 0;
+}
+
+void broadcast_tick(Tox *tox) {
+    struct conferences *c = conferences();
+    if (c->count == 0) {
+        return;
+    }
+    struct broadcast *b = &c->broadcasts[c->head];
+    bool done;
+    metrics_add(METRIC_BROADCAST_SENT, send_batch(tox, b, &done));
+    if (done) {
+        logger("broadcast reached %u friends and conferences", b->reached);
+        c->head = (c->head + 1) % MAX_BROADCASTS;
+        c->count--;
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <tox/tox.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* conferences, toxcore's group chats. we join any text conference a friend invites us to
+   and host one of our own that friends can ask into.
+
+   broadcasts fan out to every online friend and every conference a batch at a time, a little
+   each iteration, so reaching thousands of people never holds up tox_iterate. each shard has
+   its own; tox thread only. the broadcast command posts one to every other shard's tox queue. */
+
+// sends per iteration, and the time they may take, whichever runs out first
+#define FANOUT_BATCH 64
+#define FANOUT_BUDGET_NS 1000000u
+// broadcasts waiting their turn
+#define MAX_BROADCASTS 4
+
+void conference_join(Tox *tox, uint32_t friend_num, TOX_CONFERENCE_TYPE type,
+                    const uint8_t *cookie, size_t length);
+
+// invite the friend to the conference we host, starting it first if need be
+bool conference_invite_friend(Tox *tox, uint32_t friend_num);
+
+bool conference_send(Tox *tox, uint32_t conference_num, const char *message, size_t length);
+
+// false if too many broadcasts are already going
+bool broadcast_start(const char *message, size_t length);
+
+// send the next batch. call every iteration.
+void broadcast_tick(Tox *tox);
+
+// a broadcast of the current shard is still going out
+bool broadcast_pending(void);
@@ -0,0 +1,433 @@
+#include "file_echo.h"
+
+#include "friends.h"
+#include "globals.h"
+#include "metrics.h"
+#include "outbox.h"
+#include "util.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MB (1024 * 1024)
+
+struct transfer {
+    uint32_t friend_num;
+    uint32_t in_file;   // theirs, coming in
+    uint32_t out_file;  // ours, going back
+    uint64_t size;
+    uint64_t received;  // the next position we expect
+    uint64_t sent;      // echoed so far
+    uint64_t requested; // how far toxcore has asked for
+    size_t chunk;       // the length toxcore asks for, but for the last request
+    bool in_done;
+    bool paused;
+    uint64_t progress_ns;
+
+    /* the bytes from sent to received live at position % capacity of buffer,
+       which is the ring below unless the transfer has spilled. */
+    uint8_t *buffer;
+    size_t capacity;
+    int spill_fd; // -1 while not spilled
+    uint8_t ring[FILE_ECHO_RING_BYTES];
+};
+
+struct transfers {
+    struct transfer **list;
+    unsigned count;
+    unsigned allocated;
+    uint64_t next_check_ns;
+};
+
+// one per shard
+static struct transfers all_transfers[MAX_SHARDS];
+
+// the caps, and transfers going over all shards
+static _Atomic uint64_t max_size = (uint64_t) FILE_ECHO_MAX_MB * MB;
+static atomic_uint max_transfers = FILE_ECHO_MAX_TRANSFERS;
+static atomic_uint active = 0;
+
+static struct transfers * transfers(void) {
+    assert (shard_current() != NULL);
+    return &all_transfers[shard_current()->index];
+}
+
+void file_echo_init(void) {
+    const char *value = getenv("MRPRICKLES_FILE_ECHO");
+    if (value == NULL) {
+        return;
+    }
+    uint64_t mb;
+    unsigned count;
+    if (sscanf(value, "%" SCNu64 ",%u", &mb, &count) != 2 || mb == 0 || mb > UINT64_MAX / MB) {
+        logger("ignoring MRPRICKLES_FILE_ECHO, it should be two numbers like \"8192,32\"");
+        return;
+    }
+    file_echo_set_caps(mb, count);
+}
+
+void file_echo_set_caps(uint64_t max_mb, unsigned count) {
+    atomic_store(&max_size, max_mb * MB);
+    atomic_store(&max_transfers, count);
+    logger("echoing files of up to %" PRIu64 " MB, %u at a time", max_mb, count);
+}
+
+static void reply(Tox *tox, uint32_t friend_num, const char *msg) {
+    outbox_send(tox, friend_num, msg, strlen(msg));
+}
+
+// copy len bytes in or out of a ring of capacity bytes, starting at position
+static void ring_write(uint8_t *buffer, size_t capacity, uint64_t position, const uint8_t *data, size_t len) {
+    const size_t offset = (size_t) (position % capacity);
+    const size_t first = capacity - offset < len ? capacity - offset : len;
+    memcpy(buffer + offset, data, first);
+    memcpy(buffer, data + first, len - first);
+}
+
+static void ring_read(const uint8_t *buffer, size_t capacity, uint64_t position, uint8_t *data, size_t len) {
+    const size_t offset = (size_t) (position % capacity);
+    const size_t first = capacity - offset < len ? capacity - offset : len;
+    memcpy(data, buffer + offset, first);
+    memcpy(data + first, buffer, len - first);
+}
+
+/* the friend is sending faster than they take the echo. move what's waiting into a temp file,
+   which the kernel can write out rather than keeping in memory. */
+static bool spill(struct transfer *t) {
+    assert (t->spill_fd == -1);
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mrprickles-echo-XXXXXX", dir ? dir : "/tmp");
+    const int fd = mkstemp(path);
+    if (fd == -1) {
+        return false;
+    }
+    unlink(path);
+    uint8_t *map = ftruncate(fd, FILE_ECHO_SPILL_BYTES) == 0
+        ? mmap(NULL, FILE_ECHO_SPILL_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    for (uint64_t position = t->sent; position < t->received; ) {
+        const size_t offset = (size_t) (position % t->capacity);
+        const size_t run = t->capacity - offset < t->received - position
+            ? t->capacity - offset : (size_t) (t->received - position);
+        ring_write(map, FILE_ECHO_SPILL_BYTES, position, t->buffer + offset, run);
+        position += run;
+    }
+    t->buffer = map;
+    t->capacity = FILE_ECHO_SPILL_BYTES;
+    t->spill_fd = fd;
+    metrics_add(METRIC_FILES_SPILLED, 1);
+    return true;
+}
+
+// back to the ring once they've caught up
+static void unspill(struct transfer *t) {
+    if (t->spill_fd == -1) {
+        return;
+    }
+    munmap(t->buffer, t->capacity);
+    close(t->spill_fd);
+    t->spill_fd = -1;
+    t->buffer = t->ring;
+    t->capacity = sizeof(t->ring);
+}
+
+// forget the transfer. if tox is given, both directions are cancelled first.
+static void finish(Tox *tox, struct transfers *all, struct transfer *t) {
+    if (tox != NULL) {
+        if (! t->in_done) {
+            tox_file_control(tox, t->friend_num, t->in_file, TOX_FILE_CONTROL_CANCEL, NULL);
+        }
+        tox_file_control(tox, t->friend_num, t->out_file, TOX_FILE_CONTROL_CANCEL, NULL);
+    }
+    for (unsigned i = 0; i < all->count; i++) {
+        if (all->list[i] == t) {
+            all->list[i] = all->list[--all->count];
+            break;
+        }
+    }
+    unspill(t);
+    free(t);
+    atomic_fetch_sub(&active, 1);
+}
+
+static struct transfer * find(const struct transfers *all, uint32_t friend_num, uint32_t file_num, bool outgoing) {
+    for (unsigned i = 0; i < all->count; i++) {
+        struct transfer *t = all->list[i];
+        if (t->friend_num == friend_num && (outgoing ? t->out_file : t->in_file) == file_num) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+void file_echo_start(Tox *tox, uint32_t friend_num, uint32_t file_num, uint64_t file_size,
+                    const uint8_t *filename, size_t filename_length) {
+    const char *refusal = NULL;
+    if (file_size == UINT64_MAX) {
+        refusal = "tell me how big it is first.";
+    } else if (file_size > atomic_load(&max_size)) {
+        refusal = "that's too big for me.";
+    } else if (atomic_fetch_add(&active, 1) >= atomic_load(&max_transfers)) {
+        atomic_fetch_sub(&active, 1);
+        refusal = "my hands are full. try again later.";
+    }
+    if (refusal != NULL) {
+        tox_file_control(tox, friend_num, file_num, TOX_FILE_CONTROL_CANCEL, NULL);
+        reply(tox, friend_num, refusal);
+        return;
+    }
+
+    struct transfers *all = transfers();
+    struct transfer *t = calloc(1, sizeof(struct transfer));
+    if (all->count == all->allocated && t != NULL) {
+        const unsigned new_size = all->allocated ? all->allocated * 2 : 8;
+        struct transfer **list = realloc(all->list, new_size * sizeof(*list));
+        if (list == NULL) {
+            free(t);
+            t = NULL;
+        } else {
+            all->list = list;
+            all->allocated = new_size;
+        }
+    }
+    if (t == NULL) {
+        logger("oh no, couldn't allocate memory.");
+        atomic_fetch_sub(&active, 1);
+        tox_file_control(tox, friend_num, file_num, TOX_FILE_CONTROL_CANCEL, NULL);
+        return;
+    }
+
+    TOX_ERR_FILE_SEND err;
+    t->out_file = tox_file_send(tox, friend_num, TOX_FILE_KIND_DATA, file_size, NULL,
+            filename, filename_length, &err);
+    if (err != TOX_ERR_FILE_SEND_OK) {
+        logger("could not echo friend %u's file, error: %d", friend_num, err);
+        free(t);
+        atomic_fetch_sub(&active, 1);
+        tox_file_control(tox, friend_num, file_num, TOX_FILE_CONTROL_CANCEL, NULL);
+        reply(tox, friend_num, "sorry, i couldn't send it back.");
+        return;
+    }
+    t->friend_num = friend_num;
+    t->in_file = file_num;
+    t->size = file_size;
+    t->buffer = t->ring;
+    t->capacity = sizeof(t->ring);
+    t->spill_fd = -1;
+    t->progress_ns = monotonic_ns();
+    all->list[all->count++] = t;
+
+    if (! tox_file_control(tox, friend_num, file_num, TOX_FILE_CONTROL_RESUME, NULL)) {
+        finish(tox, all, t);
+        return;
+    }
+    logger("echoing a %" PRIu64 " byte file for friend %u (%s)", file_size, friend_num, friend_name(friend_num));
+}
+
+/* send whatever toxcore has asked for and we have. false if the transfer had to be given up. */
+static bool pump(Tox *tox, struct transfers *all, struct transfer *t) {
+    while (t->sent < t->requested) {
+        const size_t len = t->requested - t->sent < t->chunk ? (size_t) (t->requested - t->sent) : t->chunk;
+        if (t->received - t->sent < len) {
+            break;
+        }
+        const size_t offset = (size_t) (t->sent % t->capacity);
+        const uint8_t *data = t->buffer + offset;
+        uint8_t wrapped[TOX_MAX_CUSTOM_PACKET_SIZE];
+        if (offset + len > t->capacity) {
+            if (len > sizeof(wrapped)) {
+                logger("friend %u asked for %zu byte chunks, which is more than toxcore sends", t->friend_num, len);
+                finish(tox, all, t);
+                return false;
+            }
+            ring_read(t->buffer, t->capacity, t->sent, wrapped, len);
+            data = wrapped;
+        }
+
+        TOX_ERR_FILE_SEND_CHUNK err;
+        tox_file_send_chunk(tox, t->friend_num, t->out_file, t->sent, data, len, &err);
+        if (err == TOX_ERR_FILE_SEND_CHUNK_SENDQ) {
+            break; // file_echo_tick tries again
+        }
+        if (err != TOX_ERR_FILE_SEND_CHUNK_OK) {
+            log_ratelimited(1000, LOG_WARN, "could not echo a chunk to friend %u, error: %d", t->friend_num, err);
+            finish(tox, all, t);
+            return false;
+        }
+        t->sent += len;
+        t->progress_ns = monotonic_ns();
+        metrics_add(METRIC_FILE_BYTES_ECHOED, len);
+    }
+
+    const uint64_t waiting = t->received - t->sent;
+    if (waiting == 0) {
+        unspill(t);
+    }
+    if (t->paused && waiting < t->capacity / 4
+            && tox_file_control(tox, t->friend_num, t->in_file, TOX_FILE_CONTROL_RESUME, NULL)) {
+        t->paused = false;
+    }
+    return true;
+}
+
+void file_echo_chunk(Tox *tox, uint32_t friend_num, uint32_t file_num, uint64_t position,
+                    const uint8_t *data, size_t length) {
+    struct transfers *all = transfers();
+    struct transfer *t = find(all, friend_num, file_num, false);
+    if (t == NULL) {
+        return;
+    }
+    if (length == 0) {
+        t->in_done = true;
+        return;
+    }
+    if (position != t->received) {
+        log_ratelimited(1000, LOG_WARN, "friend %u's file skipped from %" PRIu64 " to %" PRIu64,
+                friend_num, t->received, position);
+        finish(tox, all, t);
+        return;
+    }
+
+    const uint64_t waiting = t->received - t->sent;
+    if (waiting + length > t->capacity && (t->spill_fd != -1 || ! spill(t))) {
+        // either the temp file couldn't be made or they kept sending while paused
+        log_ratelimited(1000, LOG_WARN, "no room left to echo friend %u's file", friend_num);
+        finish(tox, all, t);
+        return;
+    }
+    ring_write(t->buffer, t->capacity, t->received, data, length);
+    t->received += length;
+    t->progress_ns = monotonic_ns();
+
+    // only a spilled transfer is paused, the ring alone spills instead
+    if (! t->paused && t->spill_fd != -1 && t->received - t->sent > t->capacity / 4 * 3
+            && tox_file_control(tox, friend_num, file_num, TOX_FILE_CONTROL_PAUSE, NULL)) {
+        t->paused = true;
+    }
+    pump(tox, all, t);
+}
+
+void file_echo_request(Tox *tox, uint32_t friend_num, uint32_t file_num, uint64_t position, size_t length) {
+    struct transfers *all = transfers();
+    struct transfer *t = find(all, friend_num, file_num, true);
+    if (t == NULL) {
+        return;
+    }
+    if (length == 0) {
+        logger("echoed a %" PRIu64 " byte file to friend %u (%s)", t->size, friend_num, friend_name(friend_num));
+        metrics_add(METRIC_FILES_ECHOED, 1);
+        finish(NULL, all, t);
+        return;
+    }
+    // toxcore asks for each chunk once and in order, and we answer them in order too
+    if (position != t->requested) {
+        log_ratelimited(1000, LOG_WARN, "friend %u's echo asked for %" PRIu64 " rather than %" PRIu64,
+                friend_num, position, t->requested);
+        finish(tox, all, t);
+        return;
+    }
+    t->requested += length;
+    if (length > t->chunk) {
+        t->chunk = length;
+    }
+    pump(tox, all, t);
+}
+
+void file_echo_control(Tox *tox, uint32_t friend_num, uint32_t file_num, TOX_FILE_CONTROL control) {
+    if (control != TOX_FILE_CONTROL_CANCEL) {
+        // toxcore holds back chunks itself while either side is paused
+        return;
+    }
+    struct transfers *all = transfers();
+    struct transfer *t = find(all, friend_num, file_num, false);
+    const bool incoming = t != NULL;
+    if (t == NULL && (t = find(all, friend_num, file_num, true)) == NULL) {
+        return;
+    }
+    logger("friend %u (%s) cancelled a file after %" PRIu64 " of %" PRIu64 " bytes", friend_num,
+            friend_name(friend_num), t->received, t->size);
+    if (incoming) {
+        // the echo can't be finished without the rest of the file
+        tox_file_control(tox, friend_num, t->out_file, TOX_FILE_CONTROL_CANCEL, NULL);
+    } else if (! t->in_done) {
+        // they don't want the echo, so there's no point taking the rest
+        tox_file_control(tox, friend_num, t->in_file, TOX_FILE_CONTROL_CANCEL, NULL);
+    }
+    finish(NULL, all, t);
+}
+
+void file_echo_offline(uint32_t friend_num) {
+    struct transfers *all = transfers();
+    for (unsigned i = all->count; i-- > 0; ) {
+        if (all->list[i]->friend_num == friend_num) {
+            finish(NULL, all, all->list[i]);
+        }
+    }
+}
+
+void file_echo_tick(Tox *tox) {
+    struct transfers *all = transfers();
+    if (all->count == 0) {
+        return;
+    }
+    const uint64_t now = monotonic_ns();
+    const bool check = now >= all->next_check_ns;
+    if (check) {
+        all->next_check_ns = now + 1000000000u;
+    }
+    // backwards, since finishing one moves the last into its place
+    for (unsigned i = all->count; i-- > 0; ) {
+        struct transfer *t = all->list[i];
+        if (check && now - t->progress_ns > FILE_ECHO_STALL_MS * 1000000ull) {
+            logger("giving up on friend %u's file after %" PRIu64 " of %" PRIu64 " bytes",
+                    t->friend_num, t->sent, t->size);
+            finish(tox, all, t);
+        } else if (t->sent < t->requested && t->sent < t->received) {
+            pump(tox, all, t);
+        }
+    }
+}
+
+void file_echo_report(char *buf, size_t size) {
+    const struct transfers *all = transfers();
+    uint64_t waiting = 0;
+    unsigned spilled = 0;
+    for (unsigned i = 0; i < all->count; i++) {
+        waiting += all->list[i]->received - all->list[i]->sent;
+        spilled += all->list[i]->spill_fd != -1;
+    }
+    snprintf(buf, size, "file echo: %u transfers here, %u of %u everywhere, files up to %" PRIu64
+            " MB. %" PRIu64 " KB waiting, %u spilled", all->count, atomic_load(&active),
+            atomic_load(&max_transfers), atomic_load(&max_size) / MB, waiting / 1024, spilled);
+}
+
+void file_echo_stop(Tox *tox) {
+    struct transfers *all = transfers();
+    while (all->count > 0) {
+        finish(tox, all, all->list[all->count - 1]);
+    }
+}
+
+void file_echo_free(void) {
+    for (unsigned s = 0; s < MAX_SHARDS; s++) {
+        struct transfers *all = &all_transfers[s];
+        while (all->count > 0) {
+            finish(NULL, all, all->list[all->count - 1]);
+        }
+        free(all->list);
+        all->list = NULL;
+        all->allocated = 0;
+    }
+}
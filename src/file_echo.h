@@ -0,0 +1,59 @@
+#pragma once
+
+#include <tox/tox.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* files friends send us are streamed straight back to them as they arrive. a transfer's bytes
+   wait in a small ring of its own between file_recv_chunk and file_chunk_request. when the
+   friend takes the echo slower than they send, the ring spills into a temp file mapped into
+   memory, and past most of that the incoming side is paused until they catch up. so memory
+   never grows with the size of a file, however many are going at once.
+
+   MRPRICKLES_FILE_ECHO   largest file in MB, transfers at once over all shards (say "8192,32",
+                          0 transfers turns the echo off). the admin can change both while running.
+
+   each shard has its own transfers; tox thread only. */
+
+// the in-memory ring of every transfer
+#define FILE_ECHO_RING_BYTES (64 * 1024)
+// the temp file a transfer spills into. the incoming side is paused at 3/4 and resumed at 1/4.
+#define FILE_ECHO_SPILL_BYTES (64 * 1024 * 1024)
+// a transfer that moves no bytes either way for this long is given up on
+#define FILE_ECHO_STALL_MS 60000
+
+#define FILE_ECHO_MAX_MB 8192
+#define FILE_ECHO_MAX_TRANSFERS 32
+
+// read the caps from the environment. call before the tox threads start.
+void file_echo_init(void);
+
+// transfers already going aren't affected. 0 transfers turns the echo off.
+void file_echo_set_caps(uint64_t max_mb, unsigned max_transfers);
+
+// a friend offered us a file. it's accepted and echoed, or cancelled with a reply saying why.
+void file_echo_start(Tox *tox, uint32_t friend_num, uint32_t file_num, uint64_t file_size,
+                    const uint8_t *filename, size_t filename_length);
+
+// the tox file callbacks, for transfers both ways
+void file_echo_chunk(Tox *tox, uint32_t friend_num, uint32_t file_num, uint64_t position,
+                    const uint8_t *data, size_t length);
+void file_echo_request(Tox *tox, uint32_t friend_num, uint32_t file_num, uint64_t position, size_t length);
+void file_echo_control(Tox *tox, uint32_t friend_num, uint32_t file_num, TOX_FILE_CONTROL control);
+
+// toxcore drops a friend's transfers without a word when they go offline
+void file_echo_offline(uint32_t friend_num);
+
+// retries full send queues and gives up on stalled transfers. call every iteration.
+void file_echo_tick(Tox *tox);
+
+// the caps and the current shard's transfers
+void file_echo_report(char *buf, size_t size);
+
+// cancel the current shard's transfers, shutting down
+void file_echo_stop(Tox *tox);
+
+// every shard's transfers
+void file_echo_free(void);
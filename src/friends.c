@@ -0,0 +1,229 @@
+#include "friends.h"
+
+#include "globals.h"
+#include "scratch.h"
+#include "util.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct friends_table {
+    struct friend_info *friends;
+    uint32_t size;
+    /* the tox thread reads without it; it is taken for writing, and for reading on other threads. */
+    pthread_rwlock_t lock;
+
+    /* kept up to date as friends change, so nobody has to walk the table to count them.
+       the per-status counts only include friends who are online. */
+    atomic_uint count_total;
+    atomic_uint count_online;
+    atomic_uint count_status[3]; // indexed by TOX_USER_STATUS
+};
+
+// one per shard
+static struct friends_table tables[MAX_SHARDS];
+
+static struct friends_table * table(void) {
+    assert (shard_current() != NULL);
+    return &tables[shard_current()->index];
+}
+
+// add (delta 1) or remove (delta -1) a friend's contribution to the counters
+static void count(struct friends_table *t, const struct friend_info *info, int delta) {
+    if (! info->exists) {
+        return;
+    }
+    atomic_fetch_add(&t->count_total, (unsigned) delta);
+    if (info->connection != TOX_CONNECTION_NONE) {
+        atomic_fetch_add(&t->count_online, (unsigned) delta);
+        if ((unsigned) info->status < sizeof(t->count_status)/sizeof(t->count_status[0])) {
+            atomic_fetch_add(&t->count_status[info->status], (unsigned) delta);
+        }
+    }
+}
+
+// the table has a slot for friend_num afterwards, unless memory ran out. write lock must be held.
+static bool reserve(struct friends_table *t, uint32_t friend_num) {
+    if (friend_num < t->size) {
+        return true;
+    }
+    uint32_t new_size = t->size ? t->size : 64;
+    while (new_size <= friend_num) {
+        new_size *= 2;
+    }
+    struct friend_info * new_friends = realloc(t->friends, new_size * sizeof(*t->friends));
+    if (new_friends == NULL) {
+        logger("oh no, couldn't allocate memory.");
+        return false;
+    }
+    memset(&new_friends[t->size], 0, (new_size - t->size) * sizeof(*t->friends));
+    t->friends = new_friends;
+    t->size = new_size;
+    return true;
+}
+
+static void copy_name(struct friend_info *info, const uint8_t *name, size_t length) {
+    if (length > TOX_MAX_NAME_LENGTH) {
+        length = TOX_MAX_NAME_LENGTH;
+    }
+    memcpy(info->name, name, length);
+    info->name[length] = '\0';
+}
+
+// write lock must be held
+static void fill(struct friends_table *t, Tox *tox, uint32_t friend_num) {
+    if (! reserve(t, friend_num)) {
+        return;
+    }
+    struct friend_info *info = &t->friends[friend_num];
+    count(t, info, -1);
+    memset(info, 0, sizeof(*info));
+
+    uint8_t key[TOX_PUBLIC_KEY_SIZE];
+    if (! tox_friend_get_public_key(tox, friend_num, key, NULL)) {
+        logger("no friend %u.", friend_num);
+        return;
+    }
+    to_hex(info->key_hex, key, TOX_PUBLIC_KEY_SIZE);
+    info->key_hex[sizeof(info->key_hex) - 1] = '\0';
+
+    uint8_t name[TOX_MAX_NAME_LENGTH];
+    size_t name_size = tox_friend_get_name_size(tox, friend_num, NULL);
+    if (name_size <= sizeof(name) && tox_friend_get_name(tox, friend_num, name, NULL)) {
+        copy_name(info, name, name_size);
+    }
+
+    info->status = tox_friend_get_status(tox, friend_num, NULL);
+    info->connection = tox_friend_get_connection_status(tox, friend_num, NULL);
+    uint64_t last_online = tox_friend_get_last_online(tox, friend_num, NULL);
+    info->last_seen = last_online == UINT64_MAX ? 0 : (time_t) last_online;
+    info->exists = true;
+    count(t, info, 1);
+}
+
+void friends_load(Tox *tox) {
+    const size_t count = tox_self_get_friend_list_size(tox);
+    uint32_t * list = scratch_alloc(count * sizeof(uint32_t));
+    if (list == NULL) {
+        logger("oh no, couldn't allocate memory.");
+        return;
+    }
+    tox_self_get_friend_list(tox, list);
+
+    struct friends_table *t = table();
+    pthread_rwlock_init(&t->lock, NULL);
+    pthread_rwlock_wrlock(&t->lock);
+    for (size_t i = 0; i < count; i++) {
+        fill(t, tox, list[i]);
+    }
+    pthread_rwlock_unlock(&t->lock);
+}
+
+void friends_add(Tox *tox, uint32_t friend_num) {
+    struct friends_table *t = table();
+    pthread_rwlock_wrlock(&t->lock);
+    fill(t, tox, friend_num);
+    pthread_rwlock_unlock(&t->lock);
+}
+
+void friends_set_name(uint32_t friend_num, const uint8_t *name, size_t length) {
+    struct friends_table *t = table();
+    pthread_rwlock_wrlock(&t->lock);
+    if (friend_num < t->size && t->friends[friend_num].exists) {
+        copy_name(&t->friends[friend_num], name, length);
+    }
+    pthread_rwlock_unlock(&t->lock);
+}
+
+void friends_set_status(uint32_t friend_num, TOX_USER_STATUS status) {
+    struct friends_table *t = table();
+    pthread_rwlock_wrlock(&t->lock);
+    if (friend_num < t->size && t->friends[friend_num].exists) {
+        count(t, &t->friends[friend_num], -1);
+        t->friends[friend_num].status = status;
+        count(t, &t->friends[friend_num], 1);
+    }
+    pthread_rwlock_unlock(&t->lock);
+}
+
+void friends_set_connection(uint32_t friend_num, TOX_CONNECTION connection) {
+    struct friends_table *t = table();
+    pthread_rwlock_wrlock(&t->lock);
+    if (friend_num < t->size && t->friends[friend_num].exists) {
+        count(t, &t->friends[friend_num], -1);
+        t->friends[friend_num].connection = connection;
+        t->friends[friend_num].last_seen = time(NULL);
+        count(t, &t->friends[friend_num], 1);
+    }
+    pthread_rwlock_unlock(&t->lock);
+}
+
+const struct friend_info * friend_get(uint32_t friend_num) {
+    const struct friends_table *t = table();
+    if (friend_num < t->size && t->friends[friend_num].exists) {
+        return &t->friends[friend_num];
+    }
+    return NULL;
+}
+
+const char * friend_name(uint32_t friend_num) {
+    const struct friend_info *info = friend_get(friend_num);
+    return info ? info->name : "";
+}
+
+void friend_copy_name(uint32_t friend_num, char *buf, size_t size) {
+    assert (size > 0);
+    struct friends_table *t = table();
+    pthread_rwlock_rdlock(&t->lock);
+    const char *name = friend_num < t->size && t->friends[friend_num].exists
+        ? t->friends[friend_num].name : "";
+    size_t length = strlen(name);
+    if (length >= size) {
+        length = size - 1;
+    }
+    memcpy(buf, name, length);
+    buf[length] = '\0';
+    pthread_rwlock_unlock(&t->lock);
+}
+
+void friends_count(unsigned shard, struct friend_counts *counts) {
+    assert (shard < MAX_SHARDS);
+    const struct friends_table *t = &tables[shard];
+    counts->total = atomic_load(&t->count_total);
+    counts->online = atomic_load(&t->count_online);
+    counts->available = atomic_load(&t->count_status[TOX_USER_STATUS_NONE]);
+    counts->away = atomic_load(&t->count_status[TOX_USER_STATUS_AWAY]);
+    counts->busy = atomic_load(&t->count_status[TOX_USER_STATUS_BUSY]);
+}
+
+void friends_count_all(struct friend_counts *counts) {
+    memset(counts, 0, sizeof(*counts));
+    for (unsigned i = 0; i < g_nshards; i++) {
+        struct friend_counts shard_counts;
+        friends_count(i, &shard_counts);
+        counts->total += shard_counts.total;
+        counts->online += shard_counts.online;
+        counts->available += shard_counts.available;
+        counts->away += shard_counts.away;
+        counts->busy += shard_counts.busy;
+    }
+}
+
+uint32_t friends_end(void) {
+    return table()->size;
+}
+
+void friends_free(void) {
+    for (unsigned i = 0; i < g_nshards; i++) {
+        struct friends_table *t = &tables[i];
+        pthread_rwlock_wrlock(&t->lock);
+        free(t->friends);
+        t->friends = NULL;
+        t->size = 0;
+        pthread_rwlock_unlock(&t->lock);
+        pthread_rwlock_destroy(&t->lock);
+    }
+}
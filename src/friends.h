@@ -0,0 +1,61 @@
+#pragma once
+
+#include <tox/tox.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* what we know about each friend, indexed by friend number and kept current by the tox callbacks,
+   so logging and listings never have to allocate or ask toxcore. written only by the tox thread.
+   every shard has its own table; these work on the current shard's unless they take one. */
+struct friend_info {
+    bool exists;
+    TOX_USER_STATUS status;
+    TOX_CONNECTION connection;
+    time_t last_seen;
+    char key_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    char name[TOX_MAX_NAME_LENGTH + 1];
+};
+
+// fill the table from the friend list. call before the tox thread starts.
+void friends_load(Tox *tox);
+
+void friends_add(Tox *tox, uint32_t friend_num);
+
+void friends_set_name(uint32_t friend_num, const uint8_t *name, size_t length);
+
+void friends_set_status(uint32_t friend_num, TOX_USER_STATUS status);
+
+void friends_set_connection(uint32_t friend_num, TOX_CONNECTION connection);
+
+/* tox thread only. the pointer is good until the next tox callback. NULL for no such friend. */
+const struct friend_info * friend_get(uint32_t friend_num);
+
+// tox thread only. never NULL.
+const char * friend_name(uint32_t friend_num);
+
+// any thread. copies the name, or "" for no such friend.
+void friend_copy_name(uint32_t friend_num, char *buf, size_t size);
+
+struct friend_counts {
+    unsigned total;
+    unsigned online;
+    // online friends by status
+    unsigned available;
+    unsigned away;
+    unsigned busy;
+};
+
+// any thread, O(1)
+void friends_count(unsigned shard, struct friend_counts *counts);
+
+// summed over every shard
+void friends_count_all(struct friend_counts *counts);
+
+// one past the highest friend number in the table, for walking it with friend_get
+uint32_t friends_end(void);
+
+// every shard's table
+void friends_free(void);
@@ -10,16 +10,22 @@ const size_t mrprickles_nstatuses = sizeof(mrprickles_statuses)
                                     / sizeof(mrprickles_statuses[0]);
 
 const char * const help_msg = "list of commands:\ninfo: show stats.\ncallme: launch an audio call.\n"
-    "videocallme: launch a video call.\nonline/away/busy: change my user status\nname: change my name\n"
-    "status: change my status message";
+    "videocallme: launch a video call.\npartyme: join the party line.\ninvite: join my conference.\nonline/away/busy: change my user status\nname: change my name\n"
+    "status: change my status message\nsend me a file and i'll send it right back.";
 
-time_t last_info_change; // always a timestring
 time_t start_time;
 atomic_bool signal_exit = false;
 
 const uint32_t audio_bitrate = 48;
-const uint32_t video_bitrate = 5000;
+const uint32_t audio_bitrate_min = 8;
+const uint32_t audio_bitrate_max = 64;
+const uint32_t video_bitrate = 2500;
+const uint32_t video_bitrate_min = 150;
+const uint32_t video_bitrate_max = 5000;
 
-ToxAV *g_toxAV = NULL;
 pthread_t main_thread;
+struct reactor g_main_reactor;
+
+struct shard g_shards[MAX_SHARDS];
+unsigned g_nshards = 1;
 
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "reactor.h"
+#include "shard.h"
+
 #include <tox/tox.h>
 #include <tox/toxav.h>
 
@@ -18,12 +21,20 @@ extern const char * const help_msg;
 // reset name and status message every 6 hours
 #define RESET_INFO_DELAY 21600
 
-extern time_t last_info_change; // always a timestring
 extern time_t start_time;
 extern atomic_bool signal_exit;
 
+// in kbit/s. calls start at these and the rate controller keeps them within the bounds.
 extern const uint32_t audio_bitrate;
+extern const uint32_t audio_bitrate_min;
+extern const uint32_t audio_bitrate_max;
 extern const uint32_t video_bitrate;
+extern const uint32_t video_bitrate_min;
+extern const uint32_t video_bitrate_max;
 
-extern ToxAV *g_toxAV;
 extern pthread_t main_thread;
+extern struct reactor g_main_reactor;
+
+// set by MRPRICKLES_SHARDS, 1 by default
+extern struct shard g_shards[MAX_SHARDS];
+extern unsigned g_nshards;
@@ -0,0 +1,208 @@
+#include "listing.h"
+
+#include "friends.h"
+#include "outbox.h"
+#include "shard.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// messages to the friend queued or not yet read, listings included
+#define LISTING_WINDOW 4
+#define LISTING_PAGE_MESSAGES 8
+#define MAX_LISTINGS 8
+
+struct listing {
+    bool active;
+    enum listing_kind kind;
+    uint32_t friend_num;
+    uint32_t cursor;         // the next friend to list, or friends_end()
+    unsigned page_messages;  // sent so far on this page
+    bool page_done;
+};
+
+// per shard
+static struct listing all_listings[MAX_SHARDS][MAX_LISTINGS];
+
+static struct listing * shard_listings(void) {
+    assert (shard_current() != NULL);
+    return all_listings[shard_current()->index];
+}
+
+static struct listing * find(uint32_t friend_num) {
+    struct listing *listings = shard_listings();
+    for (size_t i = 0; i < MAX_LISTINGS; i++) {
+        if (listings[i].active && listings[i].friend_num == friend_num) {
+            return &listings[i];
+        }
+    }
+    return NULL;
+}
+
+static int format_line(enum listing_kind kind, uint32_t num, const struct friend_info *info,
+                        char *buf, size_t size) {
+    if (kind == LISTING_KEYS) {
+        return snprintf(buf, size, "%u: %s %s", num, info->name, info->key_hex);
+    }
+
+    if (info->connection == TOX_CONNECTION_NONE) {
+        char since[20] = "a while";
+        struct tm time_struct;
+        if (info->last_seen != 0 && localtime_r(&info->last_seen, &time_struct) != NULL) {
+            strftime(since, sizeof(since), "%b %d", &time_struct);
+        }
+        return snprintf(buf, size, "%u: %s (offline since %s)", num, info->name, since);
+    } else if (info->status == TOX_USER_STATUS_AWAY) {
+        return snprintf(buf, size, "%u: %s (away)", num, info->name);
+    } else if (info->status == TOX_USER_STATUS_BUSY) {
+        return snprintf(buf, size, "%u: %s (busy)", num, info->name);
+    }
+    return snprintf(buf, size, "%u: %s (online)", num, info->name);
+}
+
+static const char more_footer[] = "\n(say 'next' for more.)";
+static const char end_footer[] = "\n(that's everyone.)";
+
+/* moves the cursor past friend numbers nobody has, so it only ever moves forward and a whole
+   listing walks the friend table once. */
+static bool more_friends(struct listing *l) {
+    while (l->cursor < friends_end() && friend_get(l->cursor) == NULL) {
+        l->cursor++;
+    }
+    return l->cursor < friends_end();
+}
+
+/* pack lines from the cursor into msg, which holds TOX_MAX_MESSAGE_LENGTH, and end the page
+   once everyone is listed. a page's last message keeps room for the footer, so a page is never
+   longer than LISTING_PAGE_MESSAGES. returns the length. */
+static size_t build_message(struct listing *l, char *msg) {
+    size_t length = 0;
+    char line[TOX_MAX_MESSAGE_LENGTH];
+    const bool last = l->page_messages + 1 >= LISTING_PAGE_MESSAGES;
+    const size_t room = TOX_MAX_MESSAGE_LENGTH - (last ? sizeof(more_footer) - 1 : 0);
+
+    for (; more_friends(l); l->cursor++) {
+        int n = format_line(l->kind, l->cursor, friend_get(l->cursor), line, sizeof(line));
+        if (n < 0) {
+            continue;
+        }
+        size_t needed = (length ? 1 : 0) + (size_t) n;
+        if (length + needed > room) {
+            break;
+        }
+        if (length) {
+            msg[length++] = '\n';
+        }
+        memcpy(msg + length, line, (size_t) n);
+        length += (size_t) n;
+    }
+
+    const bool more = more_friends(l);
+    if (last || ! more) {
+        const char *footer = more ? more_footer : end_footer;
+        if (length == 0) {
+            footer++; // no leading newline
+        }
+        const size_t footer_length = strlen(footer);
+        if (length + footer_length <= TOX_MAX_MESSAGE_LENGTH) {
+            memcpy(msg + length, footer, footer_length);
+            length += footer_length;
+            l->page_done = true;
+        }
+        /* otherwise the last lines filled this message and the footer follows on its own. */
+    }
+    return length;
+}
+
+/* the outbox retries and tracks receipts, so all a listing does is keep its window full. */
+static void pump(Tox *tox, struct listing *l) {
+    while (! l->page_done && outbox_pending(l->friend_num) < LISTING_WINDOW) {
+        char msg[TOX_MAX_MESSAGE_LENGTH];
+        const size_t length = build_message(l, msg);
+        if (length > 0 && ! outbox_send(tox, l->friend_num, msg, length)) {
+            logger("stopped listing for friend %u", l->friend_num);
+            l->active = false;
+            return;
+        }
+        l->page_messages++;
+    }
+
+    if (l->page_done && outbox_pending(l->friend_num) == 0 && ! more_friends(l)) {
+        l->active = false; // everything has been read
+    }
+}
+
+static void start_page(Tox *tox, struct listing *l) {
+    l->page_messages = 0;
+    l->page_done = false;
+    pump(tox, l);
+}
+
+void listing_start(Tox *tox, uint32_t friend_num, enum listing_kind kind) {
+    struct listing *listings = shard_listings();
+    struct listing *l = find(friend_num);
+    for (size_t i = 0; l == NULL && i < MAX_LISTINGS; i++) {
+        if (! listings[i].active) {
+            l = &listings[i];
+        }
+    }
+    for (size_t i = 0; l == NULL && i < MAX_LISTINGS; i++) {
+        /* someone who stopped at the end of a page and never asked for more. */
+        if (listings[i].page_done && outbox_pending(listings[i].friend_num) == 0) {
+            l = &listings[i];
+        }
+    }
+    if (l == NULL) {
+        const char *reply = "i'm busy listing for other people, try again in a bit.";
+        outbox_send(tox, friend_num, reply, strlen(reply));
+        return;
+    }
+
+    memset(l, 0, sizeof(*l));
+    l->active = true;
+    l->kind = kind;
+    l->friend_num = friend_num;
+    if (kind == LISTING_KEYS) {
+        logger("listing public key for each friend.");
+    }
+    start_page(tox, l);
+}
+
+void listing_next(Tox *tox, uint32_t friend_num) {
+    struct listing *l = find(friend_num);
+    if (l == NULL || ! more_friends(l)) {
+        const char *reply = "there's nothing more to list.";
+        outbox_send(tox, friend_num, reply, strlen(reply));
+        return;
+    }
+    if (! l->page_done) {
+        return; // still sending the current page
+    }
+    start_page(tox, l);
+}
+
+void listing_receipt(Tox *tox, uint32_t friend_num) {
+    struct listing *l = find(friend_num);
+    if (l != NULL) {
+        pump(tox, l);
+    }
+}
+
+void listing_tick(Tox *tox) {
+    struct listing *listings = shard_listings();
+    for (size_t i = 0; i < MAX_LISTINGS; i++) {
+        if (listings[i].active) {
+            pump(tox, &listings[i]);
+        }
+    }
+}
+
+void listing_forget(uint32_t friend_num) {
+    struct listing *l = find(friend_num);
+    if (l != NULL) {
+        l->active = false;
+    }
+}
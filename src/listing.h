@@ -0,0 +1,27 @@
+#pragma once
+
+#include <tox/tox.h>
+
+#include <stdint.h>
+
+/* the friends and keys listings, packed into as few messages as fit and sent a page at a time.
+   only a few messages to the friend are in the outbox at once; more go out as read receipts come back. */
+
+enum listing_kind {
+    LISTING_FRIENDS,
+    LISTING_KEYS,
+};
+
+// send the first page of a listing to friend_num
+void listing_start(Tox *tox, uint32_t friend_num, enum listing_kind kind);
+
+// send the page after the one friend_num saw last
+void listing_next(Tox *tox, uint32_t friend_num);
+
+// one of friend_num's messages was read
+void listing_receipt(Tox *tox, uint32_t friend_num);
+
+// tops up windows that opened without a receipt, when the outbox gave up on one. call every iteration.
+void listing_tick(Tox *tox);
+
+void listing_forget(uint32_t friend_num);
@@ -0,0 +1,409 @@
+#include "log.h"
+
+#include "util.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_SIZE (64 * 1024)
+#define MAX_LINE 2048
+#define WRAP_MARKER 0xFFFFu
+#define LOG_KEEP 3
+
+/* a single producer, single consumer ring of records: a 2 byte length, then the line.
+   a record never wraps; if it doesn't fit before the end, a marker sends the reader back to 0. */
+struct log_ring {
+    struct log_ring *next;
+    _Atomic size_t head; // written by the owning thread
+    _Atomic size_t tail; // written by the log writer
+    atomic_uint_fast64_t dropped;
+    // the thread has exited. the writer frees the ring once it has drained it.
+    atomic_bool orphaned;
+    uint8_t data[RING_SIZE];
+};
+
+/* pushed onto by the threads as they first log. only the writer unlinks, so it may
+   change any link but the head without racing them. */
+static _Atomic(struct log_ring *) rings = NULL;
+static atomic_uint_fast64_t total_dropped = 0;
+static _Thread_local struct log_ring *my_ring = NULL;
+static _Thread_local bool my_ring_failed = false;
+// its destructor orphans a thread's ring
+static pthread_key_t ring_key;
+static bool ring_key_made = false;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_bool async = false;
+static atomic_bool stopping = false;
+static pthread_t writer_thread;
+/* the writer sleeps on wake_cond once every ring is empty. writer_asleep is set before it
+   looks one last time, and a thread that has just logged checks it, so one of them always
+   sees the other and no line waits for a wakeup that never comes. */
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static atomic_bool writer_asleep = false;
+// serialises synchronous writes and the writer's output
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static enum log_level min_level = LOG_INFO;
+static FILE *log_file = NULL;
+static char *log_file_name = NULL;
+static size_t log_file_size = 0;
+static size_t log_file_max = 10 * 1024 * 1024;
+
+static const char * const level_tags[] = {"debug: ", "", "warning: ", "error: "};
+
+// format the timestamp once per second per thread
+static size_t timestamp(char *buf) {
+    static _Thread_local time_t cached_time = 0;
+    static _Thread_local char cached[32];
+    static _Thread_local size_t cached_length = 0;
+
+    const time_t now = time(NULL);
+    if (now != cached_time) {
+        struct tm time_struct;
+        localtime_r(&now, &time_struct);
+        cached_length = strftime(cached, sizeof(cached), "[%b %d %T] ", &time_struct);
+        cached_time = now;
+    }
+    memcpy(buf, cached, cached_length);
+    return cached_length;
+}
+
+static void rotate(void) {
+    fclose(log_file);
+    log_file = NULL;
+
+    const size_t size = strlen(log_file_name) + 8;
+    char *from = malloc(size);
+    char *to = malloc(size);
+    if (from != NULL && to != NULL) {
+        for (int i = LOG_KEEP - 1; i >= 1; i--) {
+            snprintf(from, size, "%s.%d", log_file_name, i);
+            snprintf(to, size, "%s.%d", log_file_name, i + 1);
+            rename(from, to);
+        }
+        snprintf(to, size, "%s.1", log_file_name);
+        rename(log_file_name, to);
+    }
+    free(from);
+    free(to);
+
+    log_file = fopen(log_file_name, "a");
+    log_file_size = 0;
+}
+
+// output_lock must be held
+static void output(const char *line, size_t length) {
+    fwrite(line, 1, length, stdout);
+    if (log_file != NULL) {
+        fwrite(line, 1, length, log_file);
+        log_file_size += length;
+        if (log_file_size >= log_file_max) {
+            rotate();
+        }
+    }
+}
+
+static void flush_output(void) {
+    fflush(stdout);
+    if (log_file != NULL) {
+        fflush(log_file);
+    }
+}
+
+static void orphan_ring(void *arg) {
+    struct log_ring *ring = arg;
+    // anything logged from here on, by later destructors, is written synchronously
+    my_ring = NULL;
+    my_ring_failed = true;
+    atomic_store(&ring->orphaned, true);
+}
+
+static void make_ring_key(void) {
+    ring_key_made = pthread_key_create(&ring_key, orphan_ring) == 0;
+}
+
+static struct log_ring * get_ring(void) {
+    if (my_ring == NULL && ! my_ring_failed) {
+        struct log_ring *ring = calloc(1, sizeof(struct log_ring));
+        if (ring == NULL) {
+            my_ring_failed = true;
+            return NULL;
+        }
+        // without the key the ring just lives as long as the process
+        pthread_once(&ring_key_once, make_ring_key);
+        if (ring_key_made) {
+            pthread_setspecific(ring_key, ring);
+        }
+        ring->next = atomic_load(&rings);
+        while (! atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+        }
+        my_ring = ring;
+    }
+    return my_ring;
+}
+
+static bool ring_put(struct log_ring *ring, const char *line, size_t length) {
+    const size_t record = 2 + length;
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    const size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t start = head;
+
+    if (head >= tail && RING_SIZE - head < record) {
+        /* doesn't fit before the end, so wrap. head must never catch up with tail,
+           or a full ring would look empty. */
+        if (tail <= record) {
+            return false;
+        }
+        if (RING_SIZE - head >= 2) {
+            ring->data[head] = WRAP_MARKER & 0xFF;
+            ring->data[head + 1] = WRAP_MARKER >> 8;
+        }
+        start = 0;
+    } else if (start < tail && tail - start <= record) {
+        return false;
+    }
+
+    ring->data[start] = (uint8_t) (length & 0xFF);
+    ring->data[start + 1] = (uint8_t) (length >> 8);
+    memcpy(&ring->data[start + 2], line, length);
+    atomic_store_explicit(&ring->head, start + record, memory_order_release);
+    return true;
+}
+
+// returns whether anything was written. output_lock must be held.
+static bool ring_drain(struct log_ring *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    bool wrote = false;
+
+    while (tail != head) {
+        if (RING_SIZE - tail < 2) {
+            tail = 0;
+            continue;
+        }
+        size_t length = ring->data[tail] | (size_t) ring->data[tail + 1] << 8;
+        if (length == WRAP_MARKER) {
+            tail = 0;
+            continue;
+        }
+        output((const char *) &ring->data[tail + 2], length);
+        tail += 2 + length;
+        wrote = true;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    uint_fast64_t dropped = atomic_exchange(&ring->dropped, 0);
+    if (dropped > 0) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "(%llu log lines dropped)\n", (unsigned long long) dropped);
+        output(line, (size_t) n);
+        wrote = true;
+    }
+    return wrote;
+}
+
+// output_lock must be held
+static void unlink_ring(struct log_ring *ring) {
+    struct log_ring *head = ring;
+    if (atomic_compare_exchange_strong(&rings, &head, ring->next)) {
+        return;
+    }
+    // a thread pushed a new ring in front of it
+    struct log_ring *prev = head;
+    while (prev->next != ring) {
+        prev = prev->next;
+    }
+    prev->next = ring->next;
+}
+
+static bool drain_all(void) {
+    bool wrote = false;
+    pthread_mutex_lock(&output_lock);
+    for (struct log_ring *ring = atomic_load(&rings), *next; ring != NULL; ring = next) {
+        // looked at first, so the last lines of a thread that has exited are written before it goes
+        const bool orphaned = atomic_load(&ring->orphaned);
+        wrote |= ring_drain(ring);
+        next = ring->next;
+        if (orphaned) {
+            unlink_ring(ring);
+            free(ring);
+        }
+    }
+    if (wrote) {
+        flush_output();
+    }
+    pthread_mutex_unlock(&output_lock);
+    return wrote;
+}
+
+// anything for the writer to do
+static bool pending(void) {
+    for (struct log_ring *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        if (atomic_load(&ring->head) != atomic_load(&ring->tail)
+                || atomic_load(&ring->dropped) > 0 || atomic_load(&ring->orphaned)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// after a thread has put a line in its ring, or dropped one
+static void wake_writer(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&writer_asleep, memory_order_relaxed)) {
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_lock);
+    }
+}
+
+static void * run_writer(void *arg) {
+    (void) arg;
+    // signals are for the main thread, whatever the mask was when log_init ran
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    while (! atomic_load(&stopping)) {
+        if (drain_all()) {
+            continue;
+        }
+        pthread_mutex_lock(&wake_lock);
+        atomic_store(&writer_asleep, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (! atomic_load(&stopping) && ! pending()) {
+            pthread_cond_wait(&wake_cond, &wake_lock);
+        }
+        atomic_store(&writer_asleep, false);
+        pthread_mutex_unlock(&wake_lock);
+    }
+    return NULL;
+}
+
+void log_init(void) {
+    const char *level = getenv("MRPRICKLES_LOG_LEVEL");
+    if (level != NULL) {
+        if (strcmp(level, "debug") == 0) {
+            min_level = LOG_DEBUG;
+        } else if (strcmp(level, "warn") == 0) {
+            min_level = LOG_WARN;
+        } else if (strcmp(level, "error") == 0) {
+            min_level = LOG_ERROR;
+        }
+    }
+
+    const char *max_mb = getenv("MRPRICKLES_LOG_MAX_MB");
+    if (max_mb != NULL && atol(max_mb) > 0) {
+        log_file_max = (size_t) atol(max_mb) * 1024 * 1024;
+    }
+
+    const char *file_name = getenv("MRPRICKLES_LOG_FILE");
+    if (file_name != NULL) {
+        log_file_name = strdup(file_name);
+        log_file = fopen(file_name, "a");
+        struct stat st;
+        if (log_file == NULL) {
+            logger("could not open log file %s", file_name);
+        } else if (stat(file_name, &st) == 0) {
+            log_file_size = (size_t) st.st_size;
+        }
+    }
+
+    atomic_store(&stopping, false);
+    if (pthread_create(&writer_thread, NULL, &run_writer, NULL) == 0) {
+        atomic_store(&async, true);
+    } else {
+        logger("could not start the log writer, logging synchronously");
+    }
+}
+
+void log_shutdown(void) {
+    if (atomic_exchange(&async, false)) {
+        atomic_store(&stopping, true);
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_lock);
+        pthread_join(writer_thread, NULL);
+    }
+    drain_all();
+
+    pthread_mutex_lock(&output_lock);
+    if (log_file != NULL) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+    free(log_file_name);
+    log_file_name = NULL;
+    pthread_mutex_unlock(&output_lock);
+}
+
+static void vlog_at(enum log_level level, const char *format, va_list ap) {
+    if (level < min_level) {
+        return;
+    }
+
+    char line[MAX_LINE];
+    size_t length = timestamp(line);
+    const size_t tag_length = strlen(level_tags[level]);
+    memcpy(line + length, level_tags[level], tag_length);
+    length += tag_length;
+
+    int n = vsnprintf(line + length, sizeof(line) - length - 1, format, ap);
+    if (n > 0) {
+        length += (size_t) n < sizeof(line) - length - 1 ? (size_t) n : sizeof(line) - length - 2;
+    }
+    line[length++] = '\n';
+
+    struct log_ring *ring = atomic_load(&async) ? get_ring() : NULL;
+    if (ring == NULL) {
+        pthread_mutex_lock(&output_lock);
+        output(line, length);
+        flush_output();
+        pthread_mutex_unlock(&output_lock);
+    } else {
+        if (! ring_put(ring, line, length)) {
+            atomic_fetch_add(&ring->dropped, 1);
+            atomic_fetch_add(&total_dropped, 1);
+        }
+        wake_writer();
+    }
+}
+
+void log_at(enum log_level level, const char * format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    vlog_at(level, format, ap);
+    va_end(ap);
+}
+
+void logger(const char * format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    vlog_at(LOG_INFO, format, ap);
+    va_end(ap);
+}
+
+uint64_t log_dropped(void) {
+    return atomic_load(&total_dropped);
+}
+
+bool log_ratelimit_allow(struct log_ratelimit *rl, unsigned interval_ms, unsigned *suppressed) {
+    const uint64_t now = monotonic_ns();
+    uint64_t next = atomic_load_explicit(&rl->next_ns, memory_order_relaxed);
+    if (now < next || ! atomic_compare_exchange_strong(&rl->next_ns, &next,
+                now + (uint64_t) interval_ms * 1000000u)) {
+        atomic_fetch_add_explicit(&rl->suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+    *suppressed = atomic_exchange(&rl->suppressed, 0);
+    return true;
+}
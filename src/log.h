@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* each thread formats its lines into a buffer of its own, without locks, and a background
+   thread writes them out. a slow terminal or disk drops lines rather than stalling iteration.
+   the writer sleeps while there's nothing to write, and a thread's buffer is freed after it exits.
+
+   MRPRICKLES_LOG_LEVEL   debug, info (the default), warn or error
+   MRPRICKLES_LOG_FILE    also append to this file...
+   MRPRICKLES_LOG_MAX_MB  ...rotating it to .1, .2, .3 once it is this big (default 10) */
+
+enum log_level {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+};
+
+// until this is called lines are written synchronously
+void log_init(void);
+
+// write out everything buffered and go back to writing synchronously
+void log_shutdown(void);
+
+void log_at(enum log_level level, const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+void logger(const char * format, ...) __attribute__((format(printf, 1, 2)));
+
+// lines lost because a thread's buffer was full
+uint64_t log_dropped(void);
+
+struct log_ratelimit {
+    _Atomic uint64_t next_ns;
+    atomic_uint suppressed;
+};
+
+// true if the call site may log now. *suppressed is how many lines it skipped since last time.
+bool log_ratelimit_allow(struct log_ratelimit *rl, unsigned interval_ms, unsigned *suppressed);
+
+/* log at most once every interval_ms from this call site. */
+#define log_ratelimited(interval_ms, level, ...) do { \
+        static struct log_ratelimit log_rl_; \
+        unsigned log_suppressed_; \
+        if (log_ratelimit_allow(&log_rl_, (interval_ms), &log_suppressed_)) { \
+            if (log_suppressed_ > 0) { \
+                log_at((level), "(%u similar lines suppressed)", log_suppressed_); \
+            } \
+            log_at((level), __VA_ARGS__); \
+        } \
+    } while (0)
@@ -1,15 +1,67 @@
 #include "messaging.h"
 
+#include "admin.h"
+#include "calls.h"
+#include "cmdqueue.h"
+#include "conference.h"
+#include "file_echo.h"
+#include "friends.h"
 #include "globals.h"
+#include "listing.h"
+#include "metrics.h"
+#include "outbox.h"
+#include "profile.h"
+#include "ratelimit.h"
 #include "util.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+/* where replies go: back to the friend, or into the conference the command came from.
+   every shard's tox thread has its own. */
+static _Thread_local struct {
+    bool conference;
+    uint32_t num;
+} reply_to;
+
+static void send_reply(Tox *tox, uint32_t friend_num, const char *reply) {
+    if (reply_to.conference) {
+        conference_send(tox, reply_to.num, reply, strlen(reply));
+    } else {
+        outbox_send(tox, friend_num, reply, strlen(reply));
+    }
+}
+
+// text too long for one message goes out in several, split between lines
+static void send_reply_lines(Tox *tox, uint32_t friend_num, const char *text) {
+    char msg[TOX_MAX_MESSAGE_LENGTH + 1];
+    while (*text != '\0') {
+        size_t length = strlen(text);
+        if (length > TOX_MAX_MESSAGE_LENGTH) {
+            // the last line break that fits, or a hard cut for a line longer than a message
+            length = TOX_MAX_MESSAGE_LENGTH;
+            for (size_t i = TOX_MAX_MESSAGE_LENGTH; i > 0; i--) {
+                if (text[i] == '\n') {
+                    length = i;
+                    break;
+                }
+            }
+        }
+        memcpy(msg, text, length);
+        msg[length] = '\0';
+        send_reply(tox, friend_num, msg);
+        text += length;
+        if (*text == '\n') {
+            text++;
+        }
+    }
+}
+
 static void send_info_message(Tox* tox, uint32_t friend_num) {
     char msg[TOX_MAX_MESSAGE_LENGTH];
 
@@ -19,193 +71,334 @@ static void send_info_message(Tox* tox, uint32_t friend_num) {
         logger("unable to get hostname");
     } else {
         snprintf(msg, sizeof(msg), "%s on %s", MRPRICKLES_VERSION, hostname);
-        tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-            (uint8_t *) msg, strlen(msg), NULL);
+        send_reply(tox, friend_num, msg);
     }
 
     time_t cur_time = time(NULL);
     get_elapsed_time_str(msg, sizeof(msg), cur_time-start_time);
-    tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-            (uint8_t *) msg, strlen(msg), NULL);
-
-    snprintf(msg, sizeof(msg), "friends: %zu (%u online)",
-            tox_self_get_friend_list_size(tox),
-            get_online_friend_count(tox));
-    tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-            (uint8_t *) msg, strlen(msg), NULL);
-}
-
-static void send_friends_list_message(Tox* tox, uint32_t friend_num) {
-    size_t friend_count = tox_self_get_friend_list_size(tox);
-    uint32_t * friend_list = calloc(sizeof(uint32_t), friend_count);
-    tox_self_get_friend_list(tox, friend_list);
-
-    for (uint32_t i = 0; i < friend_count; i++) {
-        TOX_ERR_FRIEND_QUERY err;
-        size_t name_size = tox_friend_get_name_size(tox, i, &err);
-        if (err != TOX_ERR_FRIEND_QUERY_OK) {
-            if (err == TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND) {
-                logger("no friend %u.", i);
-            } else {
-                puts("wait, what? this shouldn't happen.");
-            }
-            continue;
-        }
+    send_reply(tox, friend_num, msg);
 
-        uint8_t *friend_name;
-        friend_name_from_num(&friend_name, tox, i);
+    struct friend_counts counts;
+    friends_count_all(&counts);
+    snprintf(msg, sizeof(msg), "friends: %u (%u online: %u available, %u away, %u busy)",
+            counts.total, counts.online, counts.available, counts.away, counts.busy);
+    send_reply(tox, friend_num, msg);
 
-        // what is the status of an offline friend?
-        TOX_USER_STATUS status = tox_friend_get_status(tox, i, &err);
-        if (err != TOX_ERR_FRIEND_QUERY_OK) {
-            puts("could not get friends status");
-            continue;
-        }
+    snprintf(msg, sizeof(msg), "conferences: %zu", tox_conference_get_chatlist_size(tox));
+    send_reply(tox, friend_num, msg);
 
-        // enough space for name, 10-digit number, status
-        size_t msg_size = name_size + 24;
-        char * msg = calloc(msg_size, sizeof(char));
+    if (g_nshards > 1) {
+        // new friends should go where there is the most room
+        snprintf(msg, sizeof(msg), "i'm %u cacti. tell your friends to add this one: %s",
+                g_nshards, shard_least_loaded()->address);
+        send_reply(tox, friend_num, msg);
+    }
+}
 
-        if (tox_friend_get_connection_status(tox, friend_list[i], NULL)
-                == TOX_CONNECTION_NONE) {
-            snprintf(msg, msg_size, "%u: %s (offline)", i, friend_name);
-        } else {
-            if (status == TOX_USER_STATUS_NONE) {
-                snprintf(msg, msg_size, "%u: %s (online)", i, friend_name);
-            } else if (status == TOX_USER_STATUS_AWAY) {
-                snprintf(msg, msg_size, "%u: %s (away)", i, friend_name);
-            } else if (status == TOX_USER_STATUS_BUSY) {
-                snprintf(msg, msg_size, "%u: %s (busy)", i, friend_name);
-            }
-        }
+static void info_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    send_info_message(tox, friend_num);
+}
+
+static void friends_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    listing_start(tox, friend_num, LISTING_FRIENDS);
+}
 
-        free(friend_name);
-        tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-                (uint8_t *) msg, strlen(msg), NULL);
-        free(msg);
+static void keys_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    listing_start(tox, friend_num, LISTING_KEYS);
+}
+
+static void next_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    listing_next(tox, friend_num);
+}
+
+static void calls_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    char report[TOX_MAX_MESSAGE_LENGTH];
+    calls_report(report, sizeof(report));
+    send_reply(tox, friend_num, report);
+}
+
+// add another report on a line of its own, if there's room
+static void append_report(char *buf, size_t size, void (*report)(char *buf, size_t size)) {
+    const size_t used = strlen(buf);
+    if (used + 1 < size) {
+        buf[used] = '\n';
+        report(buf + used + 1, size - used - 1);
     }
-    free(friend_list);
 }
 
-static void send_keys_message(Tox* tox, uint32_t friend_num) {
-    size_t friend_count = tox_self_get_friend_list_size(tox);
+static void queues_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    char report[TOX_MAX_MESSAGE_LENGTH];
+    cmdqueue_report(report, sizeof(report));
+    append_report(report, sizeof(report), profile_report);
+    append_report(report, sizeof(report), outbox_report);
+    append_report(report, sizeof(report), file_echo_report);
+    send_reply(tox, friend_num, report);
+}
 
-    logger("listing public key for each friend.");
-    for (uint32_t i = 0; i < friend_count; i++) {
-        TOX_ERR_FRIEND_QUERY err;
-        size_t name_size = tox_friend_get_name_size(tox, i, &err);
-        if (err != TOX_ERR_FRIEND_QUERY_OK) {
-            if (err == TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND) {
-                logger("no friend %u.", i);
-            } else {
-                puts("wait, what? this shouldn't happen.");
-            }
-            continue;
-        }
+// a few messages' worth, every counter and histogram
+static void stats_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    char report[4 * TOX_MAX_MESSAGE_LENGTH];
+    metrics_report(report, sizeof(report));
+    send_reply_lines(tox, friend_num, report);
+}
+
+static void name_command(Tox *tox, GCC_UNUSED uint32_t friend_num, const char *new_name) {
+    tox_self_set_name(tox, (const uint8_t *) new_name, strlen(new_name), NULL);
+    shard_current()->last_info_change = time(NULL);
+}
+
+static void status_command(Tox *tox, GCC_UNUSED uint32_t friend_num, const char *new_status) {
+    tox_self_set_status_message(tox, (const uint8_t *) new_status, strlen(new_status), NULL);
+    shard_current()->last_info_change = time(NULL);
+}
+
+static void busy_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    tox_self_set_status(tox, TOX_USER_STATUS_BUSY);
+    send_reply(tox, friend_num, "leave me alone; i'm busy.");
+}
+
+static void away_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    tox_self_set_status(tox, TOX_USER_STATUS_AWAY);
+    send_reply(tox, friend_num, "i'm not here right now.");
+}
+
+static void online_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    tox_self_set_status(tox, TOX_USER_STATUS_NONE);
+    send_reply(tox, friend_num, "sup? sup brah?");
+}
+
+static void reset_command(Tox *tox, GCC_UNUSED uint32_t friend_num, GCC_UNUSED const char *arg) {
+    reset_info(tox);
+}
 
-        uint8_t *friend_name;
-        friend_name_from_num(&friend_name, tox, i);
+static void callme_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    if (! ratelimit_allow(LIMIT_CALL, friend_num)) {
+        send_reply(tox, friend_num, "i'm all called out. try again later.");
+        return;
+    }
+    post_call(friend_num, audio_bitrate, 0);
+}
 
-        // enough space for a number, the name, the pubkey
-        const size_t msg_size = 10 + name_size + (2 * TOX_PUBLIC_KEY_SIZE);
-        char * const msg = calloc(msg_size, sizeof(char));
+static void videocallme_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    if (! ratelimit_allow(LIMIT_CALL, friend_num)) {
+        send_reply(tox, friend_num, "i'm all called out. try again later.");
+        return;
+    }
+    post_call(friend_num, audio_bitrate, video_bitrate);
+}
 
-        TOX_ERR_FRIEND_GET_PUBLIC_KEY err2;
-        uint8_t pubkey_bin[TOX_PUBLIC_KEY_SIZE];
-        bool ok = tox_friend_get_public_key(tox, i, pubkey_bin, &err2);
-        if ((! ok) || (err2 != TOX_ERR_FRIEND_GET_PUBLIC_KEY_OK)) {
-            logger("can't get friend %u's key.", i);
-            continue;
+static void partyme_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    if (! ratelimit_allow(LIMIT_CALL, friend_num)) {
+        send_reply(tox, friend_num, "i'm all called out. try again later.");
+        return;
+    }
+    post_party_call(friend_num);
+}
+
+static void invite_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    if (! conference_invite_friend(tox, friend_num)) {
+        send_reply(tox, friend_num, "the party's off, sorry. try again later.");
+    }
+}
+
+// every shard's friends hear it. the other shards start theirs when they next drain their queue.
+static void broadcast_command(Tox *tox, uint32_t friend_num, const char *message) {
+    const size_t length = strlen(message);
+    if (! broadcast_start(message, length)) {
+        send_reply(tox, friend_num, "i'm still shouting the last few, try again in a bit.");
+        return;
+    }
+    for (unsigned i = 0; i < g_nshards; i++) {
+        if (&g_shards[i] != shard_current()) {
+            post_broadcast(&g_shards[i], message, length);
         }
+    }
+    send_reply(tox, friend_num, "spreading the word.");
+}
+
+static void filecaps_command(Tox *tox, uint32_t friend_num, const char *arg) {
+    uint64_t max_mb;
+    unsigned max_transfers;
+    if (sscanf(arg, "%" SCNu64 " %u", &max_mb, &max_transfers) != 2 || max_mb == 0 || max_mb > UINT32_MAX) {
+        send_reply(tox, friend_num, "filecaps <largest file in MB> <transfers at once>");
+        return;
+    }
+    file_echo_set_caps(max_mb, max_transfers);
+    send_reply(tox, friend_num, max_transfers ? "got it." : "no more files, then.");
+}
+
+static void help_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    /* Send usage instructions in new message. */
+    send_reply(tox, friend_num, help_msg);
+}
+
+static void suicide_command(Tox *tox, uint32_t friend_num, GCC_UNUSED const char *arg) {
+    send_reply(tox, friend_num, "so it has come to this...");
+    signal_exit = true;
+    logger("sending SIGINT");
+    int success = pthread_kill(main_thread, SIGINT);
+    assert (success == 0);
+}
+
+struct command {
+    const char * const name;
+    // arg is the null-terminated text after the name, or NULL if the command takes none
+    void (* const handler)(Tox *tox, uint32_t friend_num, const char *arg);
+    // only the admin may use it, see admin.h. everyone else gets the denied reply.
+    const bool admin_only;
+    const char * const denied;
+    // the name must be followed by a space and some text
+    const bool takes_arg;
+    // works in conferences too. the handler gets UINT32_MAX for the friend and send_reply goes to the conference.
+    const bool in_conferences;
+};
+
+/* a message runs the longest command its start matches ("infoooo" is info), otherwise it is echoed.
+   names must be lowercase letters. */
+static const struct command commands[] = {
+    {"info",        info_command,        false, NULL, false, true},
+    {"friends",     friends_command,     false, NULL, false, false},
+    {"keys",        keys_command,        true,  "i'll show you mine if you show me yours.", false, false},
+    {"next",        next_command,        false, NULL, false, false},
+    {"calls",       calls_command,       true,  "mind your own business.", false, false},
+    {"queues",      queues_command,      true,  "mind your own business.", false, false},
+    {"stats",       stats_command,       true,  "mind your own business.", false, false},
+    {"name",        name_command,        false, NULL, true, true},
+    {"status",      status_command,      false, NULL, true, true},
+    {"busy",        busy_command,        false, NULL, false, true},
+    {"away",        away_command,        false, NULL, false, true},
+    {"online",      online_command,      false, NULL, false, true},
+    {"reset",       reset_command,       true,  "you'd better reset yourself before you wreck yourself.", false, false},
+    {"callme",      callme_command,      false, NULL, false, false},
+    {"videocallme", videocallme_command, false, NULL, false, false},
+    {"partyme",     partyme_command,     false, NULL, false, false},
+    {"invite",      invite_command,      false, NULL, false, false},
+    {"broadcast",   broadcast_command,   true,  "get your own soapbox.", true, false},
+    {"filecaps",    filecaps_command,    true,  "mind your own business.", true, false},
+    {"help",        help_command,        false, NULL, false, true},
+    {"suicide",     suicide_command,     true,  "...?", false, false},
+};
+#define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
+
+/* the command names compiled into a trie over 'a'..'z', so matching a message costs
+   at most the length of the longest name no matter how many commands there are. */
+#define TRIE_ALPHABET 26
+#define TRIE_MAX_NODES 128
 
-        const uint8_t hex_length = (TOX_PUBLIC_KEY_SIZE * 2) + 1;
-        char * const pubkey_hex = calloc(hex_length, sizeof(char));
-        to_hex(pubkey_hex, pubkey_bin, TOX_PUBLIC_KEY_SIZE);
-        pubkey_hex[hex_length-1] = '\0';
-        snprintf(msg, msg_size, "%u: %s %s", i, friend_name, pubkey_hex);
-        puts(msg);
+static struct trie_node {
+    int16_t next[TRIE_ALPHABET]; // 0 means no child, the root is never anyone's child
+    int16_t command;             // -1 if no command ends here
+} trie[TRIE_MAX_NODES];
+static size_t trie_size = 0;
 
-        tox_friend_send_message(tox, friend_num,
-                                TOX_MESSAGE_TYPE_NORMAL,
-                                (uint8_t *) msg, strlen(msg), NULL);
-        free(pubkey_hex);
-        free(msg);
-        free(friend_name);
+static int16_t new_trie_node(void) {
+    assert (trie_size < TRIE_MAX_NODES);
+    struct trie_node *node = &trie[trie_size];
+    memset(node->next, 0, sizeof(node->next));
+    node->command = -1;
+    return (int16_t) trie_size++;
+}
+
+void messaging_init(void) {
+    trie_size = 0;
+    new_trie_node();
+
+    for (size_t i = 0; i < NCOMMANDS; i++) {
+        int16_t node = 0;
+        for (const char *c = commands[i].name; *c != '\0'; c++) {
+            assert (*c >= 'a' && *c <= 'z');
+            const int slot = *c - 'a';
+            if (trie[node].next[slot] == 0) {
+                const int16_t child = new_trie_node();
+                trie[node].next[slot] = child;
+            }
+            node = trie[node].next[slot];
+        }
+        assert (trie[node].command == -1); // no duplicate names
+        trie[node].command = (int16_t) i;
     }
 }
 
-void reply_friend_message(Tox *tox, uint32_t friend_num, char *message, size_t length) {
+// the command matching the start of message, with *name_length set to the length of its name
+static const struct command * match_command(const char *message, size_t length, size_t *name_length) {
+    const struct command *match = NULL;
+    int16_t node = 0;
+    for (size_t i = 0; i < length; i++) {
+        const char c = message[i];
+        if (c < 'a' || c > 'z' || (node = trie[node].next[c - 'a']) == 0) {
+            break;
+        }
+        if (trie[node].command != -1) {
+            match = &commands[trie[node].command];
+            *name_length = i + 1;
+        }
+    }
+    return match;
+}
+
+// the command the message asks for, with *arg set to its argument, or NULL to echo the message
+static const struct command * parse(const char *message, size_t length, const char **arg) {
     assert (length == strlen(message)); // note that the null byte is not included.
     assert (length <= TOX_MAX_MESSAGE_LENGTH);
-    if (!strncmp("info", message, 4)) {
-        send_info_message(tox, friend_num);
-    } else if (!strncmp("friends", message, 7)) {
-        send_friends_list_message(tox, friend_num);
-    } else if (!strncmp("keys", message, 4)) {
-        if (friend_num == 0) { /* friend 0 is considered the admin. */
-            send_keys_message(tox, friend_num);
-        } else {
-            char *reply = "i'll show you mine if you show me yours.";
-            tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-                (uint8_t *) reply, strlen(reply), NULL);
-        }
-    } else if (!strncmp("name ", message, 5) && sizeof(message) > 5) {
-        char * new_name = message + 5;
-        tox_self_set_name(tox, (uint8_t *) new_name, strlen(new_name), NULL);
-        last_info_change = time(NULL);
-    } else if (!strncmp("status ", message, 7) && sizeof(message) > 7) {
-        char * new_status = message + 7;
-        tox_self_set_status_message(tox, (uint8_t *) new_status,
-                strlen(new_status),NULL);
-        last_info_change = time(NULL);
-    } else if (!strncmp("busy", message, 4)) {
-        tox_self_set_status(tox, TOX_USER_STATUS_BUSY);
-        const char *reply = "leave me alone; i'm busy.";
-        tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-                (const uint8_t *) reply, strlen(reply), NULL);
-    } else if (!strncmp("away", message, 4)) {
-        tox_self_set_status(tox, TOX_USER_STATUS_AWAY);
-        const char *reply = "i'm not here right now.";
-        tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-                (const uint8_t *) reply, strlen(reply), NULL);
-    } else if (!strncmp("online", message, 6)) {
-        tox_self_set_status(tox, TOX_USER_STATUS_NONE);
-        const char *reply = "sup? sup brah?";
-        tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-                (const uint8_t *) reply, strlen(reply), NULL);
-    } else if (!strncmp("reset", message, 5)) {
-        if (friend_num == 0) { /* friend 0 is considered the admin. */
-            reset_info(tox);
+    assert (trie_size > 0); // messaging_init must be called first
+
+    size_t name_length = 0;
+    const struct command *cmd = match_command(message, length, &name_length);
+    *arg = NULL;
+    if (cmd != NULL && cmd->takes_arg) {
+        if (length > name_length + 1 && message[name_length] == ' ') {
+            *arg = message + name_length + 1;
         } else {
-            char *reply = "you'd better reset yourself before you wreck yourself.";
-            tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-                (const uint8_t *) reply, strlen(reply), NULL);
+            cmd = NULL;
         }
-    } else if (!strncmp("callme", message, 6)) {
-        toxav_call(g_toxAV, friend_num, audio_bitrate, 0, NULL);
-    } else if (!strncmp ("videocallme", message, 11)) {
-        toxav_call(g_toxAV, friend_num, audio_bitrate, video_bitrate, NULL);
-    } else if (!strncmp ("help", message, 4)) {
-        /* Send usage instructions in new message. */
-        tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-                (const uint8_t*) help_msg, strlen (help_msg), NULL);
-    } else if (!strncmp ("suicide", message, 7)) {
-        if (friend_num == 0) { /* friend 0 is considered the admin. */
-            const char *reply = "so it has come to this...";
-            tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-                    (const uint8_t *) reply, strlen(reply), NULL);
-            signal_exit = true;
-            logger("sending SIGINT");
-            int success = pthread_kill(main_thread, SIGINT);
-            assert (success == 0);
-        } else {
-            const char *reply = "...?";
-            tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-                    (const uint8_t *) reply, strlen(reply), NULL);
+    }
+    return cmd;
+}
+
+void reply_friend_message(Tox *tox, uint32_t friend_num, char *message, size_t length) {
+    reply_to.conference = false;
+    const char *arg;
+    const struct command *cmd = parse(message, length, &arg);
+
+    if (cmd == NULL) {
+        /* Just repeat what has been said like the nymph Echo. */
+        outbox_send(tox, friend_num, message, length);
+    } else if (cmd->admin_only && ! admin_is(tox, friend_num)) {
+        send_reply(tox, friend_num, cmd->denied);
+    } else {
+        cmd->handler(tox, friend_num, arg);
+    }
+}
+
+// our name appears somewhere in the message, in any case
+static bool mentions_us(const Tox *tox, const char *message) {
+    char name[TOX_MAX_NAME_LENGTH + 1];
+    const size_t length = tox_self_get_name_size(tox);
+    if (length == 0 || length > TOX_MAX_NAME_LENGTH) {
+        return false;
+    }
+    tox_self_get_name(tox, (uint8_t *) name);
+    name[length] = '\0';
+    return strcasestr(message, name) != NULL;
+}
+
+/* unlike friends, a conference isn't echoed: two bots in one would echo each other forever.
+   plain text is ignored unless it mentions us, and then the reply doesn't. */
+void reply_conference_message(Tox *tox, uint32_t conference_num, char *message, size_t length) {
+    reply_to.conference = true;
+    reply_to.num = conference_num;
+    const char *arg;
+    const struct command *cmd = parse(message, length, &arg);
+
+    if (cmd == NULL) {
+        if (mentions_us(tox, message)) {
+            send_reply(tox, UINT32_MAX, "that's me. say help to see what i can do.");
         }
+    } else if (! cmd->in_conferences) {
+        // peers aren't necessarily friends, and nobody here is the admin
+        send_reply(tox, UINT32_MAX, "ask me that in private.");
     } else {
-        /* Just repeat what has been said like the nymph Echo. */
-        tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
-                (const uint8_t *) message, length, NULL);
+        cmd->handler(tox, UINT32_MAX, arg);
     }
+    reply_to.conference = false;
 }
@@ -2,4 +2,10 @@
 
 #include <tox/tox.h>
 
+// build the command lookup table. call once before any messages arrive.
+void messaging_init(void);
+
 void reply_friend_message(Tox *tox, uint32_t friend_num, char *dest_msg, size_t length);
+
+// the same for a message in a conference, with replies going to the whole conference
+void reply_conference_message(Tox *tox, uint32_t conference_num, char *dest_msg, size_t length);
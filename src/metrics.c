@@ -0,0 +1,349 @@
+#include "metrics.h"
+
+#include "calls.h"
+#include "globals.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SUB_BITS 3
+#define SUB_BUCKETS (1u << SUB_BITS)
+// values are clamped to 2^41 ns, about 37 minutes
+#define MAX_MSB 40
+#define NBUCKETS (((MAX_MSB - SUB_BITS + 1) << SUB_BITS) + SUB_BUCKETS)
+
+#define DEFAULT_EXPORT_INTERVAL 15
+
+struct histogram {
+    _Atomic uint64_t buckets[NBUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+};
+
+// only the owning thread writes a shard, so plain loads and stores are enough to update it
+struct metrics_shard {
+    struct metrics_shard *next;
+    _Atomic uint64_t counters[METRIC_COUNTERS];
+    struct histogram histograms[METRIC_HISTOGRAMS];
+};
+
+static _Atomic(struct metrics_shard *) shards = NULL;
+static _Thread_local struct metrics_shard *my_shard = NULL;
+
+static const char * const counter_names[METRIC_COUNTERS] = {
+    [METRIC_MESSAGES_RECEIVED]            = "messages_received",
+    [METRIC_CONFERENCE_MESSAGES_RECEIVED] = "conference_messages_received",
+    [METRIC_BROADCAST_SENT]               = "broadcast_messages_sent",
+    [METRIC_MESSAGES_SENT]                = "messages_sent",
+    [METRIC_MESSAGES_DELAYED]             = "messages_delayed",
+    [METRIC_MESSAGES_DROPPED]             = "messages_dropped",
+    [METRIC_RECEIPTS_MISSING]             = "receipts_missing",
+    [METRIC_AUDIO_FRAMES_SENT]            = "audio_frames_sent",
+    [METRIC_AUDIO_BYTES_SENT]             = "audio_bytes_sent",
+    [METRIC_VIDEO_FRAMES_SENT]            = "video_frames_sent",
+    [METRIC_VIDEO_BYTES_SENT]             = "video_bytes_sent",
+    [METRIC_VIDEO_FRAMES_DROPPED]         = "video_frames_dropped",
+    [METRIC_SEND_ERRORS]                  = "av_send_errors",
+    [METRIC_MESSAGES_LIMITED]             = "messages_limited",
+    [METRIC_CALLS_LIMITED]                = "calls_limited",
+    [METRIC_REQUESTS_LIMITED]             = "friend_requests_limited",
+    [METRIC_CONFERENCE_MESSAGES_LIMITED]  = "conference_messages_limited",
+    [METRIC_PARTY_UNDERRUNS]              = "party_underruns",
+    [METRIC_PARTY_OVERRUNS]               = "party_overruns",
+    [METRIC_FILES_ECHOED]                 = "files_echoed",
+    [METRIC_FILE_BYTES_ECHOED]            = "file_bytes_echoed",
+    [METRIC_FILES_SPILLED]                = "file_echoes_spilled",
+};
+
+static const char * const histogram_names[METRIC_HISTOGRAMS] = {
+    [METRIC_FRIEND_MESSAGE_NS]  = "friend_message",
+    [METRIC_RECEIPT_NS]         = "message_receipt",
+    [METRIC_AUDIO_RECEIVE_NS]   = "audio_receive_frame",
+    [METRIC_VIDEO_RECEIVE_NS]   = "video_receive_frame",
+    [METRIC_TOX_ITERATION_NS]   = "tox_iteration",
+    [METRIC_TOX_JITTER_NS]      = "tox_wakeup_jitter",
+    [METRIC_TOXAV_ITERATION_NS] = "toxav_iteration",
+    [METRIC_TOXAV_JITTER_NS]    = "toxav_wakeup_jitter",
+    [METRIC_PARTY_MIX_NS]       = "party_mix",
+};
+
+static struct metrics_shard * get_shard(void) {
+    if (my_shard != NULL) {
+        return my_shard;
+    }
+    struct metrics_shard *shard = calloc(1, sizeof(*shard));
+    if (shard == NULL) {
+        return NULL;
+    }
+    shard->next = atomic_load(&shards);
+    while (! atomic_compare_exchange_weak(&shards, &shard->next, shard)) {
+    }
+    my_shard = shard;
+    return shard;
+}
+
+static inline void bump(_Atomic uint64_t *cell, uint64_t n) {
+    atomic_store_explicit(cell, atomic_load_explicit(cell, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static unsigned bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return (unsigned) value;
+    }
+    if (value >= (UINT64_C(1) << (MAX_MSB + 1))) {
+        value = (UINT64_C(1) << (MAX_MSB + 1)) - 1;
+    }
+    const unsigned msb = 63u - (unsigned) __builtin_clzll(value);
+    const unsigned shift = msb - SUB_BITS;
+    return ((msb - SUB_BITS + 1) << SUB_BITS) + (unsigned) ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+// the largest value that falls into a bucket
+static uint64_t bucket_top(unsigned bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    const unsigned msb = (bucket >> SUB_BITS) - 1 + SUB_BITS;
+    const unsigned shift = msb - SUB_BITS;
+    const uint64_t low = (uint64_t) (SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1))) << shift;
+    return low + (UINT64_C(1) << shift) - 1;
+}
+
+void metrics_add(enum metric_counter counter, uint64_t n) {
+    struct metrics_shard *shard = get_shard();
+    if (shard != NULL) {
+        bump(&shard->counters[counter], n);
+    }
+}
+
+void metrics_record(enum metric_histogram histogram, uint64_t value) {
+    struct metrics_shard *shard = get_shard();
+    if (shard == NULL) {
+        return;
+    }
+    struct histogram *h = &shard->histograms[histogram];
+    bump(&h->buckets[bucket_of(value)], 1);
+    bump(&h->count, 1);
+    bump(&h->sum, value);
+    if (value > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+    }
+}
+
+uint64_t metrics_counter(enum metric_counter counter) {
+    uint64_t total = 0;
+    for (struct metrics_shard *s = atomic_load(&shards); s != NULL; s = s->next) {
+        total += atomic_load_explicit(&s->counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+// add every shard's histogram up into buckets
+static void merge(enum metric_histogram histogram, uint64_t *buckets, struct metric_summary *summary) {
+    memset(buckets, 0, NBUCKETS * sizeof(*buckets));
+    memset(summary, 0, sizeof(*summary));
+    for (struct metrics_shard *s = atomic_load(&shards); s != NULL; s = s->next) {
+        const struct histogram *h = &s->histograms[histogram];
+        for (unsigned i = 0; i < NBUCKETS; i++) {
+            buckets[i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        }
+        summary->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+        const uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+        if (max > summary->max) {
+            summary->max = max;
+        }
+    }
+    // the count comes from the buckets so that the quantiles agree with it
+    for (unsigned i = 0; i < NBUCKETS; i++) {
+        summary->count += buckets[i];
+    }
+}
+
+static uint64_t quantile(const uint64_t *buckets, uint64_t count, uint64_t max, unsigned percent) {
+    if (count == 0) {
+        return 0;
+    }
+    const uint64_t rank = (count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < NBUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            const uint64_t top = bucket_top(i);
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+void metrics_summary(enum metric_histogram histogram, struct metric_summary *summary) {
+    uint64_t buckets[NBUCKETS];
+    merge(histogram, buckets, summary);
+    summary->p50 = quantile(buckets, summary->count, summary->max, 50);
+    summary->p90 = quantile(buckets, summary->count, summary->max, 90);
+    summary->p99 = quantile(buckets, summary->count, summary->max, 99);
+}
+
+// a line that doesn't fit is left out whole, and so is everything after it
+static bool fits(char *buf, size_t size, size_t *len, int n) {
+    if (n < 0 || (size_t) n >= size - *len) {
+        buf[*len] = '\0';
+        return false;
+    }
+    *len += (size_t) n;
+    return true;
+}
+
+void metrics_report(char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    bool room = true;
+
+    for (unsigned i = 0; i < METRIC_COUNTERS && room; i++) {
+        int n = snprintf(buf + len, size - len, "%s%s: %" PRIu64, len ? "\n" : "", counter_names[i],
+                metrics_counter(i));
+        room = fits(buf, size, &len, n);
+    }
+    for (unsigned i = 0; i < METRIC_HISTOGRAMS && room; i++) {
+        struct metric_summary s;
+        metrics_summary(i, &s);
+        int n = snprintf(buf + len, size - len, "%s%s: %" PRIu64 " times, p50 %" PRIu64 "us p90 %" PRIu64
+                "us p99 %" PRIu64 "us max %" PRIu64 "us", len ? "\n" : "", histogram_names[i], s.count,
+                s.p50 / 1000, s.p90 / 1000, s.p99 / 1000, s.max / 1000);
+        room = fits(buf, size, &len, n);
+    }
+}
+
+void metrics_write_prometheus(FILE *file) {
+    for (unsigned i = 0; i < METRIC_COUNTERS; i++) {
+        fprintf(file, "# TYPE mrprickles_%s_total counter\nmrprickles_%s_total %" PRIu64 "\n",
+                counter_names[i], counter_names[i], metrics_counter(i));
+    }
+
+    for (unsigned i = 0; i < METRIC_HISTOGRAMS; i++) {
+        uint64_t buckets[NBUCKETS];
+        struct metric_summary s;
+        merge(i, buckets, &s);
+
+        // one prometheus bucket per power of two from 2us up; the fine buckets are only for quantiles
+        fprintf(file, "# TYPE mrprickles_%s_seconds histogram\n", histogram_names[i]);
+        uint64_t cumulative = 0;
+        unsigned next = 0;
+        for (unsigned msb = 10; msb <= MAX_MSB; msb++) {
+            const uint64_t bound = (UINT64_C(1) << (msb + 1)) - 1;
+            while (next < NBUCKETS && bucket_top(next) <= bound) {
+                cumulative += buckets[next++];
+            }
+            fprintf(file, "mrprickles_%s_seconds_bucket{le=\"%.9f\"} %" PRIu64 "\n", histogram_names[i],
+                    (double) (bound + 1) / 1e9, cumulative);
+        }
+        fprintf(file, "mrprickles_%s_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n", histogram_names[i], s.count);
+        fprintf(file, "mrprickles_%s_seconds_sum %.9f\n", histogram_names[i], (double) s.sum / 1e9);
+        fprintf(file, "mrprickles_%s_seconds_count %" PRIu64 "\n", histogram_names[i], s.count);
+    }
+
+    calls_write_prometheus(file);
+}
+
+static const char *export_file = NULL;
+static unsigned export_interval = DEFAULT_EXPORT_INTERVAL;
+static bool export_running = false;
+static bool export_stopping = false;
+static pthread_t export_thread;
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t export_cond;
+
+// written to a temporary file and renamed, so the collector never reads half a file
+static void export_once(void) {
+    char *temp_name;
+    if (asprintf(&temp_name, "%s.tmp", export_file) == -1) {
+        return;
+    }
+    FILE *file = fopen(temp_name, "w");
+    if (file == NULL) {
+        log_ratelimited(60000, LOG_WARN, "could not write metrics to %s: %s", temp_name, strerror(errno));
+        free(temp_name);
+        return;
+    }
+    metrics_write_prometheus(file);
+    if (fclose(file) != 0 || rename(temp_name, export_file) != 0) {
+        log_ratelimited(60000, LOG_WARN, "could not write metrics to %s: %s", export_file, strerror(errno));
+        unlink(temp_name);
+    }
+    free(temp_name);
+}
+
+static void * run_export(GCC_UNUSED void *arg) {
+    pthread_mutex_lock(&export_lock);
+    while (! export_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += export_interval;
+        while (! export_stopping && pthread_cond_timedwait(&export_cond, &export_lock, &deadline) != ETIMEDOUT) {
+        }
+        pthread_mutex_unlock(&export_lock);
+        export_once();
+        pthread_mutex_lock(&export_lock);
+    }
+    pthread_mutex_unlock(&export_lock);
+    return NULL;
+}
+
+bool metrics_export_start(void) {
+    export_file = getenv("MRPRICKLES_METRICS_FILE");
+    if (export_file == NULL || export_file[0] == '\0') {
+        return true;
+    }
+    const char *interval = getenv("MRPRICKLES_METRICS_INTERVAL");
+    if (interval != NULL) {
+        const long seconds = strtol(interval, NULL, 10);
+        if (seconds > 0) {
+            export_interval = (unsigned) seconds;
+        }
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&export_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    export_stopping = false;
+    if (pthread_create(&export_thread, NULL, run_export, NULL) != 0) {
+        logger("could not start the metrics exporter");
+        pthread_cond_destroy(&export_cond);
+        return false;
+    }
+    export_running = true;
+    logger("writing metrics to %s every %u seconds", export_file, export_interval);
+    return true;
+}
+
+void metrics_export_stop(void) {
+    if (! export_running) {
+        return;
+    }
+    pthread_mutex_lock(&export_lock);
+    export_stopping = true;
+    pthread_cond_signal(&export_cond);
+    pthread_mutex_unlock(&export_lock);
+    pthread_join(export_thread, NULL);
+    pthread_cond_destroy(&export_cond);
+    export_running = false;
+}
+
+void metrics_free(void) {
+    struct metrics_shard *s = atomic_exchange(&shards, NULL);
+    while (s != NULL) {
+        struct metrics_shard *next = s->next;
+        free(s);
+        s = next;
+    }
+}
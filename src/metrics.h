@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* counters and latency histograms. every thread that records gets its own shard,
+   which only it writes, so recording never contends. readers add the shards up.
+
+   histograms are log-linear like hdr histograms: 8 buckets per power of two,
+   so any value is reported within 12.5%. values are nanoseconds. */
+
+enum metric_counter {
+    METRIC_MESSAGES_RECEIVED,
+    METRIC_CONFERENCE_MESSAGES_RECEIVED,
+    // sent by broadcasts, to friends and conferences
+    METRIC_BROADCAST_SENT,
+    METRIC_MESSAGES_SENT,
+    // the outbox had to hold on to them for a while
+    METRIC_MESSAGES_DELAYED,
+    METRIC_MESSAGES_DROPPED,
+    METRIC_RECEIPTS_MISSING,
+    METRIC_AUDIO_FRAMES_SENT,
+    METRIC_AUDIO_BYTES_SENT,
+    METRIC_VIDEO_FRAMES_SENT,
+    METRIC_VIDEO_BYTES_SENT,
+    METRIC_VIDEO_FRAMES_DROPPED,
+    METRIC_SEND_ERRORS,
+    // refused by the rate limiter
+    METRIC_MESSAGES_LIMITED,
+    METRIC_CALLS_LIMITED,
+    METRIC_REQUESTS_LIMITED,
+    METRIC_CONFERENCE_MESSAGES_LIMITED,
+    // a party line member's jitter buffer ran dry, or overflowed and lost its oldest audio
+    METRIC_PARTY_UNDERRUNS,
+    METRIC_PARTY_OVERRUNS,
+    METRIC_FILES_ECHOED,
+    METRIC_FILE_BYTES_ECHOED,
+    // echoes that had to wait in a temp file for a slow friend
+    METRIC_FILES_SPILLED,
+    METRIC_COUNTERS
+};
+
+enum metric_histogram {
+    METRIC_FRIEND_MESSAGE_NS,
+    // from sending a message to its read receipt
+    METRIC_RECEIPT_NS,
+    METRIC_AUDIO_RECEIVE_NS,
+    METRIC_VIDEO_RECEIVE_NS,
+    METRIC_TOX_ITERATION_NS,
+    METRIC_TOX_JITTER_NS,
+    METRIC_TOXAV_ITERATION_NS,
+    METRIC_TOXAV_JITTER_NS,
+    // one tick of the party line mixer
+    METRIC_PARTY_MIX_NS,
+    METRIC_HISTOGRAMS
+};
+
+struct metric_summary {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+};
+
+void metrics_add(enum metric_counter counter, uint64_t n);
+
+void metrics_record(enum metric_histogram histogram, uint64_t value);
+
+uint64_t metrics_counter(enum metric_counter counter);
+
+void metrics_summary(enum metric_histogram histogram, struct metric_summary *summary);
+
+// one line per counter and histogram, as many whole lines as fit size
+void metrics_report(char *buf, size_t size);
+
+void metrics_write_prometheus(FILE *file);
+
+/* writes the prometheus textfile named by MRPRICKLES_METRICS_FILE every MRPRICKLES_METRICS_INTERVAL
+   seconds (15 by default). does nothing if the file isn't set. */
+bool metrics_export_start(void);
+
+void metrics_export_stop(void);
+
+// frees every shard; call once nothing records any more
+void metrics_free(void);
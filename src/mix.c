@@ -0,0 +1,188 @@
+#include "mix.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIX_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MIX_NEON
+#endif
+
+typedef void (*add_fn)(int32_t *acc, const int16_t *pcm, size_t samples);
+typedef void (*out_fn)(int16_t *out, const int32_t *acc, const int16_t *own, size_t samples);
+
+static int16_t saturate(int32_t v) {
+    return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : (int16_t) v;
+}
+
+static void add_scalar(int32_t *acc, const int16_t *pcm, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        acc[i] += pcm[i];
+    }
+}
+
+static void out_scalar(int16_t *out, const int32_t *acc, const int16_t *own, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        out[i] = saturate(acc[i] - (own ? own[i] : 0));
+    }
+}
+
+#ifdef MIX_X86
+__attribute__((target("sse2")))
+static void add_sse2(int32_t *acc, const int16_t *pcm, size_t samples) {
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        const __m128i s = _mm_loadu_si128((const __m128i *) (pcm + i));
+        // sign extend by putting each sample in the top half of a lane and shifting it down
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        __m128i *a = (__m128i *) (acc + i);
+        _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), lo));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), hi));
+    }
+    add_scalar(acc + i, pcm + i, samples - i);
+}
+
+__attribute__((target("sse2")))
+static void out_sse2(int16_t *out, const int32_t *acc, const int16_t *own, size_t samples) {
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i *) (acc + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *) (acc + i + 4));
+        if (own != NULL) {
+            const __m128i s = _mm_loadu_si128((const __m128i *) (own + i));
+            lo = _mm_sub_epi32(lo, _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+            hi = _mm_sub_epi32(hi, _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+        }
+        _mm_storeu_si128((__m128i *) (out + i), _mm_packs_epi32(lo, hi));
+    }
+    out_scalar(out + i, acc + i, own ? own + i : NULL, samples - i);
+}
+
+__attribute__((target("avx2")))
+static void add_avx2(int32_t *acc, const int16_t *pcm, size_t samples) {
+    size_t i = 0;
+    for (; i + 16 <= samples; i += 16) {
+        const __m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (pcm + i)));
+        const __m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (pcm + i + 8)));
+        __m256i *a = (__m256i *) (acc + i);
+        _mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a), lo));
+        _mm256_storeu_si256(a + 1, _mm256_add_epi32(_mm256_loadu_si256(a + 1), hi));
+    }
+    add_scalar(acc + i, pcm + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+static void out_avx2(int16_t *out, const int32_t *acc, const int16_t *own, size_t samples) {
+    size_t i = 0;
+    for (; i + 16 <= samples; i += 16) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *) (acc + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *) (acc + i + 8));
+        if (own != NULL) {
+            lo = _mm256_sub_epi32(lo, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (own + i))));
+            hi = _mm256_sub_epi32(hi, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (own + i + 8))));
+        }
+        // packs works within 128 bit lanes, so put the quarters back in order afterwards
+        const __m256i packed = _mm256_packs_epi32(lo, hi);
+        _mm256_storeu_si256((__m256i *) (out + i), _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+    out_scalar(out + i, acc + i, own ? own + i : NULL, samples - i);
+}
+#endif
+
+#ifdef MIX_NEON
+static void add_neon(int32_t *acc, const int16_t *pcm, size_t samples) {
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        const int16x8_t s = vld1q_s16(pcm + i);
+        vst1q_s32(acc + i, vaddw_s16(vld1q_s32(acc + i), vget_low_s16(s)));
+        vst1q_s32(acc + i + 4, vaddw_s16(vld1q_s32(acc + i + 4), vget_high_s16(s)));
+    }
+    add_scalar(acc + i, pcm + i, samples - i);
+}
+
+static void out_neon(int16_t *out, const int32_t *acc, const int16_t *own, size_t samples) {
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        int32x4_t lo = vld1q_s32(acc + i);
+        int32x4_t hi = vld1q_s32(acc + i + 4);
+        if (own != NULL) {
+            const int16x8_t s = vld1q_s16(own + i);
+            lo = vsubw_s16(lo, vget_low_s16(s));
+            hi = vsubw_s16(hi, vget_high_s16(s));
+        }
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+    }
+    out_scalar(out + i, acc + i, own ? own + i : NULL, samples - i);
+}
+#endif
+
+static const struct kernel {
+    const char * const name;
+    const add_fn add;
+    const out_fn out;
+} kernels[] = {
+#ifdef MIX_X86
+    {"avx2", add_avx2, out_avx2},
+    {"sse2", add_sse2, out_sse2},
+#endif
+#ifdef MIX_NEON
+    {"neon", add_neon, out_neon},
+#endif
+    {"scalar", add_scalar, out_scalar},
+};
+
+static const struct kernel * current = &kernels[sizeof(kernels)/sizeof(kernels[0]) - 1];
+
+static bool kernel_supported(const struct kernel *k) {
+#ifdef MIX_X86
+    if (k->add == add_avx2) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (k->add == add_sse2) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    (void) k;
+    return true;
+}
+
+void mix_init(void) {
+#ifdef MIX_X86
+    __builtin_cpu_init();
+#endif
+    /* the table is ordered fastest first. */
+    for (size_t i = 0; i < sizeof(kernels)/sizeof(kernels[0]); i++) {
+        if (kernel_supported(&kernels[i])) {
+            current = &kernels[i];
+            return;
+        }
+    }
+}
+
+bool mix_select(const char *name) {
+#ifdef MIX_X86
+    __builtin_cpu_init();
+#endif
+    for (size_t i = 0; i < sizeof(kernels)/sizeof(kernels[0]); i++) {
+        if (strcmp(kernels[i].name, name) == 0 && kernel_supported(&kernels[i])) {
+            current = &kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+const char * mix_kernel_name(void) {
+    return current->name;
+}
+
+void mix_add(int32_t *acc, const int16_t *pcm, size_t samples) {
+    current->add(acc, pcm, samples);
+}
+
+void mix_out(int16_t *out, const int32_t *acc, const int16_t *own, size_t samples) {
+    current->out(out, acc, own, samples);
+}
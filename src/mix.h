@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* the party line's mixing kernels. sources are summed into int32, so any number of them
+   can be added without clipping halfway, and each listener's mix is the sum minus their own
+   audio, saturated back down to int16. */
+
+// pick the fastest kernels this cpu supports. call once before any threads start.
+void mix_init(void);
+
+// force kernels by name ("scalar", "sse2", "avx2", "neon"). false if this cpu can't run them.
+bool mix_select(const char *name);
+
+const char * mix_kernel_name(void);
+
+// acc[i] += pcm[i]
+void mix_add(int32_t *acc, const int16_t *pcm, size_t samples);
+
+// out[i] = acc[i] - own[i], saturated to int16. own may be NULL for a listener who said nothing.
+void mix_out(int16_t *out, const int32_t *acc, const int16_t *own, size_t samples);
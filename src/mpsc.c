@@ -0,0 +1,68 @@
+#include "mpsc.h"
+
+void mpsc_init(struct mpsc_queue *q) {
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+    atomic_init(&q->depth, 0);
+    atomic_init(&q->max_depth, 0);
+    atomic_init(&q->contended, 0);
+}
+
+static void push_node(struct mpsc_queue *q, struct mpsc_node *node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    struct mpsc_node *prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+    /* between the exchange and this store the queue is briefly split; the consumer copes. */
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+void mpsc_push(struct mpsc_queue *q, struct mpsc_node *node) {
+    /* counted before it is visible, so a fast consumer can't take depth below zero. */
+    size_t depth = atomic_fetch_add_explicit(&q->depth, 1, memory_order_relaxed) + 1;
+    size_t max = atomic_load_explicit(&q->max_depth, memory_order_relaxed);
+    while (depth > max && ! atomic_compare_exchange_weak_explicit(&q->max_depth, &max, depth,
+                memory_order_relaxed, memory_order_relaxed)) {
+    }
+
+    push_node(q, node);
+}
+
+static struct mpsc_node * popped(struct mpsc_queue *q, struct mpsc_node *node) {
+    atomic_fetch_sub_explicit(&q->depth, 1, memory_order_relaxed);
+    return node;
+}
+
+struct mpsc_node * mpsc_pop(struct mpsc_queue *q) {
+    struct mpsc_node *tail = q->tail;
+    struct mpsc_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next != NULL) {
+        q->tail = next;
+        return popped(q, tail);
+    }
+
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+        /* a producer has swapped in a new head but not linked it yet. */
+        atomic_fetch_add_explicit(&q->contended, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    /* tail is the last node. put the stub behind it so tail can be handed out. */
+    push_node(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        q->tail = next;
+        return popped(q, tail);
+    }
+    atomic_fetch_add_explicit(&q->contended, 1, memory_order_relaxed);
+    return NULL;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* an intrusive, lock-free queue with many producers and a single consumer (dmitry vyukov's design).
+   pushing is one atomic exchange, so producers never wait on each other or on the consumer. */
+
+struct mpsc_node {
+    _Atomic(struct mpsc_node *) next;
+};
+
+struct mpsc_queue {
+    _Atomic(struct mpsc_node *) head; // producers push here
+    struct mpsc_node *tail;           // the consumer pops here
+    struct mpsc_node stub;
+
+    atomic_size_t depth;
+    atomic_size_t max_depth;
+    // times the consumer found a push half done and had to come back later
+    atomic_uint_fast64_t contended;
+};
+
+void mpsc_init(struct mpsc_queue *q);
+
+// safe from any thread
+void mpsc_push(struct mpsc_queue *q, struct mpsc_node *node);
+
+// consumer only. NULL when empty, or when the next node is still being pushed.
+struct mpsc_node * mpsc_pop(struct mpsc_queue *q);
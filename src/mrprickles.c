@@ -1,48 +1,145 @@
+#include "admin.h"
 #include "av_callbacks.h"
+#include "av_workers.h"
+#include "bitrate.h"
+#include "bootstrap.h"
 #include "callbacks.h"
+#include "calls.h"
+#include "cmdqueue.h"
+#include "conference.h"
+#include "file_echo.h"
+#include "friends.h"
 #include "globals.h"
 #include "limits.h"
+#include "listing.h"
 #include "messaging.h"
+#include "metrics.h"
+#include "mix.h"
+#include "outbox.h"
+#include "party.h"
+#include "plane_copy.h"
+#include "profile.h"
+#include "ratelimit.h"
+#include "scratch.h"
+#include "shutdown.h"
 #include "util.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
+#include <time.h>
 
 static_assert(CHAR_BIT == 8, "mrprickles casts a lot of uint8_ts to chars.");
 
 static void * run_toxav(void * arg) {
-    ToxAV * toxav = (ToxAV *) arg;
-    assert (toxav != NULL);
-
-    for (uint32_t interval; true; usleep(interval)) {
+    struct shard * shard = (struct shard *) arg;
+    assert (shard != NULL && shard->toxav != NULL);
+    shard_set_current(shard);
+    ToxAV * toxav = shard->toxav;
+
+    uint64_t deadline = 0;
+    while (! shutdown_draining()) {
+        const uint64_t start = monotonic_ns();
+        // how late we woke up. waking early because work was posted doesn't count.
+        if (deadline != 0 && start > deadline) {
+            metrics_record(METRIC_TOXAV_JITTER_NS, start - deadline);
+        }
+        drain_toxav_commands(toxav);
         toxav_iterate(toxav);
-        interval = toxav_iteration_interval(toxav) * 1000; // microseconds
+        bitrate_tick(toxav);
+        metrics_record(METRIC_TOXAV_ITERATION_NS, monotonic_ns() - start);
+        scratch_reset();
+        const uint64_t interval = toxav_iteration_interval(toxav) * 1000000ull; // nanoseconds
+        deadline = start + interval;
+        reactor_wait(&shard->toxav_reactor, deadline);
     }
+
+    // commands still queued are only calls to make and rates to set, none worth doing now
+    discard_toxav_commands();
+    hang_up_all(toxav);
+    scratch_free();
+    shutdown_toxav_done(shard);
     return NULL;
 }
 
 static void * run_tox(void * arg) {
-    Tox * tox = (Tox *) arg;
-    assert (tox != NULL);
+    struct shard * shard = (struct shard *) arg;
+    assert (shard != NULL && shard->tox != NULL);
+    shard_set_current(shard);
+    Tox * tox = shard->tox;
 
     time_t curr_time;
 
-    for (uint32_t interval; true; usleep(interval)) {
+    uint64_t deadline = 0;
+    bool draining = false;
+    bool toxav_done = false;
+    while (true) {
+        const uint64_t start = monotonic_ns();
+        if (deadline != 0 && start > deadline) {
+            metrics_record(METRIC_TOX_JITTER_NS, start - deadline);
+        }
+
+        /* once everything has been handed to toxcore, one last iteration sends it on its way.
+           the toxav thread has to have been done since the last iteration, so that whatever
+           it posted has been drained too. */
+        bool last = false;
+        if (shutdown_draining()) {
+            if (! draining) {
+                draining = true;
+                file_echo_stop(tox);
+            }
+            last = start >= shutdown_deadline_ns()
+                || (toxav_done && outbox_drained() && ! broadcast_pending());
+            toxav_done = shutdown_toxav_is_done(shard);
+        }
+
+        drain_tox_commands(tox);
         tox_iterate(tox, NULL);
+        outbox_tick(tox);
+        listing_tick(tox);
+        broadcast_tick(tox);
+        file_echo_tick(tox);
+        if (! draining) {
+            // the profiles are saved once on the way out
+            profile_tick(tox);
+        }
+        bootstrap_tick(tox);
+        metrics_record(METRIC_TOX_ITERATION_NS, monotonic_ns() - start);
+        scratch_reset();
+        if (last) {
+            break;
+        }
 
         curr_time = time(NULL);
-        if (curr_time - last_info_change > RESET_INFO_DELAY) {
+        if (curr_time - shard->last_info_change > RESET_INFO_DELAY) {
             reset_info(tox);
         }
 
-        interval = tox_iteration_interval(tox) * 1000; // in microseconds
+        const uint64_t interval = tox_iteration_interval(tox) * 1000000ull; // in nanoseconds
+        deadline = start + interval;
+        reactor_wait(&shard->tox_reactor, deadline);
     }
+    scratch_free();
     return NULL;
 }
 
+// false if the thread is still going at deadline_ns on the monotonic clock
+static bool join_by(pthread_t thread, uint64_t deadline_ns) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const uint64_t now = monotonic_ns();
+    const uint64_t wait = deadline_ns > now ? deadline_ns - now : 0;
+    ts.tv_sec += (time_t) (wait / 1000000000u);
+    ts.tv_nsec += (long) (wait % 1000000000u);
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return pthread_timedjoin_np(thread, NULL, &ts) == 0;
+}
+
 static void handle_signal(int sig) {
     if (sig == SIGINT) {
         logger("received SIGINT");
@@ -53,31 +150,34 @@ static void handle_signal(int sig) {
     signal_exit = true;
 }
 
-int main(void) {
-    start_time = time(NULL);
-    main_thread = pthread_self();
+static void open_shard(struct shard * shard) {
     Tox * tox;
+    shard_set_current(shard);
 
-    logger(MRPRICKLES_VERSION);
+    if (! reactor_init(&shard->tox_reactor) || ! reactor_init(&shard->toxav_reactor)) {
+        logger("could not set up the reactors for shard %u", shard->index);
+        exit(EXIT_FAILURE);
+    }
 
     TOX_ERR_NEW err = TOX_ERR_NEW_OK;
     struct Tox_Options options;
     tox_options_default(&options);
 
-    char * data_filename = set_data_path();
+    shard->data_filename = set_data_path(shard->index);
 
-    if (file_exists(data_filename)) {
-        err = load_profile(&tox, &options, data_filename);
+    if (file_exists(shard->data_filename)) {
+        err = load_profile(&tox, &options, shard->data_filename);
         if (err == TOX_ERR_NEW_OK) {
-            logger("loaded data from %s", data_filename);
+            logger("loaded data from %s", shard->data_filename);
         } else {
             logger("failed to load data from disk: error code %d", err);
             exit(EXIT_FAILURE);
         }
     } else {
-        puts("creating a new profile");
+        logger("creating a new profile for shard %u", shard->index);
 
         tox = tox_new(&options, &err);
+        startup_mark("tox_new");
 
         if (err != TOX_ERR_NEW_OK) {
             logger("error at tox_new, error: %d", err);
@@ -85,78 +185,174 @@ int main(void) {
         }
 
     }
+    shard->tox = tox;
     reset_info(tox);
+    friends_load(tox);
+    admin_friend_added(tox, 0);
 
     /* register tox callbacks. */
     tox_callback_self_connection_status(tox, self_connection_status);
+    tox_callback_friend_name(tox, friend_name_change);
+    tox_callback_friend_status(tox, friend_status_change);
     tox_callback_friend_connection_status(tox, friend_on_off);
+    tox_callback_friend_read_receipt(tox, friend_read_receipt);
     tox_callback_friend_request(tox, friend_request);
     tox_callback_friend_message(tox, friend_message);
     tox_callback_file_recv(tox, file_recv);
+    tox_callback_file_recv_chunk(tox, file_recv_chunk);
+    tox_callback_file_chunk_request(tox, file_chunk_request);
+    tox_callback_file_recv_control(tox, file_recv_control);
+    tox_callback_conference_invite(tox, conference_invite);
+    tox_callback_conference_message(tox, conference_message);
 
     /* output my tox ID. */
     char * tox_id = get_tox_ID(tox);
+    if (tox_id == NULL) {
+        logger("oh no, couldn't allocate memory.");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(shard->address, sizeof(shard->address), "%s", tox_id);
     printf("%s\n", tox_id);
-    free(tox_id);
+    fflush(stdout);
 
     /* start it up. */
+    startup_mark("friend cache and callbacks");
+    bootstrap_init(shard->data_filename);
     bootstrap(tox);
+    startup_mark("bootstrap");
 
     /* create toxav and register callbacks. */
     TOXAV_ERR_NEW err2;
-    g_toxAV = toxav_new(tox, &err2);
+    shard->toxav = toxav_new(tox, &err2);
     if (err2 != TOXAV_ERR_NEW_OK) {
         logger("error at toxav_new: %d", err2);
         exit(EXIT_FAILURE);
     }
 
-    toxav_callback_call(g_toxAV, call, NULL);
-    toxav_callback_call_state(g_toxAV, call_state, NULL);
-    toxav_callback_audio_receive_frame(g_toxAV, audio_receive_frame, NULL);
-    toxav_callback_video_receive_frame(g_toxAV, video_receive_frame, NULL);
+    toxav_callback_call(shard->toxav, call, NULL);
+    toxav_callback_call_state(shard->toxav, call_state, NULL);
+    toxav_callback_audio_bit_rate(shard->toxav, audio_bit_rate, NULL);
+    toxav_callback_video_bit_rate(shard->toxav, video_bit_rate, NULL);
+    toxav_callback_audio_receive_frame(shard->toxav, audio_receive_frame, NULL);
+    toxav_callback_video_receive_frame(shard->toxav, video_receive_frame, NULL);
+    scratch_reset();
+}
 
-    /* set up signal handling. */
-    struct sigaction new_action;
-    sigemptyset(&new_action.sa_mask);
-    new_action.sa_handler = handle_signal;
-    new_action.sa_flags = 0;
-    sigaction(SIGINT, &new_action, NULL);
-    sigaction(SIGTERM, &new_action, NULL);
+int main(void) {
+    start_time = time(NULL);
+    main_thread = pthread_self();
 
-    /* start the threads and chill out for a while. */
-    pthread_t tox_thread, toxav_thread;
-    pthread_create(&tox_thread, NULL, &run_tox, tox);
-    pthread_create(&toxav_thread, NULL, &run_toxav, g_toxAV);
+    /* set up signal handling and a place for the main thread to sleep.
+       this comes before any threads are started, the log writer included,
+       so that they inherit the signal mask. */
+    if (! reactor_init(&g_main_reactor)
+            || ! reactor_watch_signals(&g_main_reactor, handle_signal)) {
+        logger("could not set up the reactors");
+        exit(EXIT_FAILURE);
+    }
 
-    while (!signal_exit) {
-        pause();
+    log_init();
+    atexit(log_shutdown);
+    logger(MRPRICKLES_VERSION);
+    startup_begin();
+
+    plane_copy_init();
+    logger("using %s kernels for video planes", plane_copy_kernel_name());
+    mix_init();
+    logger("using %s kernels for the party line", mix_kernel_name());
+
+    const char * shards = getenv("MRPRICKLES_SHARDS");
+    if (shards != NULL) {
+        const long n = strtol(shards, NULL, 10);
+        if (n >= 1 && n <= MAX_SHARDS) {
+            g_nshards = (unsigned) n;
+        } else {
+            logger("MRPRICKLES_SHARDS must be between 1 and %d, using 1", MAX_SHARDS);
+        }
     }
 
-    logger("killing tox and saving profile...");
-    sleep(1); // a bit of time for messages to finish
+    cmdqueue_init();
+    messaging_init();
+    ratelimit_init();
+    admin_init();
+    file_echo_init();
+    startup_mark("init");
+
+    for (unsigned i = 0; i < g_nshards; i++) {
+        g_shards[i].index = i;
+        open_shard(&g_shards[i]);
+    }
+    shard_set_current(NULL);
+    if (g_nshards > 1) {
+        logger("hosting %u profiles", g_nshards);
+    }
 
-    /* start packing up. */
-    int status_av_thread = pthread_cancel(toxav_thread);
-    int status_thread = pthread_cancel(tox_thread);
+    profile_start();
 
-    if (status_av_thread != 0 || status_thread != 0) {
-        logger("oh man, threads didn't want to be cancelled, this is bad");
-        sleep(2);
+    if (! av_workers_start(0)) {
+        logger("could not start the av workers");
+        exit(EXIT_FAILURE);
+    }
+    if (! party_start()) {
+        logger("could not start the party line");
         exit(EXIT_FAILURE);
     }
 
-    /* wait for threads to exit */
-    status_av_thread = pthread_join(toxav_thread, NULL);
-    status_thread = pthread_join(tox_thread, NULL);
+    metrics_export_start();
 
-    assert (0 == status_av_thread);
-    assert (0 == status_thread);
+    /* start the threads and chill out for a while. */
+    for (unsigned i = 0; i < g_nshards; i++) {
+        struct shard * shard = &g_shards[i];
+        pthread_create(&shard->tox_thread, NULL, &run_tox, shard);
+        pthread_create(&shard->toxav_thread, NULL, &run_toxav, shard);
+        shard_pin(shard, shard->tox_thread, 0);
+        shard_pin(shard, shard->toxav_thread, 1);
+    }
+
+    while (!signal_exit) {
+        reactor_wait(&g_main_reactor, 0);
+    }
+
+    /* the threads wind down on their own, see shutdown.h. one stuck inside toxcore
+       isn't waited on forever, but nothing is saved then, rather than saving a tox mid-change. */
+    logger("shutting down...");
+    const uint64_t shutdown_start = monotonic_ns();
+    shutdown_begin();
+    const uint64_t give_up = shutdown_deadline_ns() + SHUTDOWN_GRACE_MS * 1000000ull;
+    for (unsigned i = 0; i < g_nshards; i++) {
+        if (! join_by(g_shards[i].toxav_thread, give_up) || ! join_by(g_shards[i].tox_thread, give_up)) {
+            logger("oh man, shard %u's threads won't stop, this is bad", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    logger("threads stopped in %" PRIu64 " ms, saving profile...", (monotonic_ns() - shutdown_start) / 1000000);
 
-    save_profile(tox);
-    free(data_filename);
+    profile_stop();
 
-    toxav_kill(g_toxAV);
-    tox_kill(tox);
+    party_stop();
+    av_workers_stop();
+    metrics_export_stop();
+    for (unsigned i = 0; i < g_nshards; i++) {
+        toxav_kill(g_shards[i].toxav);
+    }
+    calls_free_all();
+    for (unsigned i = 0; i < g_nshards; i++) {
+        tox_kill(g_shards[i].tox);
+        free(g_shards[i].data_filename);
+    }
+    friends_free();
+    outbox_free();
+    cmdqueue_free();
+    file_echo_free();
+    ratelimit_free();
+    metrics_free();
+
+    for (unsigned i = 0; i < g_nshards; i++) {
+        reactor_close(&g_shards[i].toxav_reactor);
+        reactor_close(&g_shards[i].tox_reactor);
+    }
+    reactor_close(&g_main_reactor);
+    scratch_free();
 
     return 0;
 }
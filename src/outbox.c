@@ -0,0 +1,302 @@
+#include "outbox.h"
+
+#include "friends.h"
+#include "globals.h"
+#include "metrics.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct queued {
+    size_t length;
+    char text[];
+};
+
+struct unread {
+    uint32_t id;
+    uint64_t sent_ns;
+};
+
+struct outbox {
+    struct queued *queue[OUTBOX_MAX_QUEUED]; // a ring, oldest at head
+    unsigned head;
+    unsigned count;
+    struct unread unread[OUTBOX_MAX_UNREAD]; // oldest first
+    unsigned nunread;
+};
+
+struct outboxes {
+    struct outbox **boxes; // indexed by friend number, NULL until we first send to the friend
+    uint32_t size;
+    size_t bytes;          // queued over all friends
+    unsigned backlogged;   // friends with something queued
+    uint64_t next_retry_ns;
+    uint64_t next_expiry_ns;
+};
+
+// one per shard
+static struct outboxes all_outboxes[MAX_SHARDS];
+
+enum send_result {
+    SEND_OK,
+    SEND_LATER,
+    SEND_FAILED,
+};
+
+static struct outboxes * outboxes(void) {
+    assert (shard_current() != NULL);
+    return &all_outboxes[shard_current()->index];
+}
+
+static struct outbox * find(const struct outboxes *o, uint32_t friend_num) {
+    return friend_num < o->size ? o->boxes[friend_num] : NULL;
+}
+
+// NULL if memory ran out
+static struct outbox * get(struct outboxes *o, uint32_t friend_num) {
+    if (friend_num >= o->size) {
+        uint32_t new_size = o->size ? o->size : 64;
+        while (new_size <= friend_num) {
+            new_size *= 2;
+        }
+        struct outbox **boxes = realloc(o->boxes, new_size * sizeof(*o->boxes));
+        if (boxes == NULL) {
+            return NULL;
+        }
+        memset(&boxes[o->size], 0, (new_size - o->size) * sizeof(*boxes));
+        o->boxes = boxes;
+        o->size = new_size;
+    }
+    if (o->boxes[friend_num] == NULL) {
+        o->boxes[friend_num] = calloc(1, sizeof(struct outbox));
+    }
+    return o->boxes[friend_num];
+}
+
+// forget the oldest unread messages
+static void forget_unread(struct outbox *box, unsigned n) {
+    assert (n <= box->nunread);
+    box->nunread -= n;
+    memmove(&box->unread[0], &box->unread[n], box->nunread * sizeof(box->unread[0]));
+}
+
+static enum send_result try_send(Tox *tox, uint32_t friend_num, struct outbox *box,
+                                const char *text, size_t length) {
+    TOX_ERR_FRIEND_SEND_MESSAGE err;
+    const uint32_t id = tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL,
+            (const uint8_t *) text, length, &err);
+    switch (err) {
+        case TOX_ERR_FRIEND_SEND_MESSAGE_OK:
+            metrics_add(METRIC_MESSAGES_SENT, 1);
+            if (box->nunread == OUTBOX_MAX_UNREAD) {
+                metrics_add(METRIC_RECEIPTS_MISSING, 1);
+                forget_unread(box, 1);
+            }
+            box->unread[box->nunread++] = (struct unread) {id, monotonic_ns()};
+            return SEND_OK;
+        case TOX_ERR_FRIEND_SEND_MESSAGE_SENDQ:
+        case TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_CONNECTED:
+            return SEND_LATER;
+        default:
+            metrics_add(METRIC_MESSAGES_DROPPED, 1);
+            log_ratelimited(1000, LOG_WARN, "could not send a message to friend %u, error: %d", friend_num, err);
+            return SEND_FAILED;
+    }
+}
+
+static bool enqueue(struct outboxes *o, uint32_t friend_num, struct outbox *box,
+                    const char *text, size_t length) {
+    struct queued *q = NULL;
+    if (box->count < OUTBOX_MAX_QUEUED && o->bytes + length <= OUTBOX_MAX_BYTES) {
+        q = malloc(sizeof(struct queued) + length);
+    }
+    if (q == NULL) {
+        metrics_add(METRIC_MESSAGES_DROPPED, 1);
+        log_ratelimited(1000, LOG_WARN, "dropped a message to friend %u, too much is waiting", friend_num);
+        return false;
+    }
+    q->length = length;
+    memcpy(q->text, text, length);
+
+    box->queue[(box->head + box->count) % OUTBOX_MAX_QUEUED] = q;
+    if (box->count++ == 0) {
+        o->backlogged++;
+    }
+    o->bytes += length;
+    metrics_add(METRIC_MESSAGES_DELAYED, 1);
+    return true;
+}
+
+static void pop(struct outboxes *o, struct outbox *box) {
+    assert (box->count > 0);
+    struct queued *q = box->queue[box->head];
+    o->bytes -= q->length;
+    free(q);
+    box->head = (box->head + 1) % OUTBOX_MAX_QUEUED;
+    if (--box->count == 0) {
+        o->backlogged--;
+    }
+}
+
+// send what's queued, in order, until toxcore won't take more
+static void flush(Tox *tox, struct outboxes *o, uint32_t friend_num, struct outbox *box) {
+    while (box->count > 0) {
+        const struct queued *q = box->queue[box->head];
+        if (try_send(tox, friend_num, box, q->text, q->length) == SEND_LATER) {
+            return;
+        }
+        pop(o, box);
+    }
+}
+
+bool outbox_send(Tox *tox, uint32_t friend_num, const char *message, size_t length) {
+    struct outboxes *o = outboxes();
+    struct outbox *box = get(o, friend_num);
+    if (box == NULL) {
+        logger("oh no, couldn't allocate memory.");
+        return false;
+    }
+
+    // anything already waiting goes first
+    if (box->count == 0) {
+        switch (try_send(tox, friend_num, box, message, length)) {
+            case SEND_OK:
+                return true;
+            case SEND_FAILED:
+                return false;
+            case SEND_LATER:
+                break;
+        }
+    }
+    return enqueue(o, friend_num, box, message, length);
+}
+
+unsigned outbox_pending(uint32_t friend_num) {
+    const struct outbox *box = find(outboxes(), friend_num);
+    return box ? box->count + box->nunread : 0;
+}
+
+bool outbox_drained(void) {
+    const struct outboxes *o = outboxes();
+    for (uint32_t i = 0; o->backlogged > 0 && i < o->size; i++) {
+        const struct friend_info *info = friend_get(i);
+        if (o->boxes[i] != NULL && o->boxes[i]->count > 0
+                && info != NULL && info->connection != TOX_CONNECTION_NONE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void outbox_receipt(uint32_t friend_num, uint32_t message_id) {
+    struct outbox *box = find(outboxes(), friend_num);
+    if (box == NULL) {
+        return;
+    }
+    // receipts mostly come back in order, so this is usually the first one
+    for (unsigned i = 0; i < box->nunread; i++) {
+        if (box->unread[i].id == message_id) {
+            metrics_record(METRIC_RECEIPT_NS, monotonic_ns() - box->unread[i].sent_ns);
+            box->nunread--;
+            memmove(&box->unread[i], &box->unread[i + 1], (box->nunread - i) * sizeof(box->unread[0]));
+            return;
+        }
+    }
+}
+
+void outbox_online(Tox *tox, uint32_t friend_num) {
+    struct outboxes *o = outboxes();
+    struct outbox *box = find(o, friend_num);
+    if (box != NULL) {
+        flush(tox, o, friend_num, box);
+    }
+}
+
+void outbox_offline(uint32_t friend_num) {
+    struct outbox *box = find(outboxes(), friend_num);
+    if (box != NULL && box->nunread > 0) {
+        metrics_add(METRIC_RECEIPTS_MISSING, box->nunread);
+        forget_unread(box, box->nunread);
+    }
+}
+
+void outbox_tick(Tox *tox) {
+    struct outboxes *o = outboxes();
+    uint64_t now = 0;
+
+    if (o->backlogged > 0) {
+        now = monotonic_ns();
+        if (now >= o->next_retry_ns) {
+            o->next_retry_ns = now + OUTBOX_RETRY_MS * 1000000ull;
+            for (uint32_t i = 0; i < o->size; i++) {
+                struct outbox *box = o->boxes[i];
+                if (box == NULL || box->count == 0) {
+                    continue;
+                }
+                // offline friends are flushed when they come back
+                const struct friend_info *info = friend_get(i);
+                if (info != NULL && info->connection != TOX_CONNECTION_NONE) {
+                    flush(tox, o, i, box);
+                }
+            }
+        }
+    }
+
+    if (now == 0) {
+        now = monotonic_ns();
+    }
+    if (now < o->next_expiry_ns) {
+        return;
+    }
+    o->next_expiry_ns = now + 1000000000ull;
+    const uint64_t cutoff = OUTBOX_RECEIPT_TIMEOUT_MS * 1000000ull;
+    for (uint32_t i = 0; i < o->size; i++) {
+        struct outbox *box = o->boxes[i];
+        if (box == NULL) {
+            continue;
+        }
+        unsigned expired = 0;
+        while (expired < box->nunread && now - box->unread[expired].sent_ns > cutoff) {
+            expired++;
+        }
+        if (expired > 0) {
+            metrics_add(METRIC_RECEIPTS_MISSING, expired);
+            forget_unread(box, expired);
+        }
+    }
+}
+
+void outbox_report(char *buf, size_t size) {
+    const struct outboxes *o = outboxes();
+    unsigned queued = 0;
+    unsigned unread = 0;
+    for (uint32_t i = 0; i < o->size; i++) {
+        if (o->boxes[i] != NULL) {
+            queued += o->boxes[i]->count;
+            unread += o->boxes[i]->nunread;
+        }
+    }
+    snprintf(buf, size, "outbox: %u messages (%zu bytes) waiting for %u friends, %u unread",
+            queued, o->bytes, o->backlogged, unread);
+}
+
+void outbox_free(void) {
+    for (unsigned shard = 0; shard < MAX_SHARDS; shard++) {
+        struct outboxes *o = &all_outboxes[shard];
+        for (uint32_t i = 0; i < o->size; i++) {
+            struct outbox *box = o->boxes[i];
+            if (box == NULL) {
+                continue;
+            }
+            while (box->count > 0) {
+                pop(o, box);
+            }
+            free(box);
+        }
+        free(o->boxes);
+        memset(o, 0, sizeof(*o));
+    }
+}
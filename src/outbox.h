@@ -0,0 +1,47 @@
+#pragma once
+
+#include <tox/tox.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* every message to a friend goes out through here. when toxcore can't take a message, because
+   the friend is offline or its send queue is full, it waits in a small queue of the friend's own
+   and is retried, and flushed as soon as the friend comes back online. sent messages are
+   remembered until their read receipt arrives, for delivery latency and losses.
+   each shard has its own outboxes; tox thread only. */
+
+// messages waiting per friend, and bytes waiting per shard. past either, new messages are dropped.
+#define OUTBOX_MAX_QUEUED 16
+#define OUTBOX_MAX_BYTES (4 * 1024 * 1024)
+// retry a full send queue this often
+#define OUTBOX_RETRY_MS 100
+// sent messages remembered per friend, the oldest is given up on beyond this
+#define OUTBOX_MAX_UNREAD 32
+// a message not read by then never will be, as far as we're concerned
+#define OUTBOX_RECEIPT_TIMEOUT_MS 60000
+
+// false if the message was dropped, either now or because the friend's queue was full
+bool outbox_send(Tox *tox, uint32_t friend_num, const char *message, size_t length);
+
+// messages to friend_num that are queued or not yet read
+unsigned outbox_pending(uint32_t friend_num);
+
+// nothing is waiting for an online friend. what offline friends have waiting won't go anywhere soon.
+bool outbox_drained(void);
+
+void outbox_receipt(uint32_t friend_num, uint32_t message_id);
+
+// the friend came online, or went offline and won't be reading what's in flight
+void outbox_online(Tox *tox, uint32_t friend_num);
+void outbox_offline(uint32_t friend_num);
+
+// retries and receipt timeouts. call every iteration.
+void outbox_tick(Tox *tox);
+
+// what's waiting in the current shard's outboxes
+void outbox_report(char *buf, size_t size);
+
+// every shard's outboxes
+void outbox_free(void);
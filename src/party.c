@@ -0,0 +1,238 @@
+#include "party.h"
+
+#include "av_workers.h"
+#include "globals.h"
+#include "metrics.h"
+#include "mix.h"
+#include "util.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BUFFER_SAMPLES (PARTY_RATE / 1000 * PARTY_BUFFER_MS)
+#define PRIME_SAMPLES (PARTY_RATE / 1000 * PARTY_PRIME_MS)
+
+struct member {
+    bool used;
+    ToxAV *toxav;
+    uint32_t friend_num;
+    struct call_ctx *ctx;
+
+    // the jitter buffer, a ring of mono samples
+    int16_t buffer[BUFFER_SAMPLES];
+    size_t head;
+    size_t count;
+    bool playing;
+
+    // what they said this tick, if speaking
+    int16_t frame[PARTY_FRAME_SAMPLES];
+    bool speaking;
+};
+
+// everything here is under lock
+static struct member * members = NULL;
+static unsigned nmembers = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t joined = PTHREAD_COND_INITIALIZER;
+static bool stopping = false;
+static pthread_t mixer_thread;
+
+// pop a frame from the jitter buffer into m->frame
+static void take_frame(struct member *m) {
+    assert (m->count >= PARTY_FRAME_SAMPLES);
+    const size_t first = BUFFER_SAMPLES - m->head < PARTY_FRAME_SAMPLES
+        ? BUFFER_SAMPLES - m->head : PARTY_FRAME_SAMPLES;
+    memcpy(m->frame, &m->buffer[m->head], first * sizeof(int16_t));
+    memcpy(m->frame + first, m->buffer, (PARTY_FRAME_SAMPLES - first) * sizeof(int16_t));
+    m->head = (m->head + PARTY_FRAME_SAMPLES) % BUFFER_SAMPLES;
+    m->count -= PARTY_FRAME_SAMPLES;
+}
+
+static void mix_tick(void) {
+    int32_t acc[PARTY_FRAME_SAMPLES];
+    memset(acc, 0, sizeof(acc));
+
+    for (unsigned i = 0; i < PARTY_MAX_MEMBERS; i++) {
+        struct member *m = &members[i];
+        m->speaking = false;
+        if (! m->used) {
+            continue;
+        }
+        if (! m->playing && m->count >= PRIME_SAMPLES) {
+            m->playing = true;
+        }
+        if (! m->playing) {
+            continue;
+        }
+        if (m->count < PARTY_FRAME_SAMPLES) {
+            // ran dry. go quiet until the buffer fills back up.
+            m->playing = false;
+            metrics_add(METRIC_PARTY_UNDERRUNS, 1);
+            continue;
+        }
+        take_frame(m);
+        mix_add(acc, m->frame, PARTY_FRAME_SAMPLES);
+        m->speaking = true;
+    }
+
+    /* encoding is the expensive part, so every listener's frame goes to their own av worker. */
+    for (unsigned i = 0; i < PARTY_MAX_MEMBERS; i++) {
+        struct member *m = &members[i];
+        if (! m->used) {
+            continue;
+        }
+        struct av_job *job = av_job_get(m->ctx->worker, sizeof(int16_t) * PARTY_FRAME_SAMPLES);
+        if (job == NULL) {
+            log_ratelimited(1000, LOG_ERROR, "oh no, couldn't allocate memory.");
+            continue;
+        }
+        mix_out((int16_t *) job->data, acc, m->speaking ? m->frame : NULL, PARTY_FRAME_SAMPLES);
+        job->kind = AV_JOB_AUDIO;
+        job->toxav = m->toxav;
+        job->friend_num = m->friend_num;
+        job->call = m->ctx;
+        job->sample_count = PARTY_FRAME_SAMPLES;
+        job->channels = 1;
+        job->sampling_rate = PARTY_RATE;
+        av_job_submit(m->ctx->worker, job);
+    }
+}
+
+static void * run_mixer(GCC_UNUSED void *arg) {
+    const uint64_t frame_ns = PARTY_FRAME_MS * 1000000ull;
+    uint64_t next = 0;
+
+    pthread_mutex_lock(&lock);
+    while (! stopping) {
+        if (nmembers == 0) {
+            pthread_cond_wait(&joined, &lock);
+            next = monotonic_ns();
+            continue;
+        }
+        pthread_mutex_unlock(&lock);
+
+        /* ticks are on absolute deadlines so they don't drift, unless we fell a whole frame
+           behind, in which case there's no catching up. */
+        next += frame_ns;
+        const uint64_t now = monotonic_ns();
+        if (now > next + frame_ns) {
+            next = now;
+        }
+        const struct timespec deadline = {(time_t) (next / 1000000000u), (long) (next % 1000000000u)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) != 0) {
+            // interrupted, go back to sleep
+        }
+
+        pthread_mutex_lock(&lock);
+        const uint64_t start = monotonic_ns();
+        mix_tick();
+        metrics_record(METRIC_PARTY_MIX_NS, monotonic_ns() - start);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+bool party_start(void) {
+    assert (members == NULL);
+    members = calloc(PARTY_MAX_MEMBERS, sizeof(struct member));
+    if (members == NULL) {
+        return false;
+    }
+    stopping = false;
+    if (pthread_create(&mixer_thread, NULL, &run_mixer, NULL) != 0) {
+        free(members);
+        members = NULL;
+        return false;
+    }
+    return true;
+}
+
+void party_stop(void) {
+    if (members == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&joined);
+    pthread_mutex_unlock(&lock);
+    pthread_join(mixer_thread, NULL);
+
+    free(members);
+    members = NULL;
+    nmembers = 0;
+}
+
+bool party_join(ToxAV *toxAV, uint32_t friend_num, struct call_ctx *ctx) {
+    assert (ctx->party_slot == 0);
+    pthread_mutex_lock(&lock);
+    for (unsigned i = 0; i < PARTY_MAX_MEMBERS; i++) {
+        struct member *m = &members[i];
+        if (m->used) {
+            continue;
+        }
+        m->used = true;
+        m->toxav = toxAV;
+        m->friend_num = friend_num;
+        m->ctx = ctx;
+        m->head = 0;
+        m->count = 0;
+        m->playing = false;
+        ctx->party_slot = i + 1;
+        if (nmembers++ == 0) {
+            pthread_cond_signal(&joined);
+        }
+        pthread_mutex_unlock(&lock);
+        logger("friend %u joined the party line, %u on it now", friend_num, nmembers);
+        return true;
+    }
+    pthread_mutex_unlock(&lock);
+    return false;
+}
+
+void party_leave(struct call_ctx *ctx) {
+    if (ctx->party_slot == 0) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    struct member *m = &members[ctx->party_slot - 1];
+    assert (m->used && m->ctx == ctx);
+    m->used = false;
+    nmembers--;
+    pthread_mutex_unlock(&lock);
+    ctx->party_slot = 0;
+}
+
+void party_push(struct call_ctx *ctx, const int16_t *pcm, size_t sample_count, uint8_t channels,
+                uint32_t sampling_rate) {
+    assert (ctx->party_slot != 0);
+    if (sampling_rate != PARTY_RATE || channels == 0 || channels > 2) {
+        log_ratelimited(1000, LOG_WARN, "can't mix %u channels at %u Hz into the party line",
+                channels, sampling_rate);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    struct member *m = &members[ctx->party_slot - 1];
+    if (sample_count > BUFFER_SAMPLES) {
+        pcm += (sample_count - BUFFER_SAMPLES) * channels;
+        sample_count = BUFFER_SAMPLES;
+    }
+    // make room by dropping the oldest, a member who is too far behind is no use to anyone
+    if (m->count + sample_count > BUFFER_SAMPLES) {
+        const size_t drop = m->count + sample_count - BUFFER_SAMPLES;
+        m->head = (m->head + drop) % BUFFER_SAMPLES;
+        m->count -= drop;
+        metrics_add(METRIC_PARTY_OVERRUNS, 1);
+    }
+    size_t tail = (m->head + m->count) % BUFFER_SAMPLES;
+    for (size_t i = 0; i < sample_count; i++) {
+        // stereo is folded down to mono
+        m->buffer[tail] = channels == 1 ? pcm[i] : (int16_t) (((int32_t) pcm[2 * i] + pcm[2 * i + 1]) / 2);
+        tail = tail + 1 == BUFFER_SAMPLES ? 0 : tail + 1;
+    }
+    m->count += sample_count;
+    pthread_mutex_unlock(&lock);
+}
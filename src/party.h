@@ -0,0 +1,38 @@
+#pragma once
+
+#include "calls.h"
+
+#include <tox/toxav.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* the party line: audio calls that asked for it hear everyone else on the line rather than
+   themselves. the toxav threads feed each member's audio into a jitter buffer of their own,
+   and a mixer thread takes one frame out of every buffer each tick, sums them once, and hands
+   every member the sum minus their own frame to encode and send on their av worker. */
+
+#define PARTY_MAX_MEMBERS 64
+#define PARTY_RATE 48000
+#define PARTY_FRAME_MS 20
+#define PARTY_FRAME_SAMPLES (PARTY_RATE / 1000 * PARTY_FRAME_MS)
+// past this much buffered audio a member's oldest is dropped
+#define PARTY_BUFFER_MS 200
+// a member is only mixed in once this much is buffered, so one late packet doesn't cut them up
+#define PARTY_PRIME_MS 60
+
+// start the mixer thread. it sleeps while the line is empty.
+bool party_start(void);
+
+void party_stop(void);
+
+// toxav thread. false if the line is full.
+bool party_join(ToxAV *toxAV, uint32_t friend_num, struct call_ctx *ctx);
+
+// toxav thread
+void party_leave(struct call_ctx *ctx);
+
+// toxav thread, with the audio of a member's call
+void party_push(struct call_ctx *ctx, const int16_t *pcm, size_t sample_count, uint8_t channels,
+                uint32_t sampling_rate);
@@ -0,0 +1,145 @@
+#include "plane_copy.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PLANE_COPY_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PLANE_COPY_NEON
+#endif
+
+typedef void (*copy_row_fn)(uint8_t *dst, const uint8_t *src, size_t len);
+
+static void copy_row_scalar(uint8_t *dst, const uint8_t *src, size_t len) {
+    memcpy(dst, src, len);
+}
+
+#ifdef PLANE_COPY_X86
+__attribute__((target("sse2")))
+static void copy_row_sse2(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *) (src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *) (src + i + 48));
+        _mm_storeu_si128((__m128i *) (dst + i), a);
+        _mm_storeu_si128((__m128i *) (dst + i + 16), b);
+        _mm_storeu_si128((__m128i *) (dst + i + 32), c);
+        _mm_storeu_si128((__m128i *) (dst + i + 48), d);
+    }
+    for (; i + 16 <= len; i += 16) {
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_loadu_si128((const __m128i *) (src + i)));
+    }
+    memcpy(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void copy_row_avx2(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_loadu_si256((const __m256i *) (src + i)));
+        _mm256_storeu_si256((__m256i *) (dst + i + 32), _mm256_loadu_si256((const __m256i *) (src + i + 32)));
+    }
+    if (i + 32 <= len) {
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_loadu_si256((const __m256i *) (src + i)));
+        i += 32;
+    }
+    memcpy(dst + i, src + i, len - i);
+}
+#endif
+
+#ifdef PLANE_COPY_NEON
+static void copy_row_neon(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint8x16_t a = vld1q_u8(src + i);
+        uint8x16_t b = vld1q_u8(src + i + 16);
+        uint8x16_t c = vld1q_u8(src + i + 32);
+        uint8x16_t d = vld1q_u8(src + i + 48);
+        vst1q_u8(dst + i, a);
+        vst1q_u8(dst + i + 16, b);
+        vst1q_u8(dst + i + 32, c);
+        vst1q_u8(dst + i + 48, d);
+    }
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8(dst + i, vld1q_u8(src + i));
+    }
+    memcpy(dst + i, src + i, len - i);
+}
+#endif
+
+static const struct kernel {
+    const char * const name;
+    const copy_row_fn fn;
+} kernels[] = {
+#ifdef PLANE_COPY_X86
+    {"avx2", copy_row_avx2},
+    {"sse2", copy_row_sse2},
+#endif
+#ifdef PLANE_COPY_NEON
+    {"neon", copy_row_neon},
+#endif
+    {"scalar", copy_row_scalar},
+};
+
+static const struct kernel * current = &kernels[sizeof(kernels)/sizeof(kernels[0]) - 1];
+
+static bool kernel_supported(const struct kernel *k) {
+#ifdef PLANE_COPY_X86
+    if (k->fn == copy_row_avx2) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (k->fn == copy_row_sse2) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    (void) k;
+    return true;
+}
+
+void plane_copy_init(void) {
+#ifdef PLANE_COPY_X86
+    __builtin_cpu_init();
+#endif
+    /* the table is ordered fastest first. */
+    for (size_t i = 0; i < sizeof(kernels)/sizeof(kernels[0]); i++) {
+        if (kernel_supported(&kernels[i])) {
+            current = &kernels[i];
+            return;
+        }
+    }
+}
+
+bool plane_copy_select(const char *name) {
+#ifdef PLANE_COPY_X86
+    __builtin_cpu_init();
+#endif
+    for (size_t i = 0; i < sizeof(kernels)/sizeof(kernels[0]); i++) {
+        if (strcmp(kernels[i].name, name) == 0 && kernel_supported(&kernels[i])) {
+            current = &kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+const char * plane_copy_kernel_name(void) {
+    return current->name;
+}
+
+void plane_copy(uint8_t *dst, const uint8_t *src, int32_t stride, size_t width, size_t rows) {
+    const copy_row_fn copy_row = current->fn;
+
+    if (stride >= 0 && (size_t) stride == width) {
+        /* no padding, the whole plane is one contiguous run. */
+        copy_row(dst, src, width * rows);
+        return;
+    }
+
+    for (size_t h = 0; h < rows; h++) {
+        copy_row(&dst[h * width], src + (ptrdiff_t) h * stride, width);
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// pick the fastest row copy kernel this cpu supports. call once before any threads start.
+void plane_copy_init(void);
+
+// force a kernel by name ("scalar", "sse2", "avx2", "neon"). false if this cpu can't run it.
+bool plane_copy_select(const char *name);
+
+const char * plane_copy_kernel_name(void);
+
+/* compact `rows` rows of `width` bytes into dst, which is packed (its stride is width).
+   src points at the top row and successive rows are `stride` bytes apart.
+   stride is negative when the image is stored bottom-up. */
+void plane_copy(uint8_t *dst, const uint8_t *src, int32_t stride, size_t width, size_t rows);
@@ -0,0 +1,443 @@
+#include "profile.h"
+
+#include "globals.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// per shard, tox thread only
+static bool dirty[MAX_SHARDS];
+static uint64_t dirty_since[MAX_SHARDS];
+
+// a snapshot per shard waiting for the saver, guarded by saver_lock
+static uint8_t *pending_data[MAX_SHARDS];
+static size_t pending_size[MAX_SHARDS];
+// a small file of the shard's own for the saver, see profile_write_file
+static const char *pending_file_name[MAX_SHARDS];
+static uint8_t *pending_file_data[MAX_SHARDS];
+static size_t pending_file_size[MAX_SHARDS];
+static bool saver_stopping = false;
+static bool saver_running = false;
+static pthread_t saver_thread;
+static pthread_mutex_t saver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t saver_cond = PTHREAD_COND_INITIALIZER;
+
+static atomic_uint_fast64_t stat_saves = 0;
+static atomic_uint_fast64_t stat_failures = 0;
+static atomic_uint_fast64_t stat_coalesced = 0;
+static atomic_uint_fast64_t stat_last_bytes = 0;
+static atomic_uint_fast64_t stat_last_save_ns = 0;
+static atomic_uint_fast64_t stat_max_save_ns = 0;
+static atomic_uint_fast64_t stat_total_bytes = 0;
+
+char * set_data_path(unsigned shard) {
+    const char * home_dir;
+    if ((home_dir = getenv("HOME")) == NULL) {
+        struct passwd * pwuid = getpwuid(getuid());
+        if (! pwuid) {
+            logger("unable to find home directory; saving to a temporary location.");
+            home_dir = "/tmp";
+        } else {
+            home_dir = pwuid->pw_dir;
+        }
+    }
+    assert(home_dir != NULL);
+
+    char * cache_dir;
+    int asprintf_success = asprintf(&cache_dir, "%s/.cache", home_dir);
+    if (asprintf_success == -1) {
+        logger("problem with asprintf, possible memory shortage.");
+        exit(EXIT_FAILURE);
+    }
+    assert(cache_dir != NULL);
+
+    const int cache_dir_perms = S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH; /* 755 */
+    const int cache_dir_exists = mkdir(cache_dir, cache_dir_perms);
+    if (cache_dir_exists != 0 && errno != EEXIST) {
+        logger("problem creating cache directory.");
+        exit(EXIT_FAILURE);
+    }
+
+    // the first shard keeps the name mrprickles always had
+    char * file_name;
+    asprintf_success = shard == 0 ? asprintf(&file_name, "%s/tox_mrprickles", cache_dir)
+                                  : asprintf(&file_name, "%s/tox_mrprickles.%u", cache_dir, shard);
+    free(cache_dir);
+    if (asprintf_success == -1) {
+        logger("problem with asprintf, possible memory shortage, value: %d", asprintf_success);
+        exit(EXIT_FAILURE);
+    }
+
+    // the caller keeps it in the shard, where the save routines look for it
+    assert(file_name != NULL);
+    return file_name;
+}
+
+// a tox savedata file starts with a zero word and then this cookie, both little endian
+#define SAVEDATA_COOKIE 0x15ed1b1fu
+#define SAVEDATA_HEADER_SIZE 8
+// far more than any real friend list needs; anything bigger is not a profile
+#define SAVEDATA_MAX_SIZE (256u * 1024 * 1024)
+
+static bool read_all(int fd, uint8_t *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t got = read(fd, data + done, size - done);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            // an error, or the file shrank underneath us
+            return false;
+        }
+        done += (size_t) got;
+    }
+    return true;
+}
+
+static bool looks_like_savedata(const uint8_t *data, size_t size) {
+    if (size < SAVEDATA_HEADER_SIZE) {
+        return false;
+    }
+    const uint32_t zero = (uint32_t) data[0] | (uint32_t) data[1] << 8
+                        | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+    const uint32_t cookie = (uint32_t) data[4] | (uint32_t) data[5] << 8
+                          | (uint32_t) data[6] << 16 | (uint32_t) data[7] << 24;
+    return zero == 0 && cookie == SAVEDATA_COOKIE;
+}
+
+/* the savedata is mapped read-only and handed to tox_new as it is, which parses it once and keeps nothing.
+   if the file can't be mapped it is read into a buffer instead. */
+TOX_ERR_NEW load_profile(Tox **tox, struct Tox_Options *options, const char * const filename) {
+    const int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // this should never happen...
+        logger("could not open file %s: %s", filename, strerror(errno));
+        return TOX_ERR_NEW_LOAD_BAD_FORMAT;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        logger("could not stat %s: %s", filename, strerror(errno));
+        close(fd);
+        return TOX_ERR_NEW_LOAD_BAD_FORMAT;
+    }
+    if (! S_ISREG(st.st_mode) || st.st_size < SAVEDATA_HEADER_SIZE || st.st_size > SAVEDATA_MAX_SIZE) {
+        logger("%s is not a plausible profile (%lld bytes)", filename, (long long) st.st_size);
+        close(fd);
+        return TOX_ERR_NEW_LOAD_BAD_FORMAT;
+    }
+    const size_t size = (size_t) st.st_size;
+
+    bool mapped = true;
+    uint8_t *save_data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (save_data == MAP_FAILED) {
+        log_at(LOG_WARN, "could not map %s (%s), reading it instead", filename, strerror(errno));
+        mapped = false;
+        save_data = malloc(size);
+        errno = 0;
+        if (save_data == NULL || ! read_all(fd, save_data, size)) {
+            logger("could not read %s: %s", filename, errno != 0 ? strerror(errno) : "short read");
+            free(save_data);
+            close(fd);
+            return TOX_ERR_NEW_LOAD_BAD_FORMAT;
+        }
+    } else {
+        madvise(save_data, size, MADV_WILLNEED);
+    }
+    // a mapping stays valid after the descriptor is closed
+    close(fd);
+
+    TOX_ERR_NEW err = TOX_ERR_NEW_LOAD_BAD_FORMAT;
+    if (looks_like_savedata(save_data, size)) {
+        startup_mark("profile load");
+        options->savedata_data = save_data;
+        options->savedata_type = TOX_SAVEDATA_TYPE_TOX_SAVE;
+        options->savedata_length = size;
+
+        *tox = tox_new(options, &err);
+        startup_mark("tox_new");
+
+        options->savedata_data = NULL;
+        options->savedata_type = TOX_SAVEDATA_TYPE_NONE;
+        options->savedata_length = 0;
+    } else {
+        logger("%s does not start with a tox savedata header", filename);
+    }
+
+    if (mapped) {
+        munmap(save_data, size);
+    } else {
+        free(save_data);
+    }
+    return err;
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= (size_t) written;
+    }
+    return true;
+}
+
+// the rename is only durable once the directory holding the file is synced too
+static void sync_parent_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? strdup(".") : strndup(path, (size_t) (slash - path) + 1);
+    if (dir == NULL) {
+        return;
+    }
+    const int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+bool replace_file(const char *data_filename, const uint8_t *data, size_t size) {
+    assert (data_filename != NULL);
+
+    char *temp_name;
+    if (asprintf(&temp_name, "%s.tmp", data_filename) == -1) {
+        logger("problem with asprintf, possible memory shortage.");
+        return false;
+    }
+
+    bool ok = false;
+    const int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        logger("could not open %s: %s", temp_name, strerror(errno));
+    } else {
+        ok = write_all(fd, data, size) && fsync(fd) == 0;
+        if (! ok) {
+            logger("could not write %s: %s", temp_name, strerror(errno));
+        }
+        if (close(fd) != 0) {
+            ok = false;
+        }
+        if (ok && rename(temp_name, data_filename) != 0) {
+            logger("could not replace %s: %s", data_filename, strerror(errno));
+            ok = false;
+        }
+        if (ok) {
+            sync_parent_dir(data_filename);
+        } else {
+            unlink(temp_name);
+        }
+    }
+    free(temp_name);
+    return ok;
+}
+
+static bool timed_write(const char *data_filename, const uint8_t *data, size_t size) {
+    const uint64_t start = monotonic_ns();
+    const bool ok = replace_file(data_filename, data, size);
+    const uint64_t elapsed = monotonic_ns() - start;
+
+    if (! ok) {
+        atomic_fetch_add(&stat_failures, 1);
+        logger("could not write data");
+        return false;
+    }
+
+    atomic_fetch_add(&stat_saves, 1);
+    atomic_fetch_add(&stat_total_bytes, size);
+    atomic_store(&stat_last_bytes, size);
+    atomic_store(&stat_last_save_ns, elapsed);
+    uint_fast64_t max = atomic_load(&stat_max_save_ns);
+    while (elapsed > max && ! atomic_compare_exchange_weak(&stat_max_save_ns, &max, elapsed)) {
+    }
+    logger("data written (%zu bytes in %" PRIu64 " us).", size, elapsed / 1000);
+    return true;
+}
+
+static uint8_t * snapshot(Tox *tox, size_t *size) {
+    *size = tox_get_savedata_size(tox);
+    uint8_t *data = malloc(*size);
+    if (data != NULL) {
+        tox_get_savedata(tox, data);
+    }
+    return data;
+}
+
+static void * run_saver(GCC_UNUSED void *arg) {
+    pthread_mutex_lock(&saver_lock);
+    while (true) {
+        unsigned shard = 0;
+        while (true) {
+            for (shard = 0; shard < g_nshards && pending_data[shard] == NULL
+                    && pending_file_data[shard] == NULL; shard++) {
+            }
+            if (shard < g_nshards || saver_stopping) {
+                break;
+            }
+            pthread_cond_wait(&saver_cond, &saver_lock);
+        }
+        if (shard == g_nshards) {
+            break;
+        }
+        if (pending_data[shard] != NULL) {
+            uint8_t *data = pending_data[shard];
+            const size_t size = pending_size[shard];
+            pending_data[shard] = NULL;
+            pthread_mutex_unlock(&saver_lock);
+
+            timed_write(g_shards[shard].data_filename, data, size);
+            free(data);
+        } else {
+            const char *file_name = pending_file_name[shard];
+            uint8_t *data = pending_file_data[shard];
+            const size_t size = pending_file_size[shard];
+            pending_file_data[shard] = NULL;
+            pthread_mutex_unlock(&saver_lock);
+
+            replace_file(file_name, data, size);
+            free(data);
+        }
+
+        pthread_mutex_lock(&saver_lock);
+    }
+    pthread_mutex_unlock(&saver_lock);
+    return NULL;
+}
+
+bool profile_start(void) {
+    assert (! saver_running);
+    saver_stopping = false;
+    if (pthread_create(&saver_thread, NULL, run_saver, NULL) != 0) {
+        logger("could not start the profile saver, saving on the tox thread instead");
+        return false;
+    }
+    saver_running = true;
+    return true;
+}
+
+void profile_mark_dirty(void) {
+    const unsigned shard = shard_current()->index;
+    if (! dirty[shard]) {
+        dirty[shard] = true;
+        dirty_since[shard] = monotonic_ns();
+    }
+}
+
+void profile_tick(Tox *tox) {
+    const unsigned shard = shard_current()->index;
+    if (! dirty[shard] || monotonic_ns() - dirty_since[shard] < PROFILE_SAVE_DELAY_MS * 1000000ull) {
+        return;
+    }
+    dirty[shard] = false;
+
+    if (! saver_running) {
+        save_profile(tox);
+        return;
+    }
+
+    size_t size;
+    uint8_t *data = snapshot(tox, &size);
+    if (data == NULL) {
+        logger("out of memory taking a profile snapshot");
+        profile_mark_dirty();
+        return;
+    }
+
+    pthread_mutex_lock(&saver_lock);
+    if (pending_data[shard] != NULL) {
+        // the saver is still busy with an older one; only the newest matters
+        free(pending_data[shard]);
+        atomic_fetch_add(&stat_coalesced, 1);
+    }
+    pending_data[shard] = data;
+    pending_size[shard] = size;
+    pthread_cond_signal(&saver_cond);
+    pthread_mutex_unlock(&saver_lock);
+}
+
+void profile_write_file(const char *filename, uint8_t *data, size_t size) {
+    if (! saver_running) {
+        replace_file(filename, data, size);
+        free(data);
+        return;
+    }
+
+    const unsigned shard = shard_current()->index;
+    pthread_mutex_lock(&saver_lock);
+    // only the newest matters
+    free(pending_file_data[shard]);
+    pending_file_name[shard] = filename;
+    pending_file_data[shard] = data;
+    pending_file_size[shard] = size;
+    pthread_cond_signal(&saver_cond);
+    pthread_mutex_unlock(&saver_lock);
+}
+
+void profile_stop(void) {
+    if (saver_running) {
+        pthread_mutex_lock(&saver_lock);
+        saver_stopping = true;
+        pthread_cond_signal(&saver_cond);
+        pthread_mutex_unlock(&saver_lock);
+        pthread_join(saver_thread, NULL);
+        saver_running = false;
+    }
+
+    // the savedata also holds things nobody marks dirty, like known dht nodes, so always save on the way out
+    for (unsigned i = 0; i < g_nshards; i++) {
+        struct shard *shard = &g_shards[i];
+        shard_set_current(shard);
+        save_profile(shard->tox);
+        dirty[i] = false;
+    }
+    shard_set_current(NULL);
+}
+
+bool save_profile(Tox *tox) {
+    size_t size;
+    uint8_t *data = snapshot(tox, &size);
+    if (data == NULL) {
+        logger("could not write data");
+        return false;
+    }
+    const bool ok = timed_write(shard_current()->data_filename, data, size);
+    free(data);
+    return ok;
+}
+
+void profile_get_stats(struct profile_stats *stats) {
+    stats->saves = atomic_load(&stat_saves);
+    stats->failures = atomic_load(&stat_failures);
+    stats->coalesced = atomic_load(&stat_coalesced);
+    stats->last_bytes = atomic_load(&stat_last_bytes);
+    stats->last_save_ns = atomic_load(&stat_last_save_ns);
+    stats->max_save_ns = atomic_load(&stat_max_save_ns);
+    stats->total_bytes = atomic_load(&stat_total_bytes);
+}
+
+void profile_report(char *buf, size_t size) {
+    struct profile_stats stats;
+    profile_get_stats(&stats);
+    snprintf(buf, size, "profile: %" PRIu64 " saves, %" PRIu64 " failed, %" PRIu64 " coalesced, "
+            "last %" PRIu64 " bytes in %" PRIu64 " us, slowest %" PRIu64 " us, %" PRIu64 " bytes total",
+            stats.saves, stats.failures, stats.coalesced, stats.last_bytes, stats.last_save_ns / 1000,
+            stats.max_save_ns / 1000, stats.total_bytes);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <tox/tox.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* profiles are written by a saver thread. a shard's tox thread only marks its profile dirty;
+   once it has been dirty for PROFILE_SAVE_DELAY_MS the tox thread takes a snapshot and hands it over,
+   so a burst of changes costs one save. each save goes to a temporary file which is synced
+   and then renamed over the old profile, so a crash leaves either the old profile or the new one. */
+
+#define PROFILE_SAVE_DELAY_MS 2000
+
+struct profile_stats {
+    uint64_t saves;
+    uint64_t failures;
+    uint64_t coalesced;     // snapshots replaced before the saver got to them
+    uint64_t last_bytes;
+    uint64_t last_save_ns;
+    uint64_t max_save_ns;
+    uint64_t total_bytes;
+};
+
+// the profile path under ~/.cache for a shard. the caller keeps it in the shard and frees it at exit.
+char * set_data_path(unsigned shard);
+
+TOX_ERR_NEW load_profile(Tox **tox, struct Tox_Options *options, const char * const data_filename);
+
+bool profile_start(void);
+
+// cheap; call on the tox thread whenever something that lives in the savedata changes
+void profile_mark_dirty(void);
+
+// tox thread, once per iteration
+void profile_tick(Tox *tox);
+
+// waits for the saver to finish whatever it was given, then saves every shard synchronously.
+// the tox threads must no longer be running.
+void profile_stop(void);
+
+// write data to a temporary file, sync it and rename it over filename, as profiles are saved
+bool replace_file(const char *filename, const uint8_t *data, size_t size);
+
+/* the same, on the saver thread, for a small file the shard keeps next to its profile. takes
+   the malloced data. a newer file replaces one still waiting, so each shard can have only one
+   file, which must outlive the saver. tox thread. */
+void profile_write_file(const char *filename, uint8_t *data, size_t size);
+
+// saves the current shard right now on the calling thread
+bool save_profile(Tox *tox);
+
+void profile_get_stats(struct profile_stats *stats);
+
+void profile_report(char *buf, size_t size);
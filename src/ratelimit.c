@@ -0,0 +1,181 @@
+#include "ratelimit.h"
+
+#include "globals.h"
+#include "metrics.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* a token is TOKEN units, so a rate of n a minute adds n units a millisecond
+   and nothing needs floating point or a division. */
+#define TOKEN 60000u
+
+struct limit {
+    uint32_t per_minute; // 0 means unlimited
+    uint32_t burst;
+};
+
+struct bucket {
+    uint32_t level;
+    uint32_t stamp_ms; // 0 for a bucket nobody has used yet
+};
+
+struct limits {
+    struct limit friend;
+    struct limit everyone;
+};
+
+static struct limits limits[LIMIT_CLASSES] = {
+    [LIMIT_MESSAGE]    = {{120, 20}, {3000, 200}},
+    [LIMIT_CALL]       = {{6, 2},    {60, 10}},
+    [LIMIT_REQUEST]    = {{0, 1},    {60, 20}}, // nobody has a bucket of their own
+    [LIMIT_CONFERENCE] = {{60, 10}, {600, 50}},
+};
+
+static const char * const env_names[LIMIT_CLASSES] = {
+    [LIMIT_MESSAGE]    = "MRPRICKLES_LIMIT_MESSAGE",
+    [LIMIT_CALL]       = "MRPRICKLES_LIMIT_CALL",
+    [LIMIT_REQUEST]    = "MRPRICKLES_LIMIT_REQUEST",
+    [LIMIT_CONFERENCE] = "MRPRICKLES_LIMIT_CONFERENCE",
+};
+
+static const enum metric_counter refused_metrics[LIMIT_CLASSES] = {
+    [LIMIT_MESSAGE]    = METRIC_MESSAGES_LIMITED,
+    [LIMIT_CALL]       = METRIC_CALLS_LIMITED,
+    [LIMIT_REQUEST]    = METRIC_REQUESTS_LIMITED,
+    [LIMIT_CONFERENCE] = METRIC_CONFERENCE_MESSAGES_LIMITED,
+};
+
+struct limiter {
+    // indexed by friend number, 16 bytes a friend
+    struct bucket (*friends)[LIMIT_REQUEST];
+    uint32_t size;
+    // indexed by conference number
+    struct bucket *conferences;
+    uint32_t nconferences;
+    struct bucket everyone[LIMIT_CLASSES];
+};
+
+// one per shard
+static struct limiter limiters[MAX_SHARDS];
+
+static struct limiter * limiter(void) {
+    assert (shard_current() != NULL);
+    return &limiters[shard_current()->index];
+}
+
+void ratelimit_init(void) {
+    for (unsigned i = 0; i < LIMIT_CLASSES; i++) {
+        const char *value = getenv(env_names[i]);
+        if (value == NULL) {
+            continue;
+        }
+        struct limits l;
+        if (sscanf(value, "%u,%u,%u,%u", &l.friend.per_minute, &l.friend.burst,
+                    &l.everyone.per_minute, &l.everyone.burst) != 4
+                || l.friend.burst == 0 || l.everyone.burst == 0
+                || l.friend.burst > UINT32_MAX / TOKEN || l.everyone.burst > UINT32_MAX / TOKEN) {
+            logger("ignoring %s, it should be four numbers like \"120,20,3000,200\"", env_names[i]);
+            continue;
+        }
+        limits[i] = l;
+    }
+}
+
+// bring the bucket up to now. true if it holds a whole token, which debit may then take.
+static bool refill(struct bucket *b, const struct limit *l, uint32_t now_ms) {
+    if (l->per_minute == 0) {
+        return true;
+    }
+    const uint64_t capacity = (uint64_t) l->burst * TOKEN;
+    uint64_t level = capacity;
+    if (b->stamp_ms != 0) {
+        // unsigned, so this survives the clock wrapping every 49 days
+        const uint32_t elapsed = now_ms - b->stamp_ms;
+        level = b->level + (uint64_t) elapsed * l->per_minute;
+        if (level > capacity) {
+            level = capacity;
+        }
+    }
+    b->stamp_ms = now_ms ? now_ms : 1;
+    b->level = (uint32_t) level;
+    return level >= TOKEN;
+}
+
+static void debit(struct bucket *b, const struct limit *l) {
+    if (l->per_minute != 0) {
+        b->level -= TOKEN;
+    }
+}
+
+/* both buckets must have a token before either is debited, so one noisy friend can't drain
+   everyone's, and a friend isn't charged for what the shared bucket refused. */
+static bool allow(enum limit_class limit, struct bucket *own, struct limiter *lim) {
+    const uint32_t now_ms = (uint32_t) (monotonic_ns() / 1000000u);
+    const bool own_ok = own == NULL || refill(own, &limits[limit].friend, now_ms);
+    if (own_ok && refill(&lim->everyone[limit], &limits[limit].everyone, now_ms)) {
+        if (own != NULL) {
+            debit(own, &limits[limit].friend);
+        }
+        debit(&lim->everyone[limit], &limits[limit].everyone);
+        return true;
+    }
+    metrics_add(refused_metrics[limit], 1);
+    return false;
+}
+
+// *array has a slot for index afterwards, unless memory ran out
+static bool reserve(void **array, uint32_t *size, size_t elem_size, uint32_t index) {
+    if (index < *size) {
+        return true;
+    }
+    uint32_t new_size = *size ? *size : 64;
+    while (new_size <= index) {
+        new_size *= 2;
+    }
+    char *grown = realloc(*array, new_size * elem_size);
+    if (grown == NULL) {
+        logger("oh no, couldn't allocate memory.");
+        return false;
+    }
+    memset(grown + *size * elem_size, 0, (new_size - *size) * elem_size);
+    *array = grown;
+    *size = new_size;
+    return true;
+}
+
+bool ratelimit_allow(enum limit_class limit, uint32_t friend_num) {
+    assert (limit < LIMIT_REQUEST);
+    struct limiter *lim = limiter();
+    // without memory for the friend's bucket, the shared one still applies
+    struct bucket *own = reserve((void **) &lim->friends, &lim->size, sizeof(*lim->friends), friend_num)
+        ? &lim->friends[friend_num][limit] : NULL;
+    return allow(limit, own, lim);
+}
+
+/* a stranger is only a public key, and anyone can mint as many of those as they like, so
+   buckets per stranger would limit nobody. only the shared bucket applies. */
+bool ratelimit_allow_request(void) {
+    return allow(LIMIT_REQUEST, NULL, limiter());
+}
+
+bool ratelimit_allow_conference(uint32_t conference_num) {
+    struct limiter *lim = limiter();
+    struct bucket *own = reserve((void **) &lim->conferences, &lim->nconferences, sizeof(*lim->conferences),
+            conference_num) ? &lim->conferences[conference_num] : NULL;
+    return allow(LIMIT_CONFERENCE, own, lim);
+}
+
+void ratelimit_free(void) {
+    for (unsigned i = 0; i < MAX_SHARDS; i++) {
+        free(limiters[i].friends);
+        free(limiters[i].conferences);
+        limiters[i].friends = NULL;
+        limiters[i].conferences = NULL;
+        limiters[i].size = 0;
+        limiters[i].nconferences = 0;
+    }
+}
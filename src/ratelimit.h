@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* token buckets, one per friend and one for everyone for each class of thing people can make
+   us do. a friend over their limit, or everyone together over the shared one, is ignored.
+   each shard has its own buckets, all touched only by its tox thread, so there is no locking.
+
+   MRPRICKLES_LIMIT_MESSAGE      per friend per minute, burst, everyone per minute, burst
+   MRPRICKLES_LIMIT_CALL         (say "120,20,3000,200"; 0 per minute means no limit)
+   MRPRICKLES_LIMIT_REQUEST      (only everyone's numbers count)
+   MRPRICKLES_LIMIT_CONFERENCE   per conference rather than per friend */
+
+enum limit_class {
+    LIMIT_MESSAGE,
+    LIMIT_CALL,
+    // friend requests. strangers have only their keys, which cost nothing, so they share one bucket.
+    LIMIT_REQUEST,
+    // messages in a conference, by conference number
+    LIMIT_CONFERENCE,
+    LIMIT_CLASSES
+};
+
+// read the limits from the environment. call before the tox threads start.
+void ratelimit_init(void);
+
+// true if the friend may have one more. counts a refusal in the metrics.
+bool ratelimit_allow(enum limit_class limit, uint32_t friend_num);
+
+// the same for a friend request, from anyone
+bool ratelimit_allow_request(void);
+
+// the same for a message in a conference
+bool ratelimit_allow_conference(uint32_t conference_num);
+
+// every shard's buckets
+void ratelimit_free(void);
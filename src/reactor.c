@@ -0,0 +1,155 @@
+#include "reactor.h"
+
+#include "util.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+#ifdef MRPRICKLES_REACTOR
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+static bool watch(struct reactor *r, int fd) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    return epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool reactor_init(struct reactor *r) {
+    r->signal_fd = -1;
+    r->on_signal = NULL;
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (r->epoll_fd == -1 || r->timer_fd == -1 || r->event_fd == -1
+            || ! watch(r, r->timer_fd) || ! watch(r, r->event_fd)) {
+        logger("could not set up reactor: %s", strerror(errno));
+        reactor_close(r);
+        return false;
+    }
+    return true;
+}
+
+void reactor_close(struct reactor *r) {
+    const int fds[] = {r->signal_fd, r->event_fd, r->timer_fd, r->epoll_fd};
+    for (size_t i = 0; i < sizeof(fds)/sizeof(fds[0]); i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    r->epoll_fd = r->timer_fd = r->event_fd = r->signal_fd = -1;
+}
+
+bool reactor_watch_signals(struct reactor *r, void (*handler)(int sig)) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+
+    /* threads inherit this mask, so the signals only ever show up on the signalfd. */
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+        return false;
+    }
+    r->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (r->signal_fd == -1 || ! watch(r, r->signal_fd)) {
+        logger("could not set up signalfd: %s", strerror(errno));
+        return false;
+    }
+    r->on_signal = handler;
+    return true;
+}
+
+void reactor_wait(struct reactor *r, uint64_t deadline_ns) {
+    if (deadline_ns != 0) {
+        struct itimerspec when = {
+            .it_interval = {0, 0},
+            .it_value = {
+                .tv_sec = (time_t) (deadline_ns / 1000000000u),
+                .tv_nsec = (long) (deadline_ns % 1000000000u),
+            },
+        };
+        if (when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0) {
+            when.it_value.tv_nsec = 1; // all zeroes would disarm the timer
+        }
+        timerfd_settime(r->timer_fd, TFD_TIMER_ABSTIME, &when, NULL);
+    }
+
+    struct epoll_event events[3];
+    int n;
+    do {
+        n = epoll_wait(r->epoll_fd, events, sizeof(events)/sizeof(events[0]), -1);
+    } while (n == -1 && errno == EINTR);
+
+    for (int i = 0; i < n; i++) {
+        const int fd = events[i].data.fd;
+        if (fd == r->timer_fd) {
+            uint64_t expirations;
+            (void) ! read(fd, &expirations, sizeof(expirations));
+        } else if (fd == r->event_fd) {
+            uint64_t wakeups;
+            (void) ! read(fd, &wakeups, sizeof(wakeups));
+        } else if (fd == r->signal_fd) {
+            struct signalfd_siginfo info;
+            while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+                r->on_signal((int) info.ssi_signo);
+            }
+        }
+    }
+
+    if (deadline_ns != 0) {
+        /* disarm, so an early wakeup doesn't leave a stale expiry for the next wait. */
+        const struct itimerspec off = {{0, 0}, {0, 0}};
+        timerfd_settime(r->timer_fd, 0, &off, NULL);
+    }
+}
+
+void reactor_wake(struct reactor *r) {
+    const uint64_t one = 1;
+    (void) ! write(r->event_fd, &one, sizeof(one));
+}
+
+#else
+
+bool reactor_init(struct reactor *r) {
+    r->epoll_fd = r->timer_fd = r->event_fd = r->signal_fd = -1;
+    r->on_signal = NULL;
+    return true;
+}
+
+void reactor_close(struct reactor *r) {
+    (void) r;
+}
+
+bool reactor_watch_signals(struct reactor *r, void (*handler)(int sig)) {
+    struct sigaction new_action;
+    sigemptyset(&new_action.sa_mask);
+    new_action.sa_handler = handler;
+    new_action.sa_flags = 0;
+    r->on_signal = handler;
+    return sigaction(SIGINT, &new_action, NULL) == 0
+        && sigaction(SIGTERM, &new_action, NULL) == 0;
+}
+
+void reactor_wait(struct reactor *r, uint64_t deadline_ns) {
+    (void) r;
+    if (deadline_ns == 0) {
+        pause();
+        return;
+    }
+    const uint64_t now = monotonic_ns();
+    if (deadline_ns > now) {
+        usleep((useconds_t) ((deadline_ns - now) / 1000));
+    }
+}
+
+void reactor_wake(struct reactor *r) {
+    (void) r;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* sleeps a thread until its next iteration is due or until another thread has work for it.
+   built on epoll, timerfd, eventfd and signalfd when compiled with MRPRICKLES_REACTOR,
+   otherwise it falls back to usleep and pause like mrprickles always did. */
+struct reactor {
+    int epoll_fd;
+    int timer_fd;
+    int event_fd;
+    int signal_fd;
+    void (*on_signal)(int sig);
+};
+
+bool reactor_init(struct reactor *r);
+
+void reactor_close(struct reactor *r);
+
+/* deliver SIGINT and SIGTERM to handler from within reactor_wait on this reactor.
+   must be called before any other threads are started. */
+bool reactor_watch_signals(struct reactor *r, void (*handler)(int sig));
+
+// block until deadline_ns on the monotonic clock (0 for no deadline), a wakeup or a signal
+void reactor_wait(struct reactor *r, uint64_t deadline_ns);
+
+// safe to call from any thread
+void reactor_wake(struct reactor *r);
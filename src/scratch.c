@@ -0,0 +1,85 @@
+#include "scratch.h"
+
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// allocations that didn't fit in the block, freed at the next reset
+struct spill {
+    struct spill *next;
+    alignas(max_align_t) unsigned char data[];
+};
+
+static _Thread_local struct {
+    unsigned char *block;
+    size_t size;
+    size_t used;
+    struct spill *spills;
+    size_t spilled; // bytes asked for beyond the block since the last reset
+} arena;
+
+#define ALIGN(n) (((n) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+void * scratch_alloc(size_t size) {
+    size = ALIGN(size ? size : 1);
+    if (arena.block == NULL) {
+        arena.block = aligned_alloc(alignof(max_align_t), SCRATCH_BLOCK_BYTES);
+        arena.size = arena.block ? SCRATCH_BLOCK_BYTES : 0;
+    }
+    if (size <= arena.size - arena.used) {
+        void *p = arena.block + arena.used;
+        arena.used += size;
+        return p;
+    }
+
+    struct spill *s = malloc(sizeof(struct spill) + size);
+    if (s == NULL) {
+        return NULL;
+    }
+    s->next = arena.spills;
+    arena.spills = s;
+    arena.spilled += size;
+    return s->data;
+}
+
+void * scratch_calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *p = scratch_alloc(count * size);
+    if (p != NULL) {
+        memset(p, 0, count * size);
+    }
+    return p;
+}
+
+void scratch_reset(void) {
+    if (arena.spills != NULL) {
+        // next time it all fits
+        size_t want = arena.size ? arena.size : SCRATCH_BLOCK_BYTES;
+        while (want < arena.used + arena.spilled) {
+            want *= 2;
+        }
+        while (arena.spills != NULL) {
+            struct spill *next = arena.spills->next;
+            free(arena.spills);
+            arena.spills = next;
+        }
+        unsigned char *block = aligned_alloc(alignof(max_align_t), want);
+        if (block != NULL) {
+            free(arena.block);
+            arena.block = block;
+            arena.size = want;
+        }
+        arena.spilled = 0;
+    }
+    arena.used = 0;
+}
+
+void scratch_free(void) {
+    scratch_reset();
+    free(arena.block);
+    arena.block = NULL;
+    arena.size = 0;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+
+/* a bump allocator per thread for buffers that don't outlive an iteration, like a copy of a
+   message or a list toxcore fills in. allocating bumps a pointer and scratch_reset at the end of
+   the iteration frees everything at once, so the tox threads don't churn malloc for them.
+
+   the block is kept from one iteration to the next. what doesn't fit is malloced on the side,
+   and at the next reset the block grows to fit the whole iteration, so a thread soon stops
+   allocating at all. */
+
+#define SCRATCH_BLOCK_BYTES (16 * 1024)
+
+// NULL if memory ran out. aligned for anything, and good until the thread's next scratch_reset.
+void * scratch_alloc(size_t size);
+
+// the same, zeroed
+void * scratch_calloc(size_t count, size_t size);
+
+// the end of an iteration. nothing from scratch_alloc may be used after this.
+void scratch_reset(void);
+
+// give the thread's memory back. call before the thread returns.
+void scratch_free(void);
@@ -0,0 +1,89 @@
+#include "shard.h"
+
+#include "friends.h"
+#include "globals.h"
+#include "util.h"
+
+#include <assert.h>
+#include <sched.h>
+
+static _Thread_local struct shard *current = NULL;
+
+struct shard * shard_current(void) {
+    return current;
+}
+
+void shard_set_current(struct shard *shard) {
+    current = shard;
+}
+
+struct shard * shard_least_loaded(void) {
+    assert (g_nshards > 0);
+    struct shard *best = &g_shards[0];
+    unsigned best_total = ~0u;
+    for (unsigned i = 0; i < g_nshards; i++) {
+        struct friend_counts counts;
+        friends_count(i, &counts);
+        if (counts.total < best_total) {
+            best = &g_shards[i];
+            best_total = counts.total;
+        }
+    }
+    return best;
+}
+
+// the cores we may run on, in order. -1 until they've been looked up.
+static int allowed[CPU_SETSIZE];
+static int nallowed = -1;
+
+static unsigned allowed_cpus(void) {
+    if (nallowed >= 0) {
+        return (unsigned) nallowed;
+    }
+    nallowed = 0;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        logger("could not tell which cores we may run on, threads won't be pinned");
+        return 0;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            allowed[nallowed++] = cpu;
+        }
+    }
+    return (unsigned) nallowed;
+}
+
+// the first cores, which the shard threads are pinned to
+static unsigned shard_cpus(void) {
+    return g_nshards > 1 ? 2 * g_nshards : 0;
+}
+
+static bool pin(pthread_t thread, int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(thread, sizeof(cpus), &cpus) == 0;
+}
+
+void shard_pin(const struct shard *shard, pthread_t thread, unsigned which) {
+    const unsigned ncpus = allowed_cpus();
+    if (shard_cpus() == 0 || ncpus == 0) {
+        return;
+    }
+    // more shards than cores wrap around and share
+    if (! pin(thread, allowed[(shard->index * 2 + which) % ncpus])) {
+        logger("could not pin a thread of shard %u to a core", shard->index);
+    }
+}
+
+unsigned shard_spare_cpus(void) {
+    const unsigned ncpus = allowed_cpus();
+    return shard_cpus() < ncpus ? ncpus - shard_cpus() : 0;
+}
+
+bool shard_pin_spare(pthread_t thread, unsigned n) {
+    const unsigned spare = shard_spare_cpus();
+    return spare == 0 || pin(thread, allowed[shard_cpus() + n % spare]);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "reactor.h"
+
+#include <tox/tox.h>
+#include <tox/toxav.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* one process can host several profiles, each a shard with its own Tox, ToxAV, savedata
+   and pair of threads. a shard's threads set it as their current shard, and every module
+   that keeps per-profile state (friends, calls, listings, the profile itself...) keeps one copy
+   per shard and works on the current one. */
+
+#define MAX_SHARDS 16
+
+struct shard {
+    unsigned index;
+    Tox *tox;
+    ToxAV *toxav;
+    char *data_filename;
+    // the tox id, for telling people which shard to add
+    char address[TOX_ADDRESS_SIZE * 2 + 1];
+
+    // each thread sleeps in its own reactor, wake one to hand that thread work
+    struct reactor tox_reactor;
+    struct reactor toxav_reactor;
+    pthread_t tox_thread;
+    pthread_t toxav_thread;
+
+    time_t last_info_change; // always a timestring
+    // the status message reset_info picked last
+    size_t status_number;
+};
+
+// NULL on threads that don't belong to a shard
+struct shard * shard_current(void);
+
+void shard_set_current(struct shard *shard);
+
+// the shard with the fewest friends, the one new friends should be sent to
+struct shard * shard_least_loaded(void);
+
+/* threads are pinned to the cores the process may run on, as sched_getaffinity has them at startup.
+   with several shards, each shard's tox and toxav threads get a pair of cores of their own and the
+   av workers share what's left. one shard's threads are left to the scheduler. main thread only. */
+
+// which is 0 for the tox thread, 1 for the toxav thread
+void shard_pin(const struct shard *shard, pthread_t thread, unsigned which);
+
+// cores the shard threads leave for the av workers, 0 if there are none to spare
+unsigned shard_spare_cpus(void);
+
+// pin a thread to the nth spare core, wrapping. does nothing when there are none.
+// false if the thread couldn't be pinned.
+bool shard_pin_spare(pthread_t thread, unsigned n);
@@ -0,0 +1,34 @@
+#include "shutdown.h"
+
+#include "globals.h"
+#include "util.h"
+
+#include <stdatomic.h>
+
+static _Atomic uint64_t deadline_ns = 0;
+static atomic_bool toxav_done[MAX_SHARDS];
+
+void shutdown_begin(void) {
+    atomic_store(&deadline_ns, monotonic_ns() + SHUTDOWN_DRAIN_MS * 1000000ull);
+    for (unsigned i = 0; i < g_nshards; i++) {
+        reactor_wake(&g_shards[i].toxav_reactor);
+        reactor_wake(&g_shards[i].tox_reactor);
+    }
+}
+
+bool shutdown_draining(void) {
+    return atomic_load_explicit(&deadline_ns, memory_order_relaxed) != 0;
+}
+
+uint64_t shutdown_deadline_ns(void) {
+    return atomic_load(&deadline_ns);
+}
+
+void shutdown_toxav_done(struct shard *shard) {
+    atomic_store(&toxav_done[shard->index], true);
+    reactor_wake(&shard->tox_reactor);
+}
+
+bool shutdown_toxav_is_done(const struct shard *shard) {
+    return atomic_load(&toxav_done[shard->index]);
+}
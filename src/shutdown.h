@@ -0,0 +1,29 @@
+#pragma once
+
+#include "shard.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* shutting down without pulling the rug out from under anyone. once it begins nothing new is
+   taken on: messages, calls, files and friend requests are ignored or turned away. each toxav
+   thread hangs up its calls and returns, each tox thread keeps iterating until what's queued to
+   go out is gone, or the drain deadline passes, and returns too. nothing is ever stopped halfway
+   through toxcore, and the profiles are saved once, after. */
+
+#define SHUTDOWN_DRAIN_MS 2000
+// how long past the drain deadline main waits for a thread before giving up on it
+#define SHUTDOWN_GRACE_MS 1000
+
+// main thread. wakes every shard's threads so they notice.
+void shutdown_begin(void);
+
+// any thread. true once shutdown has begun.
+bool shutdown_draining(void);
+
+// on the monotonic clock, 0 until shutdown begins
+uint64_t shutdown_deadline_ns(void);
+
+// the shard's toxav thread has hung up and is returning; its tox thread can stop once drained
+void shutdown_toxav_done(struct shard *shard);
+bool shutdown_toxav_is_done(const struct shard *shard);
@@ -1,30 +1,27 @@
 #pragma once
 
+#include "log.h"
+
 #include <tox/tox.h>
 
 #include <time.h>
 
-void logger(const char * format, ...);
+// nanoseconds on the monotonic clock
+uint64_t monotonic_ns(void);
+
+/* the startup timeline. each mark logs how long it has been since the one before,
+   the last one also logs the total since startup_begin. */
+void startup_begin(void);
+void startup_mark(const char *phase);
+void startup_finish(const char *phase);
 
 void to_hex(char *out, uint8_t *in, int size);
 
+// NULL if memory ran out, otherwise good until scratch_reset
 char * get_tox_ID(Tox * tox);
 
-void bootstrap(Tox * tox);
-
 void get_elapsed_time_str(char *buf, size_t bufsize, time_t secs);
 
 bool file_exists(const char *filename);
 
-char * set_data_path(void);
-
-void save_profile(Tox *tox);
-
-TOX_ERR_NEW load_profile(Tox **tox, struct Tox_Options *options, const char * const data_filename);
-
 void reset_info(Tox * tox);
-
-// str is expected to point to an uninitialized pointer
-void friend_name_from_num(uint8_t **str, Tox *tox, uint32_t friend_num);
-
-uint32_t get_online_friend_count(Tox *tox);